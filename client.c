@@ -8,6 +8,14 @@
  * server which then replies with the contents of the file. In the 
  * non-iteractive mode (when the option '-f' is specified along with
  * a filename) it simply asks for that file from the server and exits.
+ *
+ * The connection is in message mode, so each request and response is one
+ * message.
+ *
+ * With '-n <count>', the whole exchange is repeated over count connections
+ * in turn.  Along with '-F', the connections after the first can then send
+ * the request in the SYN, with the cookie the server handed out on the
+ * first (cookies are only kept for as long as the process runs).
  * 
  */
 
@@ -36,13 +44,20 @@
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
-static char usage[] = "usage: client [-U] [-q] [-f <filename>] server:port\n";
+static char usage[] =
+    "usage: client [-U] [-F] [-z] [-c] [-p] [-q] [-s] [-n <count>] "
+    "[-f <filename>] server:port\n";
 static char *filename;
 static int quiet_opt = 0;
+static int stats_opt = 0;
+static int request_queued = 0;  /* first request written before connecting */
 
 static int parse_address(char *address, struct sockaddr_in *sin);
-static int get_nvt_line(int sd, char *line);
+static int get_response(int sd, char *line, size_t size);
 static void loop_until_end(int sd);
+static void run_connection(struct sockaddr_in *sin, char reliable,
+                           int fastopen, int compress, int crc32c,
+                           int fastpath);
 
 
 /**********************************************************************/
@@ -53,14 +68,18 @@ main(int argc, char *argv[])
     char opt;
     char *pline;
     char reliable = 1;
+    int fastopen = 0;
+    int compress = 0;
+    int crc32c = 0;
+    int fastpath = 0;
+    int count = 1;
     int errflg = 0;
-    int sd;
 
 
 
     filename = NULL;
     /* Parse command line options */
-    while ((opt = getopt(argc, argv, "f:qU")) != EOF)
+    while ((opt = getopt(argc, argv, "f:n:qsUFzcp")) != EOF)
     {
         switch (opt)
         {
@@ -70,11 +89,35 @@ main(int argc, char *argv[])
         case 'q':
             ++quiet_opt;
             break;
+        case 's':
+            ++stats_opt;
+            break;
 
         case 'U':
             reliable = 0;
             break;
 
+        case 'F':
+            fastopen = 1;
+            break;
+
+        case 'z':
+            compress = 1;
+            break;
+
+        case 'c':
+            crc32c = 1;
+            break;
+
+        case 'p':
+            fastpath = 1;
+            break;
+
+        case 'n':
+            if ((count = atoi(optarg)) < 1)
+                ++errflg;
+            break;
+
         case '?':
             ++errflg;
             break;
@@ -101,14 +144,67 @@ main(int argc, char *argv[])
         exit(1);
     }
 
+    while (count-- > 0)
+        run_connection(&sin, reliable, fastopen, compress, crc32c, fastpath);
+
+    if (stats_opt)
+        mypoolstats(stderr);
+
+    return 0;
+}                               /* end main() */
+
+
+/**********************************************************************/
+/* run_connection
+ *
+ * Connect to the server, and exchange requests and responses until the
+ * connection is over
+ */
+static void
+run_connection(struct sockaddr_in *sin, char reliable, int fastopen,
+               int compress, int crc32c, int fastpath)
+{
+    int sd;
+
     if ((sd = mysocket(reliable)) < 0)
     {
         perror("mysocket");
         exit(1);
     }
 
-    sd = myconnect(sd, (struct sockaddr *) &sin, sizeof(struct sockaddr_in));
-    if (sd < 0)
+    if (mysetsockopt(sd, MYSO_MESSAGES, 1) < 0 ||
+        mysetsockopt(sd, MYSO_COMPRESS, compress) < 0 ||
+        mysetsockopt(sd, MYSO_CRC32C, crc32c) < 0 ||
+        mysetsockopt(sd, MYSO_FASTPATH, fastpath) < 0)
+    {
+        perror("mysetsockopt");
+        exit(1);
+    }
+
+    if (fastopen)
+    {
+        if (mysetsockopt(sd, MYSO_FASTOPEN, 1) < 0)
+        {
+            perror("mysetsockopt");
+            exit(1);
+        }
+
+        /* queue the request before the handshake so that it can go out
+         * in the SYN (if we hold a cookie for this server).
+         */
+        if (filename != NULL)
+        {
+            if (mywrite(sd, filename, strlen(filename)) < 0)
+            {
+                perror("mywrite");
+                exit(1);
+            }
+            request_queued = 1;
+        }
+    }
+
+    if (myconnect(sd, (struct sockaddr *) sin,
+                  sizeof(struct sockaddr_in)) < 0)
     {
         perror("myconnect");
         exit(1);
@@ -120,10 +216,7 @@ main(int argc, char *argv[])
     {
         perror("myclose");
     }
-
-    return 0;
-}                               /* end main() */
-
+}
 
 /**********************************************************************/
 /* loop_until_end
@@ -135,7 +228,8 @@ loop_until_end(int sd)
 {
     int errcnd;
     char line[1000];
-    int length, to_read;
+    static char data[MYSOCK_MAX_MESSAGE];
+    int length;
     char *pline, *lenstr, *resp;
     int got;
     FILE *file;
@@ -153,33 +247,32 @@ loop_until_end(int sd)
             if (!fgets(line, sizeof(line), stdin))
                 break;
 
-            /* Remove trailing spaces and add CRLF at the end */
+            /* Remove trailing spaces */
             pline = line + strlen(line) - 1;
             while ((pline > line - 1) && isspace((int) (*pline)))
                 --pline;
 
             if (pline <= line)
                 continue;
+            pline[1] = '\0';
         }
         else
         {
             strcpy(line, filename);
-            pline = line + strlen(line) - 1;
         }
-        *++pline = '\r';
-        *++pline = '\n';
-        *++pline = '\0';
 
-        if (mywrite(sd, line, pline - line) < 0)
+        if (request_queued)
+            request_queued = 0;
+        else if (mywrite(sd, line, strlen(line)) < 0)
         {
             perror("mywrite");
             errcnd = 1;
             break;
         }
 
-        if (get_nvt_line(sd, line) < 0)
+        if (get_response(sd, line, sizeof(line)) < 0)
         {
-            perror("get_nvt_line");
+            perror("get_response");
             errcnd = 1;
             break;
         }
@@ -224,12 +317,11 @@ loop_until_end(int sd)
             errcnd = 1;
             break;
         }
-        /* Retrieve the remote file and write it to a local file */
-        while (length)
+        /* Retrieve the remote file (one message per server write) and
+         * write it to a local file */
+        while (length > 0)
         {
-            to_read = MIN(length, (int) sizeof(line));
-
-            if ((got = myread(sd, line, to_read)) < 0)
+            if ((got = myread(sd, data, sizeof(data))) < 0)
             {
                 perror("myread");
                 errcnd = 1;
@@ -241,14 +333,9 @@ loop_until_end(int sd)
                 break;
             }
 
-            if (got < to_read)
-            {
-                to_read = got;
-            }
-
             if (!quiet_opt)
             {
-                while (0 == fwrite(line, 1, to_read, file))
+                while (0 == fwrite(data, 1, got, file))
                 {
                     if (errno != EINTR)
                     {
@@ -258,7 +345,7 @@ loop_until_end(int sd)
                     }
                 }
             }
-            length -= to_read;
+            length -= got;
         }
 
         if (length)
@@ -336,45 +423,23 @@ cleanup:
 }
 
 /**********************************************************************/
-/* get_nvt_line
+/* get_response
  * 
- * Retrieves the next line of NVT ASCII from mysocket layer.
+ * Retrieves the server's response (one message) from mysocket layer as a
+ * string.
  *
  * Returns 
  *  0 on success
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_response(int sd, char *line, size_t size)
 {
-    char last_char;
-    char this_char;
     int len;
 
-    last_char = '\0';
-    for (;;)
-    {
-        len = myread(sd, &this_char, sizeof(this_char));
-        if (len < 0)
-            return -1;
+    if ((len = myread(sd, line, size - 1)) < 0)
+        return -1;
 
-        if (len == 0)
-        {
-            /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
-            return 0;
-        }
-    /** fprintf(stderr, "read character %c\n", this_char); **/
-
-        if (last_char == '\r' && this_char == '\n')
-        {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
-            return 0;
-        }
-
-        *line++ = this_char;
-        last_char = this_char;
-    }
+    line[len] = '\0';
+    return 0;
 }
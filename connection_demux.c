@@ -69,10 +69,12 @@ static listen_queue_t *_get_connection_queue(mysock_context_t *ctx);
 
 
 /* called by myaccept() to grab the first completed connection off the
- * given mysocket's connection queue, or block until one completes.
+ * given mysocket's connection queue, or block until one completes.  if
+ * block is false, returns FALSE at once if none has completed.
  */
-void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
-                                mysock_context_t **new_ctx)
+bool_t _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
+                                  mysock_context_t **new_ctx,
+                                  bool_t             block)
 {
     listen_queue_t *q;
     completed_connect_t *r;
@@ -88,6 +90,12 @@ void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
     PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
     while (!q->completed_queue)
     {
+        if (!block)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+            PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+            return FALSE;
+        }
         PTHREAD_CALL(pthread_cond_wait(&q->connection_cond,
                                        &q->connection_lock));
     }
@@ -115,6 +123,7 @@ void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
 
     PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+    return TRUE;
 }
 
 static void _debug_print_connection(const char *msg, const char *reason,
@@ -220,6 +229,7 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
+        memcpy(new_ctx->options, ctx->options, sizeof(new_ctx->options));
 
         new_ctx->network_state.peer_addr       = *peer_addr;
         new_ctx->network_state.peer_addr_len   = peer_addr_len;
@@ -301,6 +311,29 @@ void _mysock_passive_connection_complete(mysock_context_t *ctx)
         PTHREAD_CALL(pthread_cond_signal(&q->connection_cond));
     }
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+
+    /* the listening mysocket has a connection to accept */
+    _mysock_poll_notify(_mysock_get_context(ctx->listen_sd));
+}
+
+/* TRUE if myaccept() on the given listening mysocket wouldn't block */
+bool_t _mysock_connection_ready(mysock_context_t *accept_ctx)
+{
+    listen_queue_t *q;
+    bool_t ready = FALSE;
+
+    assert(accept_ctx && accept_ctx->listening);
+
+    PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
+    if ((q = _get_connection_queue(accept_ctx)))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+        ready = (q->completed_queue != NULL);
+        PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+
+    return ready;
 }
 
 /* called by mylisten() to specify the number of pending connection
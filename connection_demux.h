@@ -7,8 +7,9 @@
 
 struct mysock_context;
 
-void _mysock_dequeue_connection(struct mysock_context  *accept_ctx,
-                                struct mysock_context **new_ctx);
+bool_t _mysock_dequeue_connection(struct mysock_context  *accept_ctx,
+                                  struct mysock_context **new_ctx,
+                                  bool_t                  block);
 
 bool_t _mysock_enqueue_connection(struct mysock_context *ctx,
                                   const void            *packet,
@@ -21,6 +22,7 @@ void _mysock_set_backlog(struct mysock_context *ctx, unsigned int backlog);
 void _mysock_close_passive_socket(struct mysock_context *ctx);
 
 void _mysock_passive_connection_complete(struct mysock_context *new_ctx);
+bool_t _mysock_connection_ready(struct mysock_context *accept_ctx);
 
 #endif  /* __CONNECTION_DEMUX_H__ */
 
@@ -0,0 +1,697 @@
+/* fiber.c--fibers switched with ucontext on a pool of worker threads.
+ * see fiber.h.
+ *
+ * each worker has a run queue of fibers ready to go, and a heap of parked
+ * fibers with deadlines, both under the worker's lock.  a fiber belongs
+ * to one worker, its home: it is parked, woken and run there, so a
+ * connection keeps to the processor whose cache holds its state.  a
+ * worker takes the fiber at the head of its run queue and swaps to it;
+ * when the fiber parks or returns, it swaps back, and the worker (now off
+ * the fiber's stack) finishes parking it: onto the heap if it has a
+ * deadline, or straight back onto the run queue if it was woken up
+ * meanwhile.
+ *
+ * a worker with nothing to run steals half the run queue of the busiest
+ * other worker, and becomes the stolen fibers' home.  only if there is
+ * nothing to steal does it wait on its condition variable, until its
+ * earliest deadline.  fibers made runnable on a busy worker nudge an idle
+ * one, to come and steal them.
+ *
+ * fiber_run() lends a parked fiber a thread that isn't a worker: the
+ * thread swaps to it as a worker would, through a fiber_worker_t of its
+ * own (a guest) that only has the context to come back to.  the fiber
+ * keeps its home.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/time.h>
+#include "mysock_impl.h"
+#include "fiber.h"
+
+
+typedef enum
+{
+    FIBER_NEW,          /* not started */
+    FIBER_RUNNABLE,     /* on its home's run queue */
+    FIBER_RUNNING,
+    FIBER_PARKING,      /* swapped back to its worker, to be parked */
+    FIBER_PARKED,
+    FIBER_DONE          /* its function has returned */
+} fiber_state_t;
+
+typedef struct fiber_worker
+{
+    pthread_t  thread;
+    int        index;
+    ucontext_t context;     /* where it waits for fibers to run */
+    fiber_t   *current;
+
+    /* under lock, with the fibers whose home this is */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;           /* work for it, when idle */
+    bool_t          idle;
+    fiber_t        *run_head, *run_tail;
+    int             num_ready;      /* on the run queue */
+    fiber_t       **timer_heap;
+    int             timer_heap_len, timer_heap_size;
+} fiber_worker_t;
+
+struct fiber
+{
+    ucontext_t     context;
+    char          *stack;
+    void        *(*start)(void *arg);
+    void          *arg;
+
+    /* under home->lock.  home itself only changes while the fiber is
+     * runnable, by a worker stealing it, with the old home's lock held.
+     */
+    struct fiber_worker *volatile home;
+    struct fiber_worker *worker;    /* running it (home, or a guest) */
+    fiber_state_t   state;
+    bool_t          wake_pending;   /* woken while not parked */
+    bool_t          timed_out;
+    struct timespec deadline;
+    bool_t          has_deadline;
+    int             heap_index;     /* in home's timer_heap, or -1 */
+    struct fiber   *next;           /* on the run queue */
+
+    bool_t          finished;       /* done, and off its stack (under
+                                     * join_lock) */
+};
+
+static fiber_worker_t fiber_workers[FIBER_MAX_WORKERS];
+static int num_fiber_workers = 0;
+static int fiber_workers_wanted = 0;    /* see fiber_set_workers() */
+static unsigned int next_home = 0;
+static pthread_key_t fiber_key;     /* the calling thread's fiber_worker_t */
+static pthread_once_t fiber_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t join_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t join_cond = PTHREAD_COND_INITIALIZER;   /* a fiber has
+                                                                * finished */
+
+static void fiber_start_workers(void);
+static void *fiber_worker_func(void *arg);
+static void fiber_entry(void);
+static fiber_worker_t *fiber_lock_home(fiber_t *fiber);
+static void fiber_enqueue(fiber_worker_t *worker, fiber_t *fiber);
+static fiber_t *fiber_steal(fiber_worker_t *worker);
+static void fiber_switched_back(fiber_worker_t *home, fiber_t *fiber);
+static void fiber_heap_insert(fiber_worker_t *worker, fiber_t *fiber);
+static void fiber_heap_remove(fiber_worker_t *worker, fiber_t *fiber);
+static int fiber_time_cmp(const struct timespec *a, const struct timespec *b);
+
+
+void fiber_set_workers(int num_workers)
+{
+    assert(num_workers > 0 && num_workers <= FIBER_MAX_WORKERS);
+    assert(!num_fiber_workers);
+    fiber_workers_wanted = num_workers;
+}
+
+fiber_t *fiber_create(void *(*start)(void *arg), void *arg)
+{
+    fiber_t *fiber;
+
+    assert(start);
+    PTHREAD_CALL(pthread_once(&fiber_once, fiber_start_workers));
+
+    fiber = (fiber_t *) calloc(1, sizeof(fiber_t));
+    assert(fiber);
+    fiber->stack = (char *) malloc(FIBER_STACK_SIZE);
+    assert(fiber->stack);
+    fiber->start = start;
+    fiber->arg = arg;
+    fiber->state = FIBER_NEW;
+    fiber->heap_index = -1;
+
+    if (getcontext(&fiber->context) < 0)
+    {
+        assert(0);
+        abort();
+    }
+    fiber->context.uc_stack.ss_sp = fiber->stack;
+    fiber->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, fiber_entry, 0);
+
+    return fiber;
+}
+
+void fiber_start(fiber_t *fiber)
+{
+    fiber_worker_t *home;
+
+    assert(fiber && fiber->state == FIBER_NEW);
+
+    /* new fibers are dealt out to the workers in turn */
+    home = &fiber_workers[__sync_fetch_and_add(&next_home, 1) %
+                          num_fiber_workers];
+    fiber->home = home;
+
+    PTHREAD_CALL(pthread_mutex_lock(&home->lock));
+    fiber_enqueue(home, fiber);
+    PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+}
+
+fiber_t *fiber_self(void)
+{
+    fiber_worker_t *worker;
+
+    if (!num_fiber_workers)
+        return NULL;
+
+    worker = (fiber_worker_t *) pthread_getspecific(fiber_key);
+    return worker ? worker->current : NULL;
+}
+
+bool_t fiber_park(const struct timespec *abstime)
+{
+    fiber_t *fiber = fiber_self();
+    fiber_worker_t *home;
+    int saved_errno = errno;    /* (the fiber may come back on another
+                                 * worker, with its own errno) */
+    bool_t timed_out;
+
+    assert(fiber);
+
+    /* (a running fiber's home doesn't change) */
+    home = fiber->home;
+    PTHREAD_CALL(pthread_mutex_lock(&home->lock));
+    assert(fiber->state == FIBER_RUNNING && fiber->worker->current == fiber);
+    fiber->state = FIBER_PARKING;
+    fiber->timed_out = FALSE;
+    if ((fiber->has_deadline = (abstime != NULL)))
+        fiber->deadline = *abstime;
+    PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+
+    /* (the worker takes it from here) */
+    if (swapcontext(&fiber->context, &fiber->worker->context) < 0)
+    {
+        assert(0);
+        abort();
+    }
+
+    home = fiber->home;
+    PTHREAD_CALL(pthread_mutex_lock(&home->lock));
+    timed_out = fiber->timed_out;
+    PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+
+    errno = saved_errno;
+    return !timed_out;
+}
+
+void fiber_wake(fiber_t *fiber)
+{
+    fiber_worker_t *home;
+
+    assert(fiber);
+
+    home = fiber_lock_home(fiber);
+    switch (fiber->state)
+    {
+    case FIBER_PARKED:
+        if (fiber->heap_index >= 0)
+            fiber_heap_remove(home, fiber);
+        fiber_enqueue(home, fiber);
+        break;
+
+    case FIBER_RUNNING:
+    case FIBER_PARKING:
+        fiber->wake_pending = TRUE;
+        break;
+
+    default:
+        break;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+}
+
+bool_t fiber_run(fiber_t *fiber)
+{
+    fiber_worker_t *home, guest;
+    int saved_errno = errno;
+
+    assert(fiber);
+
+    if (fiber_self())
+    {
+        /* (a fiber can't lend its own thread) */
+        fiber_wake(fiber);
+        return FALSE;
+    }
+
+    home = fiber_lock_home(fiber);
+    if (fiber->state != FIBER_PARKED)
+    {
+        if (fiber->state == FIBER_RUNNING || fiber->state == FIBER_PARKING)
+            fiber->wake_pending = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+        return FALSE;
+    }
+
+    if (fiber->heap_index >= 0)
+        fiber_heap_remove(home, fiber);
+    memset(&guest, 0, sizeof(guest));
+    guest.index = -1;
+    guest.current = fiber;
+    fiber->worker = &guest;
+    fiber->state = FIBER_RUNNING;
+    PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+
+    PTHREAD_CALL(pthread_setspecific(fiber_key, &guest));
+    if (swapcontext(&guest.context, &fiber->context) < 0)
+    {
+        assert(0);
+        abort();
+    }
+    PTHREAD_CALL(pthread_setspecific(fiber_key, NULL));
+
+    PTHREAD_CALL(pthread_mutex_lock(&home->lock));
+    fiber_switched_back(home, fiber);
+    PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+
+    errno = saved_errno;
+    return TRUE;
+}
+
+void fiber_join(fiber_t *fiber)
+{
+    assert(fiber && fiber != fiber_self());
+    assert(fiber->state != FIBER_NEW);
+
+    PTHREAD_CALL(pthread_mutex_lock(&join_lock));
+    while (!fiber->finished)
+        PTHREAD_CALL(pthread_cond_wait(&join_cond, &join_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&join_lock));
+
+    free(fiber);
+}
+
+
+/* called once, to start the workers */
+static void fiber_start_workers(void)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int k;
+
+    if (num_cpus < FIBER_MIN_WORKERS)
+        num_cpus = FIBER_MIN_WORKERS;
+    if (num_cpus > FIBER_MAX_WORKERS)
+        num_cpus = FIBER_MAX_WORKERS;
+    if (fiber_workers_wanted)
+        num_cpus = fiber_workers_wanted;
+
+    PTHREAD_CALL(pthread_key_create(&fiber_key, NULL));
+    for (k = 0; k < num_cpus; ++k)
+    {
+        fiber_worker_t *worker = &fiber_workers[k];
+
+        worker->index = k;
+        PTHREAD_CALL(pthread_mutex_init(&worker->lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&worker->cond, NULL));
+    }
+    num_fiber_workers = num_cpus;
+
+    for (k = 0; k < num_cpus; ++k)
+    {
+        fiber_workers[k].thread = _mysock_create_thread(fiber_worker_func,
+                                                        &fiber_workers[k],
+                                                        TRUE);
+    }
+}
+
+static void *fiber_worker_func(void *arg)
+{
+    fiber_worker_t *worker = (fiber_worker_t *) arg;
+
+    PTHREAD_CALL(pthread_setspecific(fiber_key, worker));
+
+#if defined(LINUX)
+    {
+        /* one worker to a processor, if there are as many as there are
+         * workers (the k-th processor we may run on, for the k-th worker)
+         */
+        cpu_set_t allowed;
+        int cpu, k = worker->index;
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 &&
+            CPU_COUNT(&allowed) >= num_fiber_workers)
+        {
+            for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &allowed) && k-- == 0)
+                {
+                    cpu_set_t mine;
+
+                    CPU_ZERO(&mine);
+                    CPU_SET(cpu, &mine);
+                    (void) pthread_setaffinity_np(pthread_self(),
+                                                  sizeof(mine), &mine);
+                    break;
+                }
+            }
+        }
+    }
+#endif
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    for (;;)
+    {
+        struct timeval tv;
+        struct timespec now;
+        fiber_t *fiber;
+
+        /* fibers whose deadlines have passed go on the run queue */
+        gettimeofday(&tv, NULL);
+        now.tv_sec = tv.tv_sec;
+        now.tv_nsec = tv.tv_usec * 1000;
+        while (worker->timer_heap_len > 0 &&
+               fiber_time_cmp(&worker->timer_heap[0]->deadline, &now) <= 0)
+        {
+            fiber = worker->timer_heap[0];
+            fiber_heap_remove(worker, fiber);
+            fiber->timed_out = TRUE;
+            fiber_enqueue(worker, fiber);
+        }
+
+        if (!(fiber = worker->run_head))
+        {
+            int rc;
+
+            PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+            fiber = fiber_steal(worker);
+            PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+            if (fiber || worker->run_head)
+                continue;
+
+            worker->idle = TRUE;
+            if (worker->timer_heap_len == 0)
+            {
+                PTHREAD_CALL(pthread_cond_wait(&worker->cond,
+                                               &worker->lock));
+            }
+            else if ((rc = pthread_cond_timedwait(
+                          &worker->cond, &worker->lock,
+                          &worker->timer_heap[0]->deadline)) != ETIMEDOUT)
+            {
+                PTHREAD_CALL(rc);
+            }
+            worker->idle = FALSE;
+            continue;
+        }
+
+        if (!(worker->run_head = fiber->next))
+            worker->run_tail = NULL;
+        fiber->next = NULL;
+        --worker->num_ready;
+        assert(fiber->home == worker);
+        fiber->state = FIBER_RUNNING;
+        fiber->worker = worker;
+        worker->current = fiber;
+        PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+        if (swapcontext(&worker->context, &fiber->context) < 0)
+        {
+            assert(0);
+            abort();
+        }
+
+        PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+        worker->current = NULL;
+        fiber_switched_back(worker, fiber);
+    }
+
+    return NULL;
+}
+
+/* finish parking a fiber that has swapped back to whoever ran it, or
+ * finish it off if its function has returned.  the caller holds the lock
+ * of the fiber's home.
+ */
+static void fiber_switched_back(fiber_worker_t *home, fiber_t *fiber)
+{
+    assert(fiber->home == home);
+    fiber->worker = NULL;
+    if (fiber->state == FIBER_PARKING)
+    {
+        if (fiber->wake_pending)
+        {
+            fiber_enqueue(home, fiber);
+        }
+        else
+        {
+            fiber->state = FIBER_PARKED;
+            if (fiber->has_deadline)
+                fiber_heap_insert(home, fiber);
+        }
+    }
+    else
+    {
+        assert(fiber->state == FIBER_DONE);
+        free(fiber->stack);
+        fiber->stack = NULL;
+
+        PTHREAD_CALL(pthread_mutex_lock(&join_lock));
+        fiber->finished = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&join_lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&join_cond));
+    }
+}
+
+/* where every fiber starts */
+static void fiber_entry(void)
+{
+    fiber_t *fiber = fiber_self();
+    fiber_worker_t *home;
+
+    assert(fiber);
+    (void) fiber->start(fiber->arg);
+
+    home = fiber->home;
+    PTHREAD_CALL(pthread_mutex_lock(&home->lock));
+    fiber->state = FIBER_DONE;
+    PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+
+    /* never to return */
+    (void) setcontext(&fiber->worker->context);
+    assert(0);
+    abort();
+}
+
+/* lock the worker a fiber belongs to, and return it */
+static fiber_worker_t *fiber_lock_home(fiber_t *fiber)
+{
+    for (;;)
+    {
+        fiber_worker_t *home = fiber->home;
+
+        PTHREAD_CALL(pthread_mutex_lock(&home->lock));
+        if (home == fiber->home)
+            return home;
+
+        /* stolen meanwhile */
+        PTHREAD_CALL(pthread_mutex_unlock(&home->lock));
+    }
+}
+
+/* put a fiber on the end of its home's run queue.  the caller holds the
+ * worker's lock.
+ */
+static void fiber_enqueue(fiber_worker_t *worker, fiber_t *fiber)
+{
+    int k;
+
+    assert(fiber->home == worker);
+    fiber->state = FIBER_RUNNABLE;
+    fiber->wake_pending = FALSE;
+    fiber->next = NULL;
+    if (worker->run_tail)
+        worker->run_tail->next = fiber;
+    else
+        worker->run_head = fiber;
+    worker->run_tail = fiber;
+    ++worker->num_ready;
+
+    if (worker->idle)
+    {
+        PTHREAD_CALL(pthread_cond_signal(&worker->cond));
+        return;
+    }
+
+    /* the worker is busy, so let an idle one take the fiber instead.  (if
+     * none sees this in time, the fiber just waits for its own worker.)
+     */
+    for (k = 1; k < num_fiber_workers; ++k)
+    {
+        fiber_worker_t *thief =
+            &fiber_workers[(worker->index + k) % num_fiber_workers];
+
+        if (thief->idle)
+        {
+            PTHREAD_CALL(pthread_cond_signal(&thief->cond));
+            break;
+        }
+    }
+}
+
+/* take half the run queue of the worker with the most fibers ready, and
+ * put them on this worker's.  returns the first of them, or NULL if there
+ * was nothing to steal.  the caller doesn't hold any worker's lock.
+ */
+static fiber_t *fiber_steal(fiber_worker_t *worker)
+{
+    fiber_worker_t *victim = NULL;
+    fiber_t *first, *last;
+    int k, most = 0, count;
+
+    /* (a guess, without the locks) */
+    for (k = 1; k < num_fiber_workers; ++k)
+    {
+        fiber_worker_t *other =
+            &fiber_workers[(worker->index + k) % num_fiber_workers];
+
+        if (other->num_ready > most)
+        {
+            victim = other;
+            most = other->num_ready;
+        }
+    }
+    if (!victim)
+        return NULL;
+
+    /* the fibers from the back of the queue, which would wait longest */
+    PTHREAD_CALL(pthread_mutex_lock(&victim->lock));
+    if ((count = victim->num_ready / 2) == 0 && victim->current)
+        count = victim->num_ready;
+    if (count == 0)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&victim->lock));
+        return NULL;
+    }
+
+    last = victim->run_head;
+    for (k = victim->num_ready - count; k > 1; --k)
+        last = last->next;
+    if (count == victim->num_ready)
+    {
+        first = victim->run_head;
+        victim->run_head = victim->run_tail = NULL;
+    }
+    else
+    {
+        first = last->next;
+        last->next = NULL;
+        victim->run_tail = last;
+    }
+    victim->num_ready -= count;
+    for (last = first; last; last = last->next)
+        last->home = worker;
+    PTHREAD_CALL(pthread_mutex_unlock(&victim->lock));
+
+    /* they're runnable, so nothing touches them until they're queued */
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    for (last = first; last->next; last = last->next)
+        ;
+    if (worker->run_tail)
+        worker->run_tail->next = first;
+    else
+        worker->run_head = first;
+    worker->run_tail = last;
+    worker->num_ready += count;
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+    return first;
+}
+
+/* timer heap, earliest deadline first.  the caller holds the worker's
+ * lock.
+ */
+static void fiber_heap_set(fiber_worker_t *worker, int k, fiber_t *fiber)
+{
+    worker->timer_heap[k] = fiber;
+    fiber->heap_index = k;
+}
+
+static void fiber_heap_sift(fiber_worker_t *worker, int k)
+{
+    fiber_t **heap = worker->timer_heap;
+    fiber_t *fiber = heap[k];
+
+    /* up... */
+    while (k > 0 && fiber_time_cmp(&fiber->deadline,
+                                   &heap[(k - 1) / 2]->deadline) < 0)
+    {
+        fiber_heap_set(worker, k, heap[(k - 1) / 2]);
+        k = (k - 1) / 2;
+    }
+
+    /* ...or down */
+    for (;;)
+    {
+        int child = 2 * k + 1;
+
+        if (child >= worker->timer_heap_len)
+            break;
+        if (child + 1 < worker->timer_heap_len &&
+            fiber_time_cmp(&heap[child + 1]->deadline,
+                           &heap[child]->deadline) < 0)
+            ++child;
+        if (fiber_time_cmp(&heap[child]->deadline, &fiber->deadline) >= 0)
+            break;
+        fiber_heap_set(worker, k, heap[child]);
+        k = child;
+    }
+    fiber_heap_set(worker, k, fiber);
+}
+
+static void fiber_heap_insert(fiber_worker_t *worker, fiber_t *fiber)
+{
+    assert(fiber->heap_index < 0);
+
+    if (worker->timer_heap_len == worker->timer_heap_size)
+    {
+        worker->timer_heap_size = worker->timer_heap_size ?
+                                  2 * worker->timer_heap_size : 64;
+        worker->timer_heap = (fiber_t **)
+            realloc(worker->timer_heap,
+                    worker->timer_heap_size * sizeof(fiber_t *));
+        assert(worker->timer_heap);
+    }
+
+    fiber_heap_set(worker, worker->timer_heap_len++, fiber);
+    fiber_heap_sift(worker, fiber->heap_index);
+
+    /* (parked by a guest, with a worker waiting for a later deadline) */
+    if (worker->idle && fiber->heap_index == 0)
+        PTHREAD_CALL(pthread_cond_signal(&worker->cond));
+}
+
+static void fiber_heap_remove(fiber_worker_t *worker, fiber_t *fiber)
+{
+    int k = fiber->heap_index;
+
+    assert(k >= 0 && k < worker->timer_heap_len &&
+           worker->timer_heap[k] == fiber);
+    fiber->heap_index = -1;
+    if (k != --worker->timer_heap_len)
+    {
+        fiber_heap_set(worker, k, worker->timer_heap[worker->timer_heap_len]);
+        fiber_heap_sift(worker, k);
+    }
+}
+
+static int fiber_time_cmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return (a->tv_sec < b->tv_sec) ? -1 : 1;
+    if (a->tv_nsec != b->tv_nsec)
+        return (a->tv_nsec < b->tv_nsec) ? -1 : 1;
+    return 0;
+}
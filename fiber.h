@@ -0,0 +1,61 @@
+/* internal header--fibers, for running transport layers without a thread
+ * each
+ */
+
+#ifndef __FIBER_H__
+#define __FIBER_H__
+
+#include <time.h>
+#include "mysock.h"
+
+/* a fiber runs a function on a stack of its own, FIBER_STACK_SIZE bytes,
+ * on one of a small pool of worker threads (one per processor, between
+ * FIBER_MIN_WORKERS and FIBER_MAX_WORKERS of them).  it keeps the worker
+ * only until it parks itself with fiber_park(), which switches straight
+ * back to the worker in user space; fiber_wake() (or the deadline
+ * passing) makes it runnable again, on the same worker unless an idle one
+ * steals it.  a fiber shouldn't block in the kernel for long, as its
+ * worker can run nothing else meanwhile.
+ */
+#define FIBER_STACK_SIZE (256 * 1024)
+#define FIBER_MIN_WORKERS 2
+#define FIBER_MAX_WORKERS 8
+
+typedef struct fiber fiber_t;
+
+/* use num_workers workers instead, if called before the first fiber is
+ * created (for benchmarks)
+ */
+void fiber_set_workers(int num_workers);
+
+/* a fiber to run start(arg), not yet runnable */
+fiber_t *fiber_create(void *(*start)(void *arg), void *arg);
+
+/* make a new fiber runnable */
+void fiber_start(fiber_t *fiber);
+
+/* the fiber running in the calling thread, or NULL */
+fiber_t *fiber_self(void);
+
+/* called on a fiber, to wait until fiber_wake() is called for it, or
+ * until abstime (if not NULL) passes.  a wake-up since the fiber last
+ * parked counts, so check for whatever is waited for first, then park.
+ * returns FALSE if the deadline passed.
+ */
+bool_t fiber_park(const struct timespec *abstime);
+
+/* make a fiber runnable if it is parked, or else have its next
+ * fiber_park() return at once
+ */
+void fiber_wake(fiber_t *fiber);
+
+/* called off the fibers, to run a parked fiber on the calling thread
+ * instead of a worker, until it parks again.  if it isn't parked, it is
+ * only woken, as by fiber_wake().  returns TRUE if it was run.
+ */
+bool_t fiber_run(fiber_t *fiber);
+
+/* wait until the fiber's function has returned, then free it */
+void fiber_join(fiber_t *fiber);
+
+#endif  /* __FIBER_H__ */
@@ -0,0 +1,239 @@
+/* LZ77 compression of STCP payloads--the format follows LZ4: a block is
+ * a run of sequences, each a token (literal count in the high nibble,
+ * match length - 4 in the low nibble, 15 meaning more length bytes
+ * follow), the literals, then a two byte little endian match offset and
+ * any extra match length bytes.  the last sequence has literals only.
+ * unlike LZ4, matches may reach back into the blocks before.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include "lz.h"
+
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_BUF_SIZE (2 * LZ_WINDOW + LZ_MAX_BLOCK)
+
+
+static uint32_t lz_hash(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* make room for a block of len bytes after the history, keeping the last
+ * LZ_WINDOW bytes of it.  both ends slide at the same points.
+ */
+static void lz_prepare(lz_stream_t *z, int len)
+{
+    int shift, k;
+
+    assert(len >= 0 && len <= LZ_MAX_BLOCK);
+    if (!z->buf)
+    {
+        z->buf = (char *) malloc(LZ_BUF_SIZE);
+        assert(z->buf);
+        z->len = 0;
+    }
+
+    if (z->len + len > LZ_BUF_SIZE)
+    {
+        shift = z->len - LZ_WINDOW;
+        memmove(z->buf, z->buf + shift, LZ_WINDOW);
+        z->len = LZ_WINDOW;
+
+        if (z->table)
+        {
+            for (k = 0; k < LZ_HASH_SIZE; ++k)
+                z->table[k] = (z->table[k] >= shift) ?
+                              z->table[k] - shift : -1;
+        }
+    }
+}
+
+/* append one sequence to *out; -1 if it might not fit before out_end */
+static int lz_sequence(unsigned char **out, unsigned char *out_end,
+                       const unsigned char *lit, int lit_len,
+                       int offset, int match_len)
+{
+    unsigned char *p = *out, *token;
+    int n;
+
+    if (out_end - p < 1 + lit_len + lit_len / 255 + 1 +
+                      2 + match_len / 255 + 1)
+        return -1;
+
+    token = p++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15)
+    {
+        for (n = lit_len - 15; n >= 255; n -= 255)
+            *p++ = 255;
+        *p++ = n;
+    }
+    memcpy(p, lit, lit_len);
+    p += lit_len;
+
+    if (match_len > 0)
+    {
+        *p++ = offset & 0xff;
+        *p++ = offset >> 8;
+        n = match_len - LZ_MIN_MATCH;
+        *token |= (n >= 15 ? 15 : n);
+        if (n >= 15)
+        {
+            for (n -= 15; n >= 255; n -= 255)
+                *p++ = 255;
+            *p++ = n;
+        }
+    }
+
+    *out = p;
+    return 0;
+}
+
+int lz_compress(lz_stream_t *z, const char *src, int src_len,
+                char *dst, int dst_max)
+{
+    unsigned char *buf, *out = (unsigned char *) dst;
+    unsigned char *out_end = out + dst_max;
+    int start, end, pos, anchor, cand, match_len, k;
+    uint32_t h;
+
+    lz_prepare(z, src_len);
+    if (!z->table)
+    {
+        z->table = (int *) malloc(LZ_HASH_SIZE * sizeof(int));
+        assert(z->table);
+        for (k = 0; k < LZ_HASH_SIZE; ++k)
+            z->table[k] = -1;
+    }
+
+    buf = (unsigned char *) z->buf;
+    start = z->len;
+    end = start + src_len;
+    memcpy(buf + start, src, src_len);
+    z->len = end;
+
+    pos = anchor = start;
+    while (pos + LZ_MIN_MATCH <= end)
+    {
+        h = lz_hash(buf + pos);
+        cand = z->table[h];
+        z->table[h] = pos;
+
+        if (cand < 0 || pos - cand > LZ_WINDOW ||
+            memcmp(buf + cand, buf + pos, LZ_MIN_MATCH) != 0)
+        {
+            ++pos;
+            continue;
+        }
+
+        match_len = LZ_MIN_MATCH;
+        while (pos + match_len < end &&
+               buf[cand + match_len] == buf[pos + match_len])
+            ++match_len;
+
+        if (lz_sequence(&out, out_end, buf + anchor, pos - anchor,
+                        pos - cand, match_len) < 0)
+            return -1;
+        pos += match_len;
+        anchor = pos;
+    }
+
+    if (lz_sequence(&out, out_end, buf + anchor, end - anchor, 0, 0) < 0)
+        return -1;
+    return out - (unsigned char *) dst;
+}
+
+int lz_decompress(lz_stream_t *z, const char *src, int src_len,
+                  char *dst, int dst_len)
+{
+    const unsigned char *in = (const unsigned char *) src;
+    const unsigned char *in_end = in + src_len;
+    unsigned char *buf;
+    int start, end, pos, lit_len, match_len, offset, token, n, k;
+
+    if (dst_len < 0 || dst_len > LZ_MAX_BLOCK)
+        return -1;
+    lz_prepare(z, dst_len);
+    buf = (unsigned char *) z->buf;
+    start = pos = z->len;
+    end = start + dst_len;
+
+    while (in < in_end)
+    {
+        token = *in++;
+
+        lit_len = token >> 4;
+        if (lit_len == 15)
+        {
+            do
+            {
+                if (in >= in_end)
+                    return -1;
+                n = *in++;
+                lit_len += n;
+            } while (n == 255);
+        }
+        if (lit_len > in_end - in || lit_len > end - pos)
+            return -1;
+        memcpy(buf + pos, in, lit_len);
+        in += lit_len;
+        pos += lit_len;
+
+        if (in == in_end)
+            break;  /* last sequence */
+
+        if (in_end - in < 2)
+            return -1;
+        offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        match_len = token & 15;
+        if (match_len == 15)
+        {
+            do
+            {
+                if (in >= in_end)
+                    return -1;
+                n = *in++;
+                match_len += n;
+            } while (n == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > pos || match_len > end - pos)
+            return -1;
+        for (k = 0; k < match_len; ++k)     /* may overlap itself */
+            buf[pos + k] = buf[pos - offset + k];
+        pos += match_len;
+    }
+
+    if (pos != end)
+        return -1;
+    memcpy(dst, buf + start, dst_len);
+    z->len = end;
+    return 0;
+}
+
+void lz_store(lz_stream_t *z, const char *src, int len)
+{
+    lz_prepare(z, len);
+    memcpy(z->buf + z->len, src, len);
+    z->len += len;
+}
+
+void lz_free(lz_stream_t *z)
+{
+    free(z->buf);
+    free(z->table);
+    memset(z, 0, sizeof(*z));
+}
+
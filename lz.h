@@ -0,0 +1,40 @@
+/* internal header--LZ77 compression of STCP payloads */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#define LZ_WINDOW 32768     /* how far back a match may reach */
+#define LZ_MAX_BLOCK 8192   /* largest block compressed at once */
+
+/* one direction of one compressed byte stream.  blocks are compressed (or
+ * decompressed) in order, and matches may refer to the last LZ_WINDOW
+ * bytes of the blocks before, so both ends must see the same blocks.  a
+ * zeroed lz_stream_t is an empty stream.
+ */
+typedef struct
+{
+    char *buf;      /* history, followed by the block being worked on */
+    int len;        /* bytes of history in buf */
+    int *table;     /* compressor only: hash of 4 bytes -> position */
+} lz_stream_t;
+
+/* compress a block of src_len (<= LZ_MAX_BLOCK) bytes into at most dst_max
+ * bytes.  returns the compressed size, or -1 if it doesn't fit (the block
+ * is then sent as it is).  either way, the block joins the history.
+ */
+int lz_compress(lz_stream_t *z, const char *src, int src_len,
+                char *dst, int dst_max);
+
+/* decompress a block of src_len bytes that expands to exactly dst_len
+ * bytes, adding it to the history.  returns 0, or -1 if it is corrupt.
+ */
+int lz_decompress(lz_stream_t *z, const char *src, int src_len,
+                  char *dst, int dst_len);
+
+/* add a block that was sent uncompressed to the history */
+void lz_store(lz_stream_t *z, const char *src, int len);
+
+void lz_free(lz_stream_t *z);
+
+#endif  /* __LZ_H__ */
+
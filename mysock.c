@@ -12,6 +12,13 @@
 #include "network_io.h"
 #include "stcp_api.h"
 #include "transport.h"
+#include "pool.h"
+#include "fiber.h"
+
+
+/* packets come from a pool, each with its buffer right after it */
+static pool_t packet_pool =
+    POOL_INITIALIZER("packet", sizeof(packet_buf_t) + PACKET_BUF_LEN);
 
 
 #ifdef NDEBUG
@@ -22,13 +29,16 @@
 #endif  /*NDEBUG*/
 
 
-/* helper functions to start transport layer and network receive threads */
+/* helper function to start the transport layer */
 static void *transport_thread_func(void *arg);
 
 static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd);
 static mysock_context_t *_mysock_allocate_context(void);
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq);
+static void _mysock_wake_app(mysock_context_t *ctx);
+static void _mysock_ring_init(byte_ring_t *ring);
+static void _mysock_ring_free(byte_ring_t *ring);
 
 
 /* mysocket descriptor table, one entry per STCP connection */
@@ -84,33 +94,126 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
     assert(!connection_context->listening);
     connection_context->is_active = is_active;
 
-    /* start a new network thread; this handles incoming data, passing it
-     * up to the transport layer.  (the network input is threaded so we can
+    /* start receiving from the network; incoming data is passed up to the
+     * transport layer by the network layer's receive threads, so we can
      * keep track of timeouts/when data arrives, in a portable manner
-     * independent of the underlying network I/O functionality).
+     * independent of the underlying network I/O functionality.
      */
-    if (_network_start_recv_thread(connection_context) < 0)
+    if (_network_start_recv(connection_context) < 0)
     {
         assert(0);
         abort();
     }
 
-    /* start a new transport layer thread */
-    connection_context->transport_thread = _mysock_create_thread(
-        transport_thread_func,
-        connection_context,
-        FALSE);
+    /* start a new transport layer fiber */
+    PTHREAD_CALL(pthread_mutex_lock(&connection_context->data_ready_lock));
+    connection_context->transport_fiber = fiber_create(transport_thread_func,
+                                                       connection_context);
+    PTHREAD_CALL(pthread_mutex_unlock(&connection_context->data_ready_lock));
+    fiber_start(connection_context->transport_fiber);
     connection_context->transport_thread_started = TRUE;
 }
 
-int _mysock_wait_for_connection(mysock_context_t *ctx)
+/* wait for the transport layer to finish, once it has been asked to */
+void _mysock_transport_join(mysock_context_t *ctx)
+{
+    assert(ctx && ctx->transport_thread_started);
+
+    /* (the pointer isn't used to wake it up once transport_done is set) */
+    fiber_join(ctx->transport_fiber);
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->transport_fiber = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    ctx->transport_thread_started = FALSE;
+}
+
+/* true if _mysock_transport_join() won't have to wait */
+bool_t _mysock_transport_finished(mysock_context_t *ctx)
+{
+    bool_t done;
+
+    assert(ctx);
+    if (!ctx->transport_thread_started)
+        return TRUE;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    done = ctx->transport_done;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return done;
+}
+
+/* wake up the transport layer's fiber, if it is waiting in
+ * stcp_wait_for_event() (the caller signals transport_cond, for a
+ * transport layer that isn't on its fiber).  the caller holds
+ * data_ready_lock.  with MYSO_INLINE, the transport layer is left for an
+ * app thread to run with _mysock_run_transport(): the caller's, if by_app
+ * is true (once it has let go of the lock), or one waiting in
+ * _mysock_run_transport_until().
+ */
+void _mysock_wake_transport(mysock_context_t *ctx, bool_t by_app)
+{
+    if (!ctx->transport_fiber || ctx->transport_done)
+        return;
+
+    if (ctx->options[MYSO_INLINE] && (by_app || ctx->inline_waiters))
+    {
+        ctx->transport_deferred = TRUE;
+        if (ctx->inline_waiters)
+            _mysock_wake_app(ctx);
+    }
+    else
+    {
+        fiber_wake(ctx->transport_fiber);
+    }
+}
+
+/* wake up every app thread sleeping on the mysocket's rings, to look
+ * again at what they wait for
+ */
+static void _mysock_wake_app(mysock_context_t *ctx)
+{
+    int k;
+
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->app_recv_queue.app_cond));
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+        PTHREAD_CALL(pthread_cond_broadcast(&ctx->app_send_queue[k].app_cond));
+}
+
+/* with MYSO_INLINE, run the transport layer on the calling thread, if a
+ * wake-up was left for the app (see _mysock_wake_transport()).  it runs
+ * until it next waits in stcp_wait_for_event(): it sends what it can of
+ * the app's data, and deals with the segments that have arrived.
+ */
+void _mysock_run_transport(mysock_context_t *ctx)
+{
+    fiber_t *fiber = NULL;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (ctx->transport_deferred && !ctx->transport_done)
+        fiber = ctx->transport_fiber;
+    ctx->transport_deferred = FALSE;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    if (fiber)
+        (void) fiber_run(fiber);
+}
+
+/* wait until we either connect to the peer, or hit an error.  if block
+ * is false, fail with EAGAIN instead of waiting.
+ */
+int _mysock_wait_for_connection(mysock_context_t *ctx, bool_t block)
 {
     assert(ctx);
 
-    /* block until we either connect to the peer, or hit an error */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
     while (ctx->blocking)
     {
+        if (!block)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+            errno = EAGAIN;
+            return -1;
+        }
         PTHREAD_CALL(pthread_cond_wait(&ctx->blocking_cond,
                                        &ctx->blocking_lock));
     }
@@ -120,51 +223,181 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
 }
 
 
-/* add an incoming buffer (packet) to a queue for this connection; it will be
- * dequeued by stcp_network_recv() or myread() when the transport layer or
- * application is ready to use it, depending on the queue to which
- * the buffer (or packet) is added.
- *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+/* a new packet, with room for PACKET_BUF_LEN bytes of data, held once */
+packet_buf_t *_mysock_alloc_packet(void)
+{
+    packet_buf_t *packet = (packet_buf_t *) pool_alloc(&packet_pool);
+
+    memset(packet, 0, sizeof(*packet));
+    packet->data = (char *) (packet + 1);
+    packet->refs = 1;
+    return packet;
+}
+
+/* take another reference to a packet */
+void _mysock_hold_packet(packet_buf_t *packet)
+{
+    assert(packet && packet->refs > 0);
+    __sync_fetch_and_add(&packet->refs, 1);
+}
+
+/* drop a reference to a packet, freeing it with the last one */
+void _mysock_release_packet(packet_buf_t *packet)
+{
+    assert(packet && packet->refs > 0);
+    if (__sync_sub_and_fetch(&packet->refs, 1) == 0)
+        pool_free(&packet_pool, packet);
+}
+
+/* wake up the app threads sleeping on a ring's app_cond, if ring isn't
+ * NULL, or else the transport layer (see _mysock_wake_transport()).  this
+ * is the slow path of a change to a queue, taken only if the other end has
+ * counted itself as waiting.  a waiter counts itself before it looks at
+ * the queue for the last time, and the queue is changed before the count
+ * is looked at, with a barrier in between on each side, so one of them
+ * always sees the other.
+ */
+static void _mysock_wake_waiters(mysock_context_t *ctx,
+                                 byte_ring_t      *ring,
+                                 bool_t            by_app)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (!ring)
+        _mysock_wake_transport(ctx, by_app);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_cond_broadcast(ring ? &ring->app_cond
+                                             : &ctx->transport_cond));
+}
+
+/* is the transport layer waiting for its queues (or an app thread, to run
+ * it with MYSO_INLINE)?
+ */
+#define TRANSPORT_WAITING(ctx) \
+    ((ctx)->transport_waiting || (ctx)->inline_waiters)
+
+/* sleep on cond until woken up by _mysock_wake_waiters(), with
+ * data_ready_lock held.  the transport layer's fiber parks instead, giving
+ * up its worker meanwhile.
+ */
+static void _mysock_sleep(mysock_context_t *ctx, pthread_cond_t *cond)
+{
+    if (fiber_self())
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        (void) fiber_park(NULL);
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    }
+    else
+    {
+        PTHREAD_CALL(pthread_cond_wait(cond, &ctx->data_ready_lock));
+    }
+}
+
+/* add a packet to a queue for this connection, handing over the caller's
+ * reference to it; it will be dequeued by stcp_network_recv() (or
+ * stcp_network_recv_packet()) when the transport layer is ready to use it.
+ */
+void _mysock_enqueue_packet(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            packet_buf_t     *packet)
+{
+    packet_buf_t *pushed;
+
+    assert(ctx && pq && packet && !packet->next);
+
+    do
+    {
+        pushed = pq->pushed;
+        packet->next = pushed;
+    } while (!__sync_bool_compare_and_swap(&pq->pushed, pushed, packet));
+
+    /* the transport layer only waits once it has taken every packet, so
+     * only the first one pushed after that need wake it.  (the swap is a
+     * full barrier.)
+     */
+    if (!pushed && TRANSPORT_WAITING(ctx))
+        _mysock_wake_waiters(ctx, NULL, FALSE);
+}
+
+/* as _mysock_enqueue_packet(), for a copy of the given buffer, so the
+ * calling code can do whatever it wants with it afterwards.
  */
 void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             packet_queue_t   *pq,
                             const void       *packet,
                             size_t            packet_len)
 {
-    packet_queue_node_t *node;
+    packet_buf_t *copy;
 
     assert(ctx && pq && (packet || !packet_len));
+    assert(packet_len <= PACKET_BUF_LEN);
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
-    assert(node);
-
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
-
+    copy = _mysock_alloc_packet();
     if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
+        memcpy(copy->data, packet, packet_len);
+    copy->data_len = packet_len;
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    if (!pq->head)
-    {
-        assert(!pq->tail);
-        pq->head = pq->tail = node;
-    }
-    else
+    _mysock_enqueue_packet(ctx, pq, copy);
+}
+
+/* the packet at the head of a queue, or NULL.  once the consumer has used
+ * up the packets it took, it takes the ones pushed since.
+ */
+static packet_buf_t *_mysock_queue_head(packet_queue_t *pq)
+{
+    if (!pq->head && pq->pushed)
     {
-        assert(pq->tail);
-        assert(!pq->tail->next);
-        assert(!node->next);
-        pq->tail->next = node;
-        pq->tail = node;
+        packet_buf_t *packet = __sync_lock_test_and_set(&pq->pushed, NULL);
+
+        /* (they were pushed newest first) */
+        while (packet)
+        {
+            packet_buf_t *next = packet->next;
+
+            packet->next = pq->head;
+            pq->head = packet;
+            packet = next;
+        }
     }
+
+    return pq->head;
+}
+
+/* as _mysock_queue_head(), blocking until there is a packet */
+static packet_buf_t *_mysock_queue_wait(mysock_context_t *ctx,
+                                        packet_queue_t   *pq)
+{
+    packet_buf_t *packet;
+
+    if ((packet = _mysock_queue_head(pq)))
+        return packet;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ++ctx->transport_waiting;
+    __sync_synchronize();
+    while (!(packet = _mysock_queue_head(pq)))
+        _mysock_sleep(ctx, &ctx->transport_cond);
+    --ctx->transport_waiting;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    return packet;
+}
+
+/* remove the packet at the head of a queue, blocking until there is one.
+ * the caller gets the queue's reference to it.
+ */
+packet_buf_t *_mysock_dequeue_packet(mysock_context_t *ctx,
+                                     packet_queue_t   *pq)
+{
+    packet_buf_t *packet;
+
+    assert(ctx && pq);
+
+    packet = _mysock_queue_wait(ctx, pq);
+    pq->head = packet->next;
+
+    packet->next = NULL;
+    return packet;
 }
 
 /* remove one packet from the head of the waiting packet queue, copying the
@@ -180,60 +413,688 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               size_t            max_len,
                               bool_t            remove_partial)
 {
-    packet_queue_node_t *node;
-    size_t               packet_len;
-    char *mid;
+    packet_buf_t *packet;
+    size_t        packet_len;
 
     assert(ctx && pq && dst);
 
     /* block until queue is non-empty */
+    packet = _mysock_queue_wait(ctx, pq);
+    assert(packet && packet->data);
+
+    if (packet->data_len > max_len && remove_partial)
+    {
+        /* remove only a portion of the packet at the head of the queue,
+         * leaving the rest around for the next call to dequeue_buffer().
+         */
+        memcpy(dst, packet->data, max_len);
+        packet->data += max_len;
+        packet->data_len -= max_len;
+        packet_len = max_len;
+    }
+    else
+    {
+        /* dequeue the entire packet at the head of the queue */
+        pq->head = packet->next;
+
+        memcpy(dst, packet->data, MIN(max_len, packet->data_len));
+        packet_len = packet->data_len;
+
+        _mysock_release_packet(packet);
+    }
+
+    return packet_len;
+}
+
+
+/* byte rings.  a record is a ring_record_t followed by the bytes written,
+ * or, if it has a packet, just the header; the header may wrap around the
+ * end of the buffer like anything else, but a record is never split
+ * between buffers.  records are written whole, so once the header is
+ * there, so is the rest.
+ */
+typedef struct
+{
+    uint32_t      len;
+    int32_t       stream;
+    packet_buf_t *packet;   /* holding the bytes at src (a reference) */
+    const char   *src;
+} ring_record_t;
+
+#define RING_MIN_SIZE 4096
+#define RING_SIZE (2 * MYSOCK_MAX_MESSAGE)  /* a record of any write fits */
+
+/* the transport layer keeps room in the rings it writes for this many
+ * empty records, which mark the end of the data (see _mysock_ring_up_room())
+ */
+#define RING_EOF_RECORDS 2
+
+/* the app is told a ring it writes has room (and a writer waiting for room
+ * is woken up) only as a read takes its room from below this to at least
+ * this much: enough for a record of any write
+ */
+#define RING_LOW_WATER (sizeof(ring_record_t) + MYSOCK_MAX_MESSAGE)
+
+#if (RING_SIZE & (RING_SIZE - 1)) != 0
+    #error RING_SIZE should be a power of two
+#endif
+
+/* room left in a ring before it holds RING_SIZE bytes, counting what is
+ * still in the buffers it has grown out of.  (as out is read after in,
+ * this can only be too little.)
+ */
+static size_t _mysock_ring_room(const byte_ring_t *ring)
+{
+    size_t in = ring->in;
+    size_t used = in - ring->out;
+
+    return (used < RING_SIZE) ? RING_SIZE - used : 0;
+}
+
+/* room left at the end of one of a ring's buffers */
+static size_t _mysock_ring_buf_room(const byte_ring_t *ring,
+                                    const ring_buf_t  *buf)
+{
+    size_t out = ring->out;
+
+    if (out < buf->base)
+        out = buf->base;    /* (the consumer hasn't got to it yet) */
+    return buf->size - (ring->in - out);
+}
+
+/* copy len bytes into a buffer at ring offset pos, in two pieces if they
+ * wrap
+ */
+static void _mysock_ring_put(ring_buf_t *buf, size_t pos,
+                             const void *src, size_t len)
+{
+    size_t start = (pos - buf->base) & (buf->size - 1);
+    size_t first = MIN(len, buf->size - start);
+
+    memcpy(buf->data + start, src, first);
+    memcpy(buf->data, (const char *) src + first, len - first);
+}
+
+/* copy len bytes out of a buffer from ring offset pos */
+static void _mysock_ring_get(const ring_buf_t *buf, size_t pos,
+                             void *dst, size_t len)
+{
+    size_t start = (pos - buf->base) & (buf->size - 1);
+    size_t first = MIN(len, buf->size - start);
+
+    memcpy(dst, buf->data + start, first);
+    memcpy((char *) dst + first, buf->data, len - first);
+}
+
+/* go on in a new buffer, twice the size of the last (a new ring starts at
+ * RING_MIN_SIZE bytes), or more, until it holds len more bytes as well as
+ * everything in the ring now.  the consumer
+ * frees the old buffer once it has read the rest of it.  only the producer
+ * calls this.
+ */
+static ring_buf_t *_mysock_ring_grow(byte_ring_t *ring, size_t len)
+{
+    size_t used = ring->in - ring->out;
+    size_t size = ring->size ? 2 * ring->size : RING_MIN_SIZE;
+    ring_buf_t *buf;
+
+    while (size < used + len)
+        size *= 2;
+
+    buf = (ring_buf_t *) malloc(sizeof(ring_buf_t) + size);
+    assert(buf);
+    buf->data = (char *) (buf + 1);
+    buf->size = size;
+    buf->base = ring->in;
+    buf->next = NULL;
+
+    /* (the consumer only looks for it once in has moved past base) */
+    if (ring->tail_buf)
+        ring->tail_buf->next = buf;
+    else
+        ring->head_buf = buf;
+    ring->tail_buf = buf;
+    ring->size = size;
+    return buf;
+}
+
+/* put a record and the src_len bytes after it at the tail of a ring,
+ * growing it if they don't fit.  only the producer calls this.
+ */
+static void _mysock_ring_put_record(byte_ring_t         *ring,
+                                    const ring_record_t *record,
+                                    const void          *src,
+                                    size_t               src_len)
+{
+    size_t len = sizeof(*record) + src_len;
+    ring_buf_t *buf = ring->tail_buf;
+
+    if (!buf || _mysock_ring_buf_room(ring, buf) < len)
+        buf = _mysock_ring_grow(ring, len);
+
+    _mysock_ring_put(buf, ring->in, record, sizeof(*record));
+    if (src_len > 0)
+        _mysock_ring_put(buf, ring->in + sizeof(*record), src, src_len);
+    if (record->packet)
+        ring->held_in += record->len;
+
+    /* the record is in place before the consumer can see it, and the
+     * consumer's waiters are looked at after (see _mysock_wake_waiters())
+     */
+    __sync_synchronize();
+    ring->in += len;
+    __sync_synchronize();
+}
+
+/* after a record has gone on a ring at old_in: if that made the ring
+ * non-empty, wake up its reader if it is waiting (for the app's ring, the
+ * transport layer), and tell the app if it reads the ring.  returns TRUE
+ * if so.
+ */
+static bool_t _mysock_ring_written(mysock_context_t *ctx,
+                                   byte_ring_t      *ring,
+                                   size_t            old_in)
+{
+    /* (a reader only waits once it has seen the ring empty, so once the
+     * barrier after in moved, it can be seen in out here)
+     */
+    if (ring->out != old_in || ring->head_open)
+        return FALSE;
+
+    if (ring == &ctx->app_recv_queue)
+    {
+        if (TRANSPORT_WAITING(ctx) || ring->readers_waiting)
+            _mysock_wake_waiters(ctx, NULL, TRUE);
+    }
+    else
+    {
+        if (ring->readers_waiting)
+            _mysock_wake_waiters(ctx, ring, FALSE);
+        _mysock_poll_notify(ctx);
+    }
+
+    return TRUE;
+}
+
+/* wait for room for a record of len bytes in the app's ring, while the
+ * transport layer is still there to empty it
+ */
+static void _mysock_ring_wait_room(mysock_context_t *ctx,
+                                   byte_ring_t      *ring,
+                                   size_t            len)
+{
+    assert(ring == &ctx->app_recv_queue);
+
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    while (!pq->head)
+    ++ring->writers_waiting;
+    __sync_synchronize();
+    while (_mysock_ring_room(ring) < len && !ctx->transport_done)
     {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+        PTHREAD_CALL(pthread_cond_wait(&ring->app_cond,
                                        &ctx->data_ready_lock));
     }
+    --ring->writers_waiting;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* append a record to a byte ring, followed by src_len bytes from src
+ * (none for a record with a packet).  see _mysock_ring_write().
+ */
+static void _mysock_ring_append(mysock_context_t    *ctx,
+                                byte_ring_t         *ring,
+                                const ring_record_t *record,
+                                const void          *src,
+                                size_t               src_len,
+                                bool_t               block)
+{
+    size_t len = sizeof(*record) + src_len;
+    int stream = (ring == &ctx->app_recv_queue) ? -1
+                                                : ring - ctx->app_send_queue;
+    size_t old_in;
+    ring_record_t rest;
 
-    node = pq->head;
-    
-    mid = malloc(node->data_len - max_len);
+    if (ring == &ctx->app_recv_queue)
+        PTHREAD_CALL(pthread_mutex_lock(&ring->app_lock));
 
-    assert(node && node->data);
+    if (block && _mysock_ring_room(ring) < len)
+        _mysock_ring_wait_room(ctx, ring, len);
 
-    if (node->data_len > max_len && remove_partial)
+    if (ring != &ctx->app_recv_queue && ctx->aio_reads[stream])
     {
-        /* remove only a portion of the packet at the head of the queue,
-         * leaving the rest around for the next call to dequeue_buffer().
-         */
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        if (RING_EMPTY(ring) && ctx->aio_reads[stream])
+        {
+            /* straight into the buffers of reads from myaio_submit(),
+             * and only what they don't take goes on the ring
+             */
+            const char *data = record->packet ? record->src
+                                              : (const char *) src;
+            size_t data_len = record->packet ? record->len : src_len;
+
+            if (_mysock_aio_fill(ctx, stream, &data, &data_len))
+            {
+                PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+                if (record->packet)
+                    _mysock_release_packet(record->packet);
+                return;
+            }
+
+            rest = *record;
+            rest.len = data_len;
+            if (rest.packet)
+            {
+                rest.src = data;
+            }
+            else
+            {
+                src = data;
+                src_len = data_len;
+            }
+            record = &rest;
+        }
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-        memcpy(dst, node->data, max_len);
-	memcpy(mid , node->data + max_len, node->data_len-max_len);
-	/* memcpy(node->data, node->data + max_len, node->data_len - max_len);*/
-	memcpy(node->data , mid , node->data_len-max_len);
-	/*printf("%s\n",dst);*/
-        node->data_len -= max_len;
-        packet_len = max_len;
     }
-    else
+
+    /* (see _mysock_ring_up_room()) */
+    assert(ring == &ctx->app_recv_queue ||
+           ring->in - ring->out + sizeof(*record) + src_len <= RING_SIZE);
+
+    old_in = ring->in;
+    _mysock_ring_put_record(ring, record, src, src_len);
+    (void) _mysock_ring_written(ctx, ring, old_in);
+
+    if (ring == &ctx->app_recv_queue)
+        PTHREAD_CALL(pthread_mutex_unlock(&ring->app_lock));
+    else if (ctx->aio_reads[stream])
+        _mysock_aio_feed(ctx);  /* (parked as the record went on the ring) */
+}
+
+/* append one record of src_len bytes, written to the given stream, to a
+ * byte ring.  if block is true (only for the app's ring), wait for room
+ * once it holds RING_SIZE bytes (while the transport layer is still there
+ * to empty it), which needs src_len to be at most MYSOCK_MAX_MESSAGE.
+ * the transport layer never waits for the app to read, but passes up no
+ * more than _mysock_ring_up_room() says there is room for, so the rings
+ * the app reads never hold more than RING_SIZE bytes.  this is the only
+ * copy made of the data on its way through the ring.
+ */
+void _mysock_ring_write(mysock_context_t *ctx,
+                        byte_ring_t      *ring,
+                        int               stream,
+                        const void       *src,
+                        size_t            src_len,
+                        bool_t            block)
+{
+    ring_record_t record;
+
+    assert(ctx && ring && (src || !src_len));
+    assert(!block || (ring == &ctx->app_recv_queue &&
+                      src_len <= MYSOCK_MAX_MESSAGE));
+
+    memset(&record, 0, sizeof(record));
+    record.len = src_len;
+    record.stream = stream;
+    _mysock_ring_append(ctx, ring, &record, src, src_len, block);
+}
+
+/* as _mysock_ring_write() with block set, for the app's ring, but rather
+ * than wait for room, write as much of src as there is room for now: a
+ * record of up to src_len bytes, or if whole is true, all of them or
+ * nothing.  returns the number of bytes written, 0 if none fit.
+ */
+size_t _mysock_ring_write_nonblock(mysock_context_t *ctx,
+                                   byte_ring_t      *ring,
+                                   int               stream,
+                                   const void       *src,
+                                   size_t            src_len,
+                                   bool_t            whole)
+{
+    ring_record_t record;
+    size_t room, old_in;
+
+    assert(ctx && ring == &ctx->app_recv_queue && src && src_len > 0);
+    assert(src_len <= MYSOCK_MAX_MESSAGE);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring->app_lock));
+    room = ctx->transport_done ? sizeof(record) + src_len
+                               : _mysock_ring_room(ring);
+
+    if (room <= sizeof(record) ||
+        (whole && room < sizeof(record) + src_len))
     {
-        /* dequeue the entire packet at the head of the queue */
-        if (!(pq->head = pq->head->next))
+        PTHREAD_CALL(pthread_mutex_unlock(&ring->app_lock));
+        return 0;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.len = MIN(src_len, room - sizeof(record));
+    record.stream = stream;
+    old_in = ring->in;
+    _mysock_ring_put_record(ring, &record, src, record.len);
+    (void) _mysock_ring_written(ctx, ring, old_in);
+    PTHREAD_CALL(pthread_mutex_unlock(&ring->app_lock));
+
+    return record.len;
+}
+
+/* TRUE if the transport layer is done, or a ring has a record to read (if
+ * room is 0), or room for a record of room bytes
+ */
+static bool_t _mysock_ring_waited(mysock_context_t *ctx,
+                                  byte_ring_t      *ring,
+                                  size_t            room)
+{
+    if (ctx->transport_done)
+        return TRUE;
+    if (!room)
+        return !RING_EMPTY(ring);
+    return _mysock_ring_room(ring) >= sizeof(ring_record_t) + room;
+}
+
+/* with MYSO_INLINE, where an app thread would wait on a ring: run the
+ * transport layer whenever there is something for it to do, until the
+ * ring has a record to read (if room is 0), or room for a record of room
+ * bytes, or the transport layer is done.  segments that arrive meanwhile
+ * wake this thread instead of the transport layer's worker.
+ */
+void _mysock_run_transport_until(mysock_context_t *ctx,
+                                 byte_ring_t      *ring,
+                                 size_t            room)
+{
+    volatile int *waiting = room ? &ring->writers_waiting
+                                 : &ring->readers_waiting;
+
+    for (;;)
+    {
+        _mysock_run_transport(ctx);
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        if (_mysock_ring_waited(ctx, ring, room))
+            break;
+        if (!ctx->transport_deferred)
         {
-            assert(pq->tail == node);
-            pq->tail = NULL;
+            ++ctx->inline_waiters;
+            ++*waiting;
+            __sync_synchronize();
+            if (!_mysock_ring_waited(ctx, ring, room))
+            {
+                PTHREAD_CALL(pthread_cond_wait(&ring->app_cond,
+                                               &ctx->data_ready_lock));
+            }
+            --*waiting;
+            --ctx->inline_waiters;
         }
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
 
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
-        packet_len = node->data_len;
+/* as _mysock_ring_write(), for src_len bytes at src in the given packet.
+ * they aren't copied: the record holds a reference to the packet until
+ * they have been read.  this never blocks.
+ */
+void _mysock_ring_write_packet(mysock_context_t *ctx,
+                               byte_ring_t      *ring,
+                               int               stream,
+                               packet_buf_t     *packet,
+                               const char       *src,
+                               size_t            src_len)
+{
+    ring_record_t record;
+
+    assert(ctx && ring && packet && src);
+    assert(src >= packet->data && src + src_len <= packet->data +
+                                                   packet->data_len);
+
+    _mysock_hold_packet(packet);
+    memset(&record, 0, sizeof(record));
+    record.len = src_len;
+    record.stream = stream;
+    record.packet = packet;
+    record.src = src;
+    _mysock_ring_append(ctx, ring, &record, NULL, 0, FALSE);
+}
 
-        free(node->data);
+/* the buffer the consumer reads from at out, after freeing any it has
+ * finished with.  there must be something left to read.
+ */
+static ring_buf_t *_mysock_ring_head_buf(byte_ring_t *ring)
+{
+    ring_buf_t *buf = ring->head_buf, *next;
 
-        memset(node, 0, sizeof(*node));
-        free(node);
+    assert(buf);
+    while ((next = buf->next) && ring->out >= next->base)
+    {
+        free(buf);
+        buf = next;
     }
 
-    return packet_len;
+    return (ring->head_buf = buf);
+}
+
+/* move past len bytes of the record at the head of a ring, once they have
+ * been read
+ */
+static void _mysock_ring_skip(byte_ring_t *ring, size_t len)
+{
+    if (ring->head_packet)
+    {
+        ring->head_src += len;
+        __sync_synchronize();
+        ring->held_out += len;
+    }
+    else
+    {
+        __sync_synchronize();
+        ring->out += len;
+    }
+    ring->head_left -= len;
+}
+
+/* set up the app's lock and condition variable for a ring */
+static void _mysock_ring_init(byte_ring_t *ring)
+{
+    PTHREAD_CALL(pthread_mutex_init(&ring->app_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ring->app_cond, NULL));
+}
+
+/* free a ring, dropping the packets its records hold.  as with
+ * _mysock_free_queue(), this is only called as the mysocket context is
+ * being deallocated.
+ */
+static void _mysock_ring_free(byte_ring_t *ring)
+{
+    ring_buf_t *buf, *next;
+
+    if (ring->head_packet)
+        _mysock_release_packet(ring->head_packet);
+    if (ring->head_open && !ring->head_packet)
+        ring->out += ring->head_left;
+    ring->head_open = FALSE;
+
+    while (!RING_EMPTY(ring))
+    {
+        ring_record_t record;
+
+        _mysock_ring_get(_mysock_ring_head_buf(ring), ring->out,
+                         &record, sizeof(record));
+        ring->out += sizeof(record);
+        if (record.packet)
+            _mysock_release_packet(record.packet);
+        else
+            ring->out += record.len;
+    }
+
+    for (buf = ring->head_buf; buf; buf = next)
+    {
+        next = buf->next;
+        free(buf);
+    }
+    PTHREAD_CALL(pthread_cond_destroy(&ring->app_cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ring->app_lock));
+    memset(ring, 0, sizeof(*ring));
+}
+
+/* TRUE if _mysock_ring_write_nonblock() would take all of any write.
+ * (it may take some with less room, but the app is only told of room
+ * again once there is this much; see RING_LOW_WATER.)
+ */
+bool_t _mysock_ring_writable(mysock_context_t *ctx, byte_ring_t *ring)
+{
+    assert(ctx && ring);
+    return ctx->transport_done || _mysock_ring_room(ring) >= RING_LOW_WATER;
+}
+
+/* the number of bytes the transport layer may still pass up in one of the
+ * rings the app reads, in up to the given number of writes: what fits in
+ * RING_SIZE bytes along with what is there now, counting the bytes of
+ * records in packets (which take no room in the buffer, but are held all
+ * the same), and leaving room for the records that mark the end of the
+ * data.  (as out and held_out are read after in and held_in, this can only
+ * be too little.)
+ */
+size_t _mysock_ring_up_room(mysock_context_t *ctx, byte_ring_t *ring,
+                            int writes)
+{
+    size_t in = ring->in, held_in = ring->held_in;
+    size_t used = (in - ring->out) + (held_in - ring->held_out) +
+                  (writes + RING_EOF_RECORDS) * sizeof(ring_record_t);
+
+    assert(ctx && ring != &ctx->app_recv_queue && writes >= 0);
+    return (used < RING_SIZE) ? RING_SIZE - used : 0;
+}
+
+/* TRUE if a read that moved a ring's out on from old_out took its room
+ * from below RING_LOW_WATER to at least that much
+ */
+static bool_t _mysock_ring_drained(const byte_ring_t *ring, size_t old_out)
+{
+    size_t in = ring->in;
+
+    return in - old_out > RING_SIZE - RING_LOW_WATER &&
+           in - ring->out <= RING_SIZE - RING_LOW_WATER;
+}
+
+/* TRUE if there is a record to read at the head of a byte ring, so
+ * _mysock_ring_read() won't block (for its only reader)
+ */
+bool_t _mysock_ring_ready(mysock_context_t *ctx, byte_ring_t *ring)
+{
+    assert(ctx && ring);
+    return !RING_EMPTY(ring);
+}
+
+/* wait until there is a record to read in a ring */
+static void _mysock_ring_wait_record(mysock_context_t *ctx,
+                                     byte_ring_t      *ring)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ++ring->readers_waiting;
+    __sync_synchronize();
+    while (RING_EMPTY(ring))
+    {
+        _mysock_sleep(ctx, (ring != &ctx->app_recv_queue)
+                               ? &ring->app_cond : &ctx->transport_cond);
+    }
+    --ring->readers_waiting;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* read from the record at the head of a byte ring, blocking until there is
+ * one, into the specified buffer.  returns the number of bytes copied, and
+ * the record's stream in *stream and how much of it is left in *left
+ * (either may be NULL).  if remove_partial is true, and there is
+ * insufficient room in the destination buffer for the rest of the record,
+ * the rest stays at the head of the ring for the next call; otherwise it
+ * is discarded, and its length is counted in the value returned (as
+ * _mysock_dequeue_buffer() does).  an empty record reads as 0 bytes.
+ */
+size_t _mysock_ring_read(mysock_context_t *ctx,
+                         byte_ring_t      *ring,
+                         int              *stream,
+                         size_t           *left,
+                         void             *dst,
+                         size_t            max_len,
+                         bool_t            remove_partial)
+{
+    ring_buf_t *buf;
+    size_t len, old_out;
+
+    assert(ctx && ring && dst);
+
+    if (ring != &ctx->app_recv_queue)
+        PTHREAD_CALL(pthread_mutex_lock(&ring->app_lock));
+    old_out = ring->out;
+
+    /* block until ring is non-empty */
+    if (RING_EMPTY(ring))
+        _mysock_ring_wait_record(ctx, ring);
+    __sync_synchronize();   /* (see _mysock_ring_put_record()) */
+    buf = _mysock_ring_head_buf(ring);
+
+    if (!ring->head_open)
+    {
+        ring_record_t record;
+
+        _mysock_ring_get(buf, ring->out, &record, sizeof(record));
+        ring->head_open = TRUE;
+        ring->head_left = record.len;
+        ring->head_stream = record.stream;
+        ring->head_packet = record.packet;
+        ring->head_src = record.src;
+        __sync_synchronize();
+        ring->out += sizeof(record);
+    }
+
+    if (stream)
+        *stream = ring->head_stream;
+
+    len = MIN(max_len, ring->head_left);
+    if (ring->head_packet)
+        memcpy(dst, ring->head_src, len);
+    else
+        _mysock_ring_get(buf, ring->out, dst, len);
+
+    if (ring->head_left > max_len && remove_partial)
+    {
+        _mysock_ring_skip(ring, len);
+    }
+    else
+    {
+        /* the whole record is gone */
+        len = ring->head_left;
+        _mysock_ring_skip(ring, len);
+        ring->head_open = FALSE;
+        if (ring->head_packet)
+            _mysock_release_packet(ring->head_packet);
+        ring->head_packet = NULL;
+    }
+    if (left)
+        *left = ring->head_left;
+
+    /* wake up an app thread waiting for room in its ring, once there is
+     * enough for any write (the transport layer never waits for room)
+     */
+    if (ring == &ctx->app_recv_queue)
+    {
+        __sync_synchronize();
+        if (_mysock_ring_drained(ring, old_out))
+        {
+            if (ring->writers_waiting)
+                _mysock_wake_waiters(ctx, ring, FALSE);
+            _mysock_poll_notify(ctx);   /* room for the app to write */
+        }
+    }
+    else
+    {
+        /* the transport layer may be waiting for room (see APP_ROOM) */
+        __sync_fetch_and_add(&ctx->app_reads, 1);
+        if (ctx->room_waiting)
+            _mysock_wake_waiters(ctx, NULL, TRUE);
+        PTHREAD_CALL(pthread_mutex_unlock(&ring->app_lock));
+    }
+
+    return len;
 }
 
 /* free any last buffers in the specified queue, discarding the contents.
@@ -243,24 +1104,20 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
  */
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
 {
-    packet_queue_node_t *node;
+    packet_buf_t *packet;
     bool_t result = FALSE;
 
     assert(ctx && pq);
-    result = (pq->head != NULL);
-    for (node = pq->head; node; )
+    result = !PACKET_QUEUE_EMPTY(pq);
+    while ((packet = _mysock_queue_head(pq)))
     {
-        packet_queue_node_t *next = node->next;
-
-        if (node->data_len > 0)
+        pq->head = packet->next;
+        if (packet->data_len > 0)
             result = TRUE;
 
-        free(node->data);
-        free(node);
-        node = next;
+        _mysock_release_packet(packet);
     }
 
-    pq->head = pq->tail = NULL;
     return result;
 }
 
@@ -271,6 +1128,7 @@ static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
 static mysock_context_t *_mysock_allocate_context(void)
 {
     mysock_context_t *ctx = 0;
+    int k;
 
     ctx = (mysock_context_t *) calloc(1, sizeof(mysock_context_t));
     assert(ctx);
@@ -285,11 +1143,15 @@ static mysock_context_t *_mysock_allocate_context(void)
     PTHREAD_CALL(pthread_cond_init(&ctx->blocking_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->blocking_lock, NULL));
 
-    /* initialise data ready condition variable.  this is signaled when
-     * data is ready from the application or the network.
+    /* initialise the condition variables for data being ready from the
+     * application or the network: the transport layer's, signaled when
+     * there is something for it, and each ring's, for the app.
      */
-    PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ctx->transport_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
+    _mysock_ring_init(&ctx->app_recv_queue);
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+        _mysock_ring_init(&ctx->app_send_queue[k]);
 
     ctx->blocking = TRUE;   /* we unblock once we're connected */
 
@@ -313,14 +1175,14 @@ static mysock_context_t *_mysock_allocate_context(void)
  */
 void _mysock_free_context(mysock_context_t *ctx)
 {
-    int sd;
+    int sd, k;
 
     assert(ctx);
 
     PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
 
-    PTHREAD_CALL(pthread_cond_destroy(&ctx->data_ready_cond));
+    PTHREAD_CALL(pthread_cond_destroy(&ctx->transport_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
 
     /* free any last buffers that might be lying around (e.g. retransmitted
@@ -329,8 +1191,9 @@ void _mysock_free_context(mysock_context_t *ctx)
      * legitimately have retransmitted packets, so silently discard these.
      */
     (void) _mysock_free_queue(ctx, &ctx->network_recv_queue);
-    (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
-    (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
+    _mysock_ring_free(&ctx->app_recv_queue);
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+        _mysock_ring_free(&ctx->app_send_queue[k]);
 
     _network_close(&ctx->network_state);
 
@@ -343,13 +1206,13 @@ void _mysock_free_context(mysock_context_t *ctx)
     free(ctx);
 }
 
-/* transport layer thread; transport_init() should not return until the
+/* transport layer fiber; transport_init() should not return until the
  * transport layer finishes (i.e. the connection is over).
  */
 static void *transport_thread_func(void *arg_ptr)
 {
     mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
-    char eof_packet;
+    int k;
 
     assert(ctx);
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
@@ -391,10 +1254,20 @@ static void *transport_thread_func(void *arg_ptr)
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
     }
 
+    /* nothing is taken out of the app's queue any more, so don't let
+     * mywrite() wait for room in it.
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->transport_done = TRUE;
+    _mysock_wake_app(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    _mysock_poll_notify(ctx);
+
     /* force final myread() to return 0 bytes (this should have been done
      * by the transport layer already in response to the peer's FIN).
      */
-    _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+        _mysock_ring_write(ctx, &ctx->app_send_queue[k], 0, NULL, 0, FALSE);
     return NULL;
 }
 
@@ -11,6 +11,7 @@
 #error need to define uint32_t
 #endif
 
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -28,12 +29,118 @@ typedef int mysocket_t;     /* mysocket descriptor */
 
 
 /* maximum number of mysockets per process */
-#define MAX_NUM_CONNECTIONS 64
+#define MAX_NUM_CONNECTIONS 1024
 
 #if (MAX_NUM_CONNECTIONS & (MAX_NUM_CONNECTIONS - 1)) != 0
     #error MAX_NUM_CONNECTIONS should be a power of two
 #endif
 
+/* maximum number of streams per connection (see MYSO_STREAMS) */
+#define MYSOCK_MAX_STREAMS 16
+
+/* largest mywrite() in message mode (see MYSO_MESSAGES) */
+#define MYSOCK_MAX_MESSAGE (64 * 1024)
+
+
+/* per-mysocket options, set with mysetsockopt().  options set on a
+ * listening mysocket are inherited by the connections accepted on it.
+ */
+enum
+{
+    /* if non-zero, data passed to mywrite() before myconnect() is sent in
+     * the SYN, provided a cookie from an earlier connection to the same
+     * server is cached.  on a listening mysocket, accept such data and
+     * issue cookies to clients that ask for them.
+     */
+    MYSO_FASTOPEN = 0,
+
+    /* milliseconds myconnect() (or a connection being accepted) may spend
+     * on the handshake before failing with ETIMEDOUT; 0 selects the
+     * default of 7 seconds.
+     */
+    MYSO_CONNECT_TIMEOUT,
+
+    /* number of independent streams wanted on the connection, up to
+     * MYSOCK_MAX_STREAMS; 0 or 1 gives a single byte stream.  the
+     * connection gets as many as both ends asked for (or a single stream
+     * if either didn't ask), and mygetsockopt() returns that number once
+     * it is established.  each stream has its own sequence space and is
+     * read with myread_stream(), so a lost segment holds up only its own
+     * stream.  myread()/mywrite() use stream 0.
+     */
+    MYSO_STREAMS,
+
+    /* if non-zero (on both ends), each mywrite() is sent as one message
+     * of up to MYSOCK_MAX_MESSAGE bytes, and each myread() returns one
+     * whole message; any part of it that doesn't fit in the buffer is
+     * discarded.  empty messages are not sent.  mygetsockopt() tells
+     * whether the connection got message mode once it is established.
+     */
+    MYSO_MESSAGES,
+
+    /* lifetime of written data in milliseconds, or 0 (the default) for
+     * fully reliable delivery.  data still unacknowledged this long after
+     * it was first sent is not retransmitted any more; the peer is told to
+     * skip it and passes up what did arrive instead of waiting for it.  in
+     * message mode whole messages are dropped, never parts of one.
+     */
+    MYSO_LIFETIME,
+
+    /* if non-zero (on both ends), data segments are followed by XOR
+     * parity segments, one per group of a few segments, so a single lost
+     * segment in a group is rebuilt by the receiver instead of resent.
+     * the groups get smaller as more loss is seen.
+     */
+    MYSO_FEC,
+
+    /* if non-zero (on both ends), data is compressed with a fast LZ77
+     * codec before it is put in segments, each stream keeping its
+     * history across segments.  not used with MYSO_LIFETIME.
+     */
+    MYSO_COMPRESS,
+
+    /* if non-zero (on both ends), each segment carries a CRC32C instead of
+     * the 16-bit TCP checksum, which misses more kinds of corruption.  it
+     * is computed with the SSE4.2 crc32 instruction where there is one.
+     */
+    MYSO_CRC32C,
+
+    /* if non-zero (on both ends) on reliable mysockets, the connection
+     * trusts the network below to deliver every segment in order and
+     * intact: segments are sent without a checksum, nothing is kept for
+     * retransmission or timed, and more data is let out before it is
+     * acknowledged.  the segments themselves are unchanged.
+     * mygetsockopt() tells whether the connection got it once it is
+     * established.
+     */
+    MYSO_FASTPATH,
+
+    /* if non-zero, calls on the mysocket don't wait.  myread() fails with
+     * EAGAIN if there is nothing to read yet; mywrite() takes as much as
+     * there is room for and returns that count (in message mode, the whole
+     * message or nothing), failing with EAGAIN if there is no room at all;
+     * myaccept() fails with EAGAIN if no connection has been established.
+     * myconnect() starts the handshake and fails with EINPROGRESS; calling
+     * it again fails with EALREADY until the handshake is over, then
+     * returns 0, or fails with the handshake's error.
+     */
+    MYSO_NONBLOCK,
+
+    /* if non-zero, the connection's transport layer runs on the app's
+     * thread where it can, instead of being handed the work: mywrite()
+     * sends what the window allows before returning, and myread() deals
+     * with arrived segments (ACKs as well as data) itself while it waits.
+     * the transport layer only runs in the background for its timers
+     * (retransmissions, say) and for segments that arrive while nothing
+     * is waiting in myread() or mywrite().  this saves a wake-up and a
+     * switch of threads each way, for request/response traffic.  it only
+     * concerns this end.
+     */
+    MYSO_INLINE,
+
+    MYSO_NUM_OPTIONS
+};
+
 
 extern mysocket_t mysocket(bool_t is_reliable);
 extern int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen);
@@ -43,15 +150,138 @@ extern int myaccept(mysocket_t sd, struct sockaddr* addr, int *addrlen);
 extern int myclose(mysocket_t sd);
 extern int myread(mysocket_t sd, void *buffer, size_t length);
 extern int mywrite(mysocket_t sd, const void *buffer, size_t length);
+extern int myread_stream(mysocket_t sd, int stream, void *buffer,
+                         size_t length);
+extern int mywrite_stream(mysocket_t sd, int stream, const void *buffer,
+                          size_t length);
 extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
+extern int mysetsockopt(mysocket_t sd, int option, int value);
+extern int mygetsockopt(mysocket_t sd, int option, int *value);
 
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
  */
 extern uint32_t mylocalip(uint32_t peer_addr);
 
+/* waiting for any of several mysockets to be ready.  a mysocket is
+ * readable (MYPOLLIN) if myread() wouldn't block, or for a listening
+ * mysocket, myaccept() wouldn't; writable (MYPOLLOUT) once connected, if
+ * mywrite() has room.  MYPOLLERR (the connection couldn't be made) and
+ * MYPOLLHUP (the connection is over) are reported whether asked for or
+ * not.
+ */
+#define MYPOLLIN   0x001
+#define MYPOLLOUT  0x004
+#define MYPOLLERR  0x008
+#define MYPOLLHUP  0x010
+#define MYPOLLNVAL 0x020    /* not a mysocket (mypoll() only) */
+
+struct mypollfd
+{
+    mysocket_t sd;
+    short      events;      /* asked for */
+    short      revents;     /* returned */
+};
+
+/* as poll(): wait up to timeout milliseconds (-1 for ever) for any of the
+ * nfds mysockets in fds to be ready, returning how many are.
+ */
+extern int mypoll(struct mypollfd *fds, int nfds, int timeout);
+
+/* as epoll: a set of mysockets, registered once with myepoll_ctl(), that
+ * myepoll_wait() waits on.  a mysocket is reported as long as it is ready
+ * (level triggered), or with MYEPOLLET in its events, only once each time
+ * something arrives for it (edge triggered), so the app should read, write
+ * or accept until EAGAIN (see MYSO_NONBLOCK).  mysockets leave the set
+ * when they are closed.
+ */
+#define MYEPOLLET 0x80000000
+
+enum { MYEPOLL_CTL_ADD, MYEPOLL_CTL_MOD, MYEPOLL_CTL_DEL };
+
+struct myepoll_event
+{
+    uint32_t   events;
+    mysocket_t sd;          /* filled in by myepoll_wait() */
+    void      *data;        /* given to myepoll_ctl(), passed back */
+};
+
+extern int myepoll_create(void);
+extern int myepoll_ctl(int epd, int op, mysocket_t sd,
+                       struct myepoll_event *event);
+extern int myepoll_wait(int epd, struct myepoll_event *events,
+                        int max_events, int timeout);
+extern int myepoll_close(int epd);
+
+/* asynchronous calls.  the app queues operations on a submission ring,
+ * hands them all over with one myaio_submit(), and collects their results
+ * from a completion ring with myaio_reap(), each tagged with the
+ * user_data it was submitted with.  nothing the app does waits, except
+ * myaio_reap() if asked to.  a read is filled in directly by the
+ * transport layer as the data comes in, if it is posted before then.  a
+ * write completes once all of it has been queued for sending.  an
+ * operation still in progress on a mysocket when it is closed completes
+ * with -ECANCELED.
+ */
+enum
+{
+    MYAIO_READ,         /* myread_stream(sd, stream, buf, len) */
+    MYAIO_WRITE,        /* mywrite_stream(sd, stream, buf, len) */
+    MYAIO_ACCEPT,       /* myaccept(sd, addr, ...); res is the new sd */
+    MYAIO_CONNECT,      /* myconnect(sd, addr, addrlen) */
+    MYAIO_CLOSE         /* myclose(sd) */
+};
+
+struct myaio_sqe
+{
+    int              opcode;
+    mysocket_t       sd;
+    int              stream;
+    void            *buf;
+    size_t           len;
+    struct sockaddr *addr;      /* (a struct sockaddr is filled in) */
+    int              addrlen;
+    void            *user_data;
+};
+
+struct myaio_cqe
+{
+    void *user_data;
+    int   res;          /* as the call would return, or -errno */
+};
+
+/* a pair of rings for up to entries operations in progress at once */
+extern int myaio_setup(unsigned int entries);
+
+/* the next free entry on the submission ring, to be filled in, or NULL if
+ * it is full
+ */
+extern struct myaio_sqe *myaio_get_sqe(int aio);
+
+/* start the operations filled in since the last call.  returns how many
+ * were, or -1 (EBUSY) if as many as the rings were set up for are still
+ * in progress.
+ */
+extern int myaio_submit(int aio);
+
+/* copy up to max_cqes results into cqes, first waiting up to timeout
+ * milliseconds (-1 for ever) for at least min_complete of them.  returns
+ * how many were copied.
+ */
+extern int myaio_reap(int aio, struct myaio_cqe *cqes, int max_cqes,
+                      int min_complete, int timeout);
+
+/* fails with EBUSY while operations are in progress */
+extern int myaio_close(int aio);
+
+/* print to fp, one line per pool, how many segments, queued buffers and
+ * timers have come from the pools the mysocket layer keeps, and how much
+ * memory the pools took from the heap for them.
+ */
+extern void mypoolstats(FILE *fp);
+
 #endif  /* __MYSOCK_H__ */
 
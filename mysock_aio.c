@@ -0,0 +1,805 @@
+/* mysock_aio.c--asynchronous calls through a submission and a completion
+ * ring: myaio_*() (see mysock.h).
+ *
+ * an operation submitted is tried at once, without waiting, much as a
+ * MYSO_NONBLOCK call would be.  if it can't finish yet, it is parked on its
+ * mysocket until it can:
+ *
+ * - a read is kept on a list per stream, under the mysocket's
+ *   data_ready_lock.  the transport layer, as it passes data up, copies it
+ *   straight into the buffers of the reads on that list and completes them
+ *   (_mysock_aio_fill()), rather than putting it on the ring for myread().
+ *   (the ring has no lock, so a read may be parked just as data goes on
+ *   it; whichever of the two notices has the aio thread pass it on.)
+ *
+ * - any other operation is kept on a list per mysocket, in submission
+ *   order, under aio_lock.  wherever a blocked call would have been woken
+ *   up, _mysock_poll_notify() hands the mysocket to the aio thread, which
+ *   tries its operations again from the front of the list.  (doing that in
+ *   the thread that notified could mean closing a mysocket from its own
+ *   transport thread.)  a close waits there for the transport layer to
+ *   report that it is done, and then frees the mysocket, cancelling
+ *   whatever was submitted behind it.
+ *
+ * either way, a result goes on the completion ring of the rings the
+ * operation came from, for myaio_reap().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "pool.h"
+
+
+/* maximum number of ring pairs per process */
+#define MAX_NUM_AIO_RINGS MAX_NUM_CONNECTIONS
+
+typedef struct aio_ring
+{
+    unsigned int      entries;
+    struct myaio_sqe *sq;           /* used by the submitting thread only */
+    unsigned int      sq_head;      /* next to be submitted */
+    unsigned int      sq_tail;      /* next to be handed out */
+
+    pthread_mutex_t   lock;         /* protects the rest */
+    pthread_cond_t    cond;         /* signaled as results are posted */
+    struct myaio_cqe *cq;
+    unsigned int      cq_head;      /* next to be reaped */
+    unsigned int      cq_tail;      /* next to be posted */
+    unsigned int      in_flight;    /* submitted, and not yet reaped */
+} aio_ring_t;
+
+/* an operation in progress */
+typedef struct aio_op
+{
+    struct myaio_sqe  sqe;
+    aio_ring_t       *ring;
+    size_t            done;         /* bytes written so far */
+    struct aio_op    *next;         /* on a mysocket's list */
+} aio_op_t;
+
+static pool_t aio_op_pool = POOL_INITIALIZER("aio op", sizeof(aio_op_t));
+
+/* ring table.  aio_lock protects it, and each mysocket's list of parked
+ * operations (other than reads) and the list of mysockets for the aio
+ * thread to look at.  it is taken before any mysocket lock, and a ring's
+ * lock is taken after any of them.
+ */
+static aio_ring_t *aio_rings[MAX_NUM_AIO_RINGS];
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_retry_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t aio_idle_cond = PTHREAD_COND_INITIALIZER;
+static mysock_context_t *aio_retry_head = NULL, *aio_retry_tail = NULL;
+static bool_t aio_thread_started = FALSE;
+
+static aio_ring_t *_aio_get_ring(int aio);
+static void _aio_submit(aio_ring_t *ring, const struct myaio_sqe *sqe);
+static int _aio_try(aio_op_t *op);
+static void _aio_park(mysock_context_t *ctx, aio_op_t *op);
+static void _aio_queue_retry(mysock_context_t *ctx);
+static void _aio_complete(aio_op_t *op, int res);
+static void _aio_feed_reads(mysock_context_t *ctx);
+static void _aio_cancel(mysock_context_t *ctx);
+static bool_t _aio_close(mysock_context_t *ctx, aio_op_t *op);
+static void *_aio_thread_func(void *arg);
+
+
+/* called by the transport layer, with data_ready_lock held, to pass len
+ * bytes at src up on the given stream while reads are parked on it (and
+ * nothing is queued ahead of them).  they are copied into the reads'
+ * buffers, one read after another, or in message mode, as much of the
+ * message as fits into the first; an empty record (EOF) completes them
+ * all.  returns TRUE if everything was taken, or else FALSE, with src and
+ * len moved past what was.
+ */
+bool_t _mysock_aio_fill(mysock_context_t *ctx, int stream,
+                        const char **src, size_t *len)
+{
+    aio_op_t *op;
+
+    assert(ctx && src && len);
+    assert(stream >= 0 && stream < MYSOCK_MAX_STREAMS);
+
+    if (*len == 0)
+    {
+        while ((op = ctx->aio_reads[stream]))
+        {
+            ctx->aio_reads[stream] = op->next;
+            _aio_complete(op, 0);
+        }
+        ctx->eof[stream] = TRUE;
+        return TRUE;
+    }
+
+    while (*len > 0 && (op = ctx->aio_reads[stream]))
+    {
+        size_t n = MIN(*len, op->sqe.len);
+
+        ctx->aio_reads[stream] = op->next;
+        memcpy(op->sqe.buf, *src, n);
+        _aio_complete(op, (int) n);
+
+        if (ctx->options[MYSO_MESSAGES])
+            return TRUE;    /* the rest of the message is dropped */
+        *src += n;
+        *len -= n;
+    }
+
+    return (*len == 0);
+}
+
+/* called wherever _mysock_poll_notify() is, if operations may be parked
+ * on the mysocket: have the aio thread try them again.
+ */
+void _mysock_aio_notify(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    ++ctx->aio_gen;
+    if (ctx->aio_ops)
+        _aio_queue_retry(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+}
+
+/* called where data may have gone on a stream's ring while reads were
+ * being parked on it, with no mysocket locks held: have the aio thread
+ * give it to them
+ */
+void _mysock_aio_feed(mysock_context_t *ctx)
+{
+    bool_t parked = FALSE;
+    int k;
+
+    assert(ctx);
+
+    /* (a mysocket being closed has no reads left parked) */
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+        parked = parked || ctx->aio_reads[k];
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    if (parked)
+    {
+        ctx->aio_feed = TRUE;
+        _aio_queue_retry(ctx);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+}
+
+/* complete every operation parked on a mysocket that is being closed with
+ * -ECANCELED, once the aio thread has finished with it
+ */
+void _mysock_aio_forget(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    while (ctx->aio_busy)
+        PTHREAD_CALL(pthread_cond_wait(&aio_idle_cond, &aio_lock));
+    _aio_cancel(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+}
+
+
+int myaio_setup(unsigned int entries)
+{
+    aio_ring_t *ring;
+    int k;
+
+    if (entries == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ring = (aio_ring_t *) calloc(1, sizeof(aio_ring_t));
+    assert(ring);
+    ring->entries = entries;
+    ring->sq = (struct myaio_sqe *) calloc(entries, sizeof(*ring->sq));
+    ring->cq = (struct myaio_cqe *) calloc(entries, sizeof(*ring->cq));
+    assert(ring->sq && ring->cq);
+    PTHREAD_CALL(pthread_mutex_init(&ring->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ring->cond, NULL));
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    if (!aio_thread_started)
+    {
+        (void) _mysock_create_thread(_aio_thread_func, NULL, TRUE);
+        aio_thread_started = TRUE;
+    }
+    for (k = 0; k < MAX_NUM_AIO_RINGS; ++k)
+    {
+        if (!aio_rings[k])
+        {
+            aio_rings[k] = ring;
+            PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+            return k;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+
+    PTHREAD_CALL(pthread_cond_destroy(&ring->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ring->lock));
+    free(ring->sq);
+    free(ring->cq);
+    free(ring);
+    errno = EMFILE;
+    return -1;
+}
+
+struct myaio_sqe *myaio_get_sqe(int aio)
+{
+    aio_ring_t *ring;
+    struct myaio_sqe *sqe;
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    ring = _aio_get_ring(aio);
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+    if (!ring)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+    if (ring->sq_tail - ring->sq_head >= ring->entries)
+    {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    sqe = &ring->sq[ring->sq_tail++ % ring->entries];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int myaio_submit(int aio)
+{
+    aio_ring_t *ring;
+    unsigned int room;
+    int num_submitted = 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    ring = _aio_get_ring(aio);
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+    if (!ring)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* so that the completion ring never overflows, no more operations go
+     * in than there are completions free for
+     */
+    PTHREAD_CALL(pthread_mutex_lock(&ring->lock));
+    room = ring->entries - ring->in_flight;
+    if (room > ring->sq_tail - ring->sq_head)
+        room = ring->sq_tail - ring->sq_head;
+    ring->in_flight += room;
+    PTHREAD_CALL(pthread_mutex_unlock(&ring->lock));
+
+    if (room == 0 && ring->sq_tail != ring->sq_head)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    while (room-- > 0)
+    {
+        _aio_submit(ring, &ring->sq[ring->sq_head % ring->entries]);
+        ++ring->sq_head;
+        ++num_submitted;
+    }
+
+    return num_submitted;
+}
+
+int myaio_reap(int aio, struct myaio_cqe *cqes, int max_cqes,
+               int min_complete, int timeout)
+{
+    struct timespec deadline;
+    aio_ring_t *ring;
+    int num_cqes = 0;
+
+    if (!cqes || max_cqes <= 0 || min_complete > max_cqes)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    ring = _aio_get_ring(aio);
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+    if (!ring)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (timeout > 0)
+    {
+        struct timeval now;
+
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + timeout / 1000;
+        deadline.tv_nsec = now.tv_usec * 1000 + (timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring->lock));
+    while (timeout != 0 && ring->cq_tail - ring->cq_head <
+                           (unsigned int) (min_complete > 0 ? min_complete : 0))
+    {
+        int rc;
+
+        if (timeout < 0)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ring->cond, &ring->lock));
+        }
+        else if ((rc = pthread_cond_timedwait(&ring->cond, &ring->lock,
+                                              &deadline)) == ETIMEDOUT)
+        {
+            break;
+        }
+        else
+        {
+            PTHREAD_CALL(rc);
+        }
+    }
+
+    while (num_cqes < max_cqes && ring->cq_head != ring->cq_tail)
+    {
+        cqes[num_cqes++] = ring->cq[ring->cq_head++ % ring->entries];
+        --ring->in_flight;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ring->lock));
+
+    return num_cqes;
+}
+
+int myaio_close(int aio)
+{
+    aio_ring_t *ring;
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    if (!(ring = _aio_get_ring(aio)))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+        errno = EBADF;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring->lock));
+    if (ring->in_flight > 0)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&ring->lock));
+        PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+        errno = EBUSY;
+        return -1;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ring->lock));
+
+    aio_rings[aio] = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+
+    PTHREAD_CALL(pthread_cond_destroy(&ring->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ring->lock));
+    free(ring->sq);
+    free(ring->cq);
+    free(ring);
+    return 0;
+}
+
+
+/* a ring pair by number, or NULL.  the caller holds aio_lock. */
+static aio_ring_t *_aio_get_ring(int aio)
+{
+    return (aio >= 0 && aio < MAX_NUM_AIO_RINGS) ? aio_rings[aio] : NULL;
+}
+
+/* start one operation, which has a completion reserved for it */
+static void _aio_submit(aio_ring_t *ring, const struct myaio_sqe *sqe)
+{
+    mysock_context_t *ctx = _mysock_get_context(sqe->sd);
+    aio_op_t *op;
+    unsigned int gen;
+    int res;
+
+    op = (aio_op_t *) pool_zalloc(&aio_op_pool);
+    op->sqe = *sqe;
+    op->ring = ring;
+
+    if (!ctx)
+    {
+        _aio_complete(op, -EBADF);
+        return;
+    }
+
+    switch (sqe->opcode)
+    {
+    case MYAIO_READ:
+        if (sqe->stream < 0 || sqe->stream >= MYSOCK_MAX_STREAMS ||
+            ctx->listening)
+        {
+            _aio_complete(op, -EINVAL);
+            return;
+        }
+        if (sqe->len == 0)
+        {
+            _aio_complete(op, 0);
+            return;
+        }
+
+        /* park the read unless there is something to give it now */
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        if (!ctx->eof[sqe->stream] &&
+            (ctx->aio_reads[sqe->stream] ||
+             RING_EMPTY(&ctx->app_send_queue[sqe->stream])))
+        {
+            aio_op_t **p;
+            bool_t missed;
+
+            for (p = &ctx->aio_reads[sqe->stream]; *p; p = &(*p)->next)
+                ;
+            *p = op;
+
+            /* the transport layer doesn't take the lock to put data on
+             * the ring, so look at it again now the read is there to see
+             */
+            __sync_synchronize();
+            missed = !RING_EMPTY(&ctx->app_send_queue[sqe->stream]);
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+            if (missed)
+                _mysock_aio_feed(ctx);
+            return;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        res = _mysock_read(sqe->sd, sqe->stream, sqe->buf, sqe->len, FALSE);
+        _aio_complete(op, (res < 0) ? -errno : res);
+        return;
+
+    case MYAIO_CLOSE:
+        /* as myclose() does, but parked on the aio thread until the
+         * transport layer is done, rather than waiting for it here
+         */
+        _mysock_aio_forget(ctx);
+        res = _mysock_close(sqe->sd, FALSE);
+        if (res == 0 || errno != EAGAIN)
+        {
+            _aio_complete(op, (res < 0) ? -errno : 0);
+            return;
+        }
+
+        /* (the transport layer may have finished since) */
+        PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+        ++ctx->aio_waiting;
+        _aio_park(ctx, op);
+        _aio_queue_retry(ctx);
+        PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+        return;
+
+    case MYAIO_WRITE:
+        if (sqe->len == 0)
+        {
+            _aio_complete(op, 0);
+            return;
+        }
+        break;
+
+    case MYAIO_ACCEPT:
+    case MYAIO_CONNECT:
+        break;
+
+    default:
+        _aio_complete(op, -EINVAL);
+        return;
+    }
+
+    /* anything parked already goes first */
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    ++ctx->aio_waiting;
+    if (ctx->aio_ops || ctx->aio_busy)
+    {
+        _aio_park(ctx, op);
+        PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+        return;
+    }
+    gen = ctx->aio_gen;
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+
+    res = _aio_try(op);
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    if (res == -EAGAIN)
+    {
+        _aio_park(ctx, op);
+
+        /* (in case the notification came while it was being tried) */
+        if (gen != ctx->aio_gen)
+            _aio_queue_retry(ctx);
+    }
+    else
+    {
+        --ctx->aio_waiting;
+        _aio_complete(op, res);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+}
+
+/* as much of an operation (other than a read or close) as can be done
+ * without waiting.  returns its result, or -EAGAIN if it isn't finished.
+ */
+static int _aio_try(aio_op_t *op)
+{
+    struct myaio_sqe *sqe = &op->sqe;
+    int rc;
+
+    switch (sqe->opcode)
+    {
+    case MYAIO_WRITE:
+        rc = _mysock_write(sqe->sd, sqe->stream,
+                           (const char *) sqe->buf + op->done,
+                           sqe->len - op->done, FALSE);
+        if (rc < 0)
+            return -errno;
+        if ((op->done += rc) < sqe->len)
+            return -EAGAIN;
+        return (int) op->done;
+
+    case MYAIO_ACCEPT:
+        rc = _mysock_accept(sqe->sd, sqe->addr,
+                            sqe->addr ? &sqe->addrlen : NULL, FALSE);
+        break;
+
+    case MYAIO_CONNECT:
+        rc = _mysock_connect(sqe->sd, sqe->addr, sqe->addrlen, FALSE);
+        if (rc < 0 && (errno == EINPROGRESS || errno == EALREADY))
+            return -EAGAIN;
+        break;
+
+    default:
+        assert(0);
+        return -EINVAL;
+    }
+
+    return (rc < 0) ? -errno : rc;
+}
+
+/* put an operation on the end of its mysocket's list.  the caller holds
+ * aio_lock.
+ */
+static void _aio_park(mysock_context_t *ctx, aio_op_t *op)
+{
+    aio_op_t **p;
+
+    for (p = &ctx->aio_ops; *p; p = &(*p)->next)
+        ;
+    op->next = NULL;
+    *p = op;
+}
+
+/* put a mysocket on the end of the aio thread's list, if it isn't there
+ * already.  the caller holds aio_lock.
+ */
+static void _aio_queue_retry(mysock_context_t *ctx)
+{
+    if (ctx->aio_queued)
+        return;
+
+    ctx->aio_queued = TRUE;
+    ctx->aio_retry_next = NULL;
+    if (aio_retry_tail)
+        aio_retry_tail->aio_retry_next = ctx;
+    else
+        aio_retry_head = ctx;
+    aio_retry_tail = ctx;
+    PTHREAD_CALL(pthread_cond_signal(&aio_retry_cond));
+}
+
+/* post an operation's result on its completion ring, and free it */
+static void _aio_complete(aio_op_t *op, int res)
+{
+    aio_ring_t *ring = op->ring;
+    struct myaio_cqe *cqe;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring->lock));
+    assert(ring->cq_tail - ring->cq_head < ring->entries);
+    cqe = &ring->cq[ring->cq_tail++ % ring->entries];
+    cqe->user_data = op->sqe.user_data;
+    cqe->res = res;
+    PTHREAD_CALL(pthread_mutex_unlock(&ring->lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&ring->cond));
+
+    pool_free(&aio_op_pool, op);
+}
+
+/* take every operation parked on a mysocket off it, and off the aio
+ * thread's list, completing them with -ECANCELED.  the caller holds
+ * aio_lock, and the aio thread isn't busy with the mysocket (or is the
+ * caller).
+ */
+static void _aio_cancel(mysock_context_t *ctx)
+{
+    aio_op_t *op;
+    mysock_context_t **p;
+    int k;
+
+    if (ctx->aio_queued)
+    {
+        mysock_context_t *prev = NULL;
+
+        for (p = &aio_retry_head; *p != ctx; p = &(*p)->aio_retry_next)
+            prev = *p;
+        *p = ctx->aio_retry_next;
+        if (aio_retry_tail == ctx)
+            aio_retry_tail = prev;
+        ctx->aio_queued = FALSE;
+    }
+
+    while ((op = ctx->aio_ops))
+    {
+        ctx->aio_ops = op->next;
+        _aio_complete(op, -ECANCELED);
+    }
+    ctx->aio_waiting = 0;
+    ctx->aio_feed = FALSE;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+    {
+        while ((op = ctx->aio_reads[k]))
+        {
+            ctx->aio_reads[k] = op->next;
+            _aio_complete(op, -ECANCELED);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* finish a MYAIO_CLOSE at the front of a mysocket's list, on the aio
+ * thread, with aio_lock held.  returns FALSE if the transport layer isn't
+ * done yet; otherwise the mysocket is gone (and the lock was let go of
+ * meanwhile).
+ */
+static bool_t _aio_close(mysock_context_t *ctx, aio_op_t *op)
+{
+    int res;
+
+    assert(ctx->aio_ops == op && op->sqe.opcode == MYAIO_CLOSE);
+
+    if (!_mysock_transport_finished(ctx))
+        return FALSE;
+
+    ctx->aio_ops = op->next;
+    _aio_cancel(ctx);
+    ctx->aio_busy = FALSE;
+    PTHREAD_CALL(pthread_cond_broadcast(&aio_idle_cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+
+    res = _mysock_close(op->sqe.sd, FALSE);
+    assert(res == 0 || errno != EAGAIN);
+    _aio_complete(op, (res < 0) ? -errno : 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    return TRUE;
+}
+
+/* give the reads parked on a mysocket what is on their streams' rings,
+ * with myread()'s non-blocking path, oldest read first
+ */
+static void _aio_feed_reads(mysock_context_t *ctx)
+{
+    int k;
+
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+    {
+        for (;;)
+        {
+            aio_op_t *op = NULL;
+            int res;
+
+            PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+            if (ctx->aio_reads[k] &&
+                (ctx->eof[k] || !RING_EMPTY(&ctx->app_send_queue[k])))
+            {
+                op = ctx->aio_reads[k];
+                ctx->aio_reads[k] = op->next;
+            }
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+            if (!op)
+                break;
+
+            res = _mysock_read(op->sqe.sd, k, op->sqe.buf, op->sqe.len, FALSE);
+            if (res < 0 && errno == EAGAIN)
+            {
+                /* (a myread() got there first) */
+                PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+                op->next = ctx->aio_reads[k];
+                ctx->aio_reads[k] = op;
+                PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+                break;
+            }
+            _aio_complete(op, (res < 0) ? -errno : res);
+        }
+    }
+}
+
+/* the aio thread: try the operations parked on each mysocket handed to it
+ * again, in order, until one still can't finish
+ */
+static void *_aio_thread_func(void *arg)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+    for (;;)
+    {
+        mysock_context_t *ctx;
+        unsigned int gen;
+        aio_op_t *op;
+
+        while (!(ctx = aio_retry_head))
+            PTHREAD_CALL(pthread_cond_wait(&aio_retry_cond, &aio_lock));
+
+        if (!(aio_retry_head = ctx->aio_retry_next))
+            aio_retry_tail = NULL;
+        ctx->aio_queued = FALSE;
+        ctx->aio_busy = TRUE;
+        gen = ctx->aio_gen;
+
+        if (ctx->aio_feed)
+        {
+            ctx->aio_feed = FALSE;
+            PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+            _aio_feed_reads(ctx);
+            PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+        }
+
+        while ((op = ctx->aio_ops))
+        {
+            int res;
+
+            if (op->sqe.opcode == MYAIO_CLOSE)
+            {
+                if (_aio_close(ctx, op))
+                {
+                    ctx = NULL;
+                    break;
+                }
+                res = -EAGAIN;
+            }
+            else
+            {
+                PTHREAD_CALL(pthread_mutex_unlock(&aio_lock));
+                res = _aio_try(op);
+                PTHREAD_CALL(pthread_mutex_lock(&aio_lock));
+            }
+
+            if (res == -EAGAIN)
+            {
+                /* nothing more to do, unless notified meanwhile */
+                if (gen == ctx->aio_gen)
+                    break;
+                gen = ctx->aio_gen;
+                continue;
+            }
+
+            ctx->aio_ops = op->next;
+            --ctx->aio_waiting;
+            _aio_complete(op, res);
+        }
+
+        if (ctx)
+        {
+            ctx->aio_busy = FALSE;
+            PTHREAD_CALL(pthread_cond_broadcast(&aio_idle_cond));
+        }
+    }
+
+    return NULL;
+}
@@ -12,6 +12,7 @@
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "connection_demux.h"
+#include "pool.h"
 
 
 /* MYSOCK_CHECK(cond,rc) checks that 'cond' is true; if it isn't, error
@@ -49,6 +50,32 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     mysock_context_t *ctx = _mysock_get_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EINVAL);
+    return _mysock_connect(sd, name, namelen, !ctx->options[MYSO_NONBLOCK]);
+}
+
+/* myconnect(), waiting for the handshake to finish only if block is true
+ * (see MYSO_NONBLOCK)
+ */
+int _mysock_connect(mysocket_t sd, struct sockaddr *name, int namelen,
+                    bool_t block)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EINVAL);
+
+    if (ctx->connect_pending)
+    {
+        /* called again after a non-blocking myconnect(), to see whether
+         * the handshake has finished
+         */
+        int rc = _mysock_wait_for_connection(ctx, FALSE);
+
+        if (rc < 0 && errno == EAGAIN)
+            MYSOCK_ERROR_EXIT(EALREADY);
+        ctx->connect_pending = FALSE;
+        return rc;
+    }
+
     MYSOCK_CHECK((ctx->network_state.peer_addr_len == 0), EISCONN);
 
 #ifdef DEBUG
@@ -80,11 +107,28 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     /* time for kick off */
     _mysock_transport_init(sd, TRUE);
 
+    if (!block)
+    {
+        ctx->connect_pending = TRUE;
+        MYSOCK_ERROR_EXIT(EINPROGRESS);
+    }
+
     /* block until connection is established, or we hit an error */
-    return _mysock_wait_for_connection(ctx);
+    return _mysock_wait_for_connection(ctx, TRUE);
 }
 
 mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
+{
+    mysock_context_t *accept_ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(accept_ctx != NULL, EBADF);
+    return _mysock_accept(sd, addr, addrlen,
+                          !accept_ctx->options[MYSO_NONBLOCK]);
+}
+
+/* myaccept(), waiting for a connection only if block is true */
+mysocket_t _mysock_accept(mysocket_t sd, struct sockaddr *addr, int *addrlen,
+                          bool_t block)
 {
     mysock_context_t *accept_ctx = _mysock_get_context(sd);
     mysock_context_t *ctx;
@@ -102,7 +146,10 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
     /* the new socket is created on an incoming SYN.  block here until we
      * establish a connection, or STCP indicates an error condition.
      */
-    _mysock_dequeue_connection(accept_ctx, &ctx);
+    if (!_mysock_dequeue_connection(accept_ctx, &ctx, block))
+    {
+        MYSOCK_ERROR_EXIT(EAGAIN);
+    }
     assert(ctx);
 
     if (!ctx->stcp_errno)
@@ -118,8 +165,22 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
     }
 
     assert(ctx->listen_sd == sd);
+    if (ctx->stcp_errno)
+    {
+        /* the handshake failed; the application never sees this mysocket,
+         * so release it here.
+         */
+        int stcp_errno = ctx->stcp_errno;
+
+        DEBUG_LOG(("***myaccept(%d) failed: errno %d***\n", sd, stcp_errno));
+        myclose(ctx->my_sd);
+        errno = stcp_errno;
+        return -1;
+    }
+
     DEBUG_LOG(("***myaccept(%d) returning new sd %d***\n", sd, ctx->my_sd));
-    return (errno = ctx->stcp_errno) ? -1 : ctx->my_sd;
+    errno = 0;
+    return ctx->my_sd;
 }
 
 /* in this implementation, mylisten() is assumed to follow mybind() */
@@ -144,7 +205,7 @@ int mylisten(mysocket_t sd, int backlog)
      * _mysock_transport_init() is never called for such sockets), we
      * begin receiving network packets here...
      */
-    if (_network_start_recv_thread(ctx) < 0)
+    if (_network_start_recv(ctx) < 0)
     {
         assert(0);
         return -1;
@@ -165,22 +226,40 @@ int myclose(mysocket_t sd)
     DEBUG_LOG(("***myclose(%d)***\n", sd));
     MYSOCK_CHECK(ctx != NULL, EBADF);
 
+    /* operations submitted with myaio_submit() that are still waiting on
+     * the mysocket don't finish now
+     */
+    _mysock_aio_forget(ctx);
+    return _mysock_close(sd, TRUE);
+}
+
+/* myclose(), less forgetting aio operations, and waiting for STCP to exit
+ * only if block is true.  otherwise, this fails with EAGAIN until the
+ * transport layer is done, leaving the close requested.
+ */
+int _mysock_close(mysocket_t sd, bool_t block)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+
     /* stcp_wait_for_event() needs to wake up on a socket close request */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     ctx->close_requested = TRUE;
+    _mysock_wake_transport(ctx, FALSE);
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->transport_cond));
 
-    /* block until STCP thread exits */
+    /* block until STCP exits */
     if (ctx->transport_thread_started)
     {
         assert(!ctx->listening);
         assert(ctx->is_active || ctx->listen_sd != -1);
-        PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
-        ctx->transport_thread_started = FALSE;
+        MYSOCK_CHECK(block || _mysock_transport_finished(ctx), EAGAIN);
+        _mysock_transport_join(ctx);
     }
 
-    _network_stop_recv_thread(ctx);
+    _network_stop_recv(ctx);
 
     if (ctx->listening)
     {
@@ -188,6 +267,9 @@ int myclose(mysocket_t sd)
         _mysock_close_passive_socket(ctx);
     }
 
+    /* and from any epoll sets */
+    _mysock_poll_forget(ctx);
+
     /* free all resources associated with this mysocket */
     _mysock_free_context(ctx);
 
@@ -196,40 +278,152 @@ int myclose(mysocket_t sd)
 }
 
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
+{
+    return mywrite_stream(sd, 0, buf, buf_len);
+}
+
+int myread(mysocket_t sd, void *buf, size_t buf_len)
+{
+    return myread_stream(sd, 0, buf, buf_len);
+}
+
+/* streams are numbered from 0 up to the MYSO_STREAMS value (which holds
+ * the negotiated number once the connection is established).
+ */
+#define VALID_STREAM(ctx, stream) \
+    ((stream) >= 0 && \
+     ((stream) == 0 || (stream) < (ctx)->options[MYSO_STREAMS]))
+
+int mywrite_stream(mysocket_t sd, int stream, const void *buf, size_t buf_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
 
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    return _mysock_write(sd, stream, buf, buf_len,
+                         !ctx->options[MYSO_NONBLOCK]);
+}
+
+/* mywrite_stream(), waiting for room only if block is true */
+int _mysock_write(mysocket_t sd, int stream, const void *buf, size_t buf_len,
+                  bool_t block)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    const char *src = (const char *) buf;
+    size_t left = buf_len;
+    bool_t run_inline;
+
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(VALID_STREAM(ctx, stream), EINVAL);
+    MYSOCK_CHECK(!ctx->options[MYSO_MESSAGES] ||
+                 buf_len <= MYSOCK_MAX_MESSAGE, EMSGSIZE);
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
+    if (buf_len == 0 && ctx->options[MYSO_MESSAGES])
+        return 0;   /* would read as EOF */
+
+    run_inline = ctx->options[MYSO_INLINE] && ctx->transport_thread_started;
+
+    if (!block && ctx->transport_thread_started && buf_len > 0)
+    {
+        /* take what there is room for now, and no more */
+        do
+        {
+            size_t len = MIN(left, MYSOCK_MAX_MESSAGE);
+            size_t written = _mysock_ring_write_nonblock(
+                ctx, &ctx->app_recv_queue, stream, src, len,
+                ctx->options[MYSO_MESSAGES]);
+
+            src += written;
+            left -= written;
+            if (written < len)
+                break;
+        } while (left > 0);
+
+        if (run_inline)
+            _mysock_run_transport(ctx);
+        MYSOCK_CHECK(left < buf_len, EAGAIN);
+        return buf_len - left;
+    }
+
+    /* a message goes in as one record; a long write to a byte stream is
+     * cut into records small enough to wait for room for.  data written
+     * before the connection is started is all kept, as there is nothing
+     * yet to make room.
+     */
+    do
+    {
+        size_t len = MIN(left, MYSOCK_MAX_MESSAGE);
+
+        /* (rather than wait for the transport layer to make room) */
+        if (run_inline)
+            _mysock_run_transport_until(ctx, &ctx->app_recv_queue, len);
+
+        _mysock_ring_write(ctx, &ctx->app_recv_queue, stream, src, len,
+                           ctx->transport_thread_started);
+        src += len;
+        left -= len;
+    } while (left > 0);
+
+    /* send it now */
+    if (run_inline)
+        _mysock_run_transport(ctx);
 
-    /* XXX: all bytes are queued, irrespective of current sender window */
     return buf_len;
 }
 
-int myread(mysocket_t sd, void *buf, size_t buf_len)
+int myread_stream(mysocket_t sd, int stream, void *buf, size_t buf_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    return _mysock_read(sd, stream, buf, buf_len,
+                        !ctx->options[MYSO_NONBLOCK]);
+}
+
+/* myread_stream(), waiting for data only if block is true */
+int _mysock_read(mysocket_t sd, int stream, void *buf, size_t buf_len,
+                 bool_t block)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
     int len;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(VALID_STREAM(ctx, stream), EINVAL);
 
     assert(!ctx->close_requested);
 
-    if (ctx->eof)
+    if (ctx->eof[stream])
         return 0;
 
-    if ((len = _mysock_dequeue_buffer(ctx, &ctx->app_send_queue,
-                                      buf, buf_len, TRUE)) == 0)
+    if (ctx->options[MYSO_INLINE] && ctx->transport_thread_started)
+    {
+        /* the segments that have arrived might be for the app */
+        if (block)
+            _mysock_run_transport_until(ctx, &ctx->app_send_queue[stream], 0);
+        else
+            _mysock_run_transport(ctx);
+    }
+
+    MYSOCK_CHECK(block ||
+                 _mysock_ring_ready(ctx, &ctx->app_send_queue[stream]), EAGAIN);
+
+    /* in message mode, the part of a message that doesn't fit is dropped */
+    if ((len = _mysock_ring_read(ctx, &ctx->app_send_queue[stream],
+                                 NULL, NULL, buf, buf_len,
+                                 !ctx->options[MYSO_MESSAGES])) == 0)
     {
         /* make sure repeated calls to myread() return 0 on EOF */
-        ctx->eof = TRUE;
+        ctx->eof[stream] = TRUE;
     }
 
-    return len;
+    /* in case the transport layer was waiting for the app to read */
+    if (ctx->options[MYSO_INLINE])
+        _mysock_run_transport(ctx);
+
+    return ((size_t) len > buf_len) ? (int) buf_len : len;
 }
 
 /* fills in addr with current port associated with the mysocket descriptor.
@@ -279,6 +473,32 @@ int mygetpeername(mysocket_t sd, struct sockaddr *name, socklen_t *namelen)
     return 0;
 }
 
+/* set a per-mysocket option (see mysock.h) */
+int mysetsockopt(mysocket_t sd, int option, int value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(option >= 0 && option < MYSO_NUM_OPTIONS, ENOPROTOOPT);
+    MYSOCK_CHECK(option != MYSO_STREAMS ||
+                 (value >= 0 && value <= MYSOCK_MAX_STREAMS), EINVAL);
+
+    ctx->options[option] = value;
+    return 0;
+}
+
+int mygetsockopt(mysocket_t sd, int option, int *value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(option >= 0 && option < MYSO_NUM_OPTIONS, ENOPROTOOPT);
+    MYSOCK_CHECK(value != NULL, EFAULT);
+
+    *value = ctx->options[option];
+    return 0;
+}
+
 /* returns IP address of interface on which packets to/from network address
  * peer_addr (network byte order) are delivered.
  */
@@ -287,3 +507,8 @@ uint32_t mylocalip(uint32_t peer_addr)
     return _network_get_interface_ip(peer_addr);
 }
 
+/* print how much of the buffer pools has been used (see pool.h) */
+void mypoolstats(FILE *fp)
+{
+    pool_print_stats(fp);
+}
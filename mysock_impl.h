@@ -48,20 +48,93 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
-typedef struct packet_queue_node
+/* a packet from the network, read into the buffer once and then passed
+ * along by reference: through the network receive queue to the transport
+ * layer, and from there (slices of it) to the app's byte rings.  it goes
+ * back to its pool when the last reference is released.
+ */
+typedef struct packet_buf
 {
-    char                     *data;
-    size_t                    data_len;
-    struct packet_queue_node *next;
-} packet_queue_node_t;
-
+    char              *data;
+    size_t             data_len;
+    int                refs;
+    struct packet_buf *next;    /* in a packet_queue_t */
+} packet_buf_t;
+
+/* room in the buffer of a packet from _mysock_alloc_packet() */
+#define PACKET_BUF_LEN MAX_IP_PAYLOAD_LEN
+
+/* packet queue, without a lock.  the network layer pushes packets on to
+ * it, newest first, from whichever thread receives them; its one consumer
+ * takes all of them at once whenever it has used up the ones it took
+ * before, and keeps them oldest first.
+ */
 typedef struct
 {
-    packet_queue_node_t *head;
-    packet_queue_node_t *tail;
+    packet_buf_t *volatile pushed;  /* newest first */
+    packet_buf_t          *head;    /* the consumer's, oldest first */
 } packet_queue_t;
 
+#define PACKET_QUEUE_EMPTY(pq) (!(pq)->head && !(pq)->pushed)
+
+/* one of the buffers of a byte ring (see below) */
+typedef struct ring_buf
+{
+    char            *data;
+    size_t           size;      /* a power of two */
+    size_t           base;      /* ring offset of its first byte */
+    struct ring_buf *volatile next;     /* the bigger one after it */
+} ring_buf_t;
+
+/* byte ring buffer of records, each the bytes of one write (tagged with
+ * its stream) after a short header, or just a header referring to bytes
+ * in a packet.  it has one producer and one consumer, which don't share a
+ * lock: the producer moves in once a record is in place, and the consumer
+ * moves out once it is done with what it passed.  in and out only ever
+ * grow; they are taken modulo the size of the buffer.  the buffer is
+ * allocated on the first write.  to grow, the producer goes on in a
+ * bigger buffer, and the consumer follows once it has read the rest of
+ * the old one.  app threads at the app's end of a ring take turns with
+ * app_lock, and sleep on app_cond: for a record in the rings the app
+ * reads, and for room in the one it writes.  the transport layer's end
+ * waits along with the transport layer's other events (see
+ * stcp_wait_for_event()).
+ */
+typedef struct
+{
+    /* the producer's */
+    ring_buf_t     *tail_buf;
+    volatile size_t size;       /* of tail_buf (0 before the first write) */
+    volatile size_t in;         /* where the next record goes */
+    volatile size_t held_in;    /* bytes in packets its records refer to */
+
+    /* the consumer's (head_buf is set by the first write) */
+    ring_buf_t     *head_buf;
+    volatile size_t out;        /* where the next read starts */
+    volatile bool_t head_open;  /* header of the record at out has been read */
+    size_t  head_left;      /* ...and this much of it is still unread */
+    int     head_stream;    /* ...which is the stream it was written to */
+    packet_buf_t *head_packet;  /* ...whose bytes are in this packet */
+    const char   *head_src;     /* ...from here on */
+    volatile size_t held_out;   /* bytes in packets read so far */
+
+    /* threads waiting on the ring, under data_ready_lock.  the other end
+     * only takes the lock to wake them if there are any, and the ring has
+     * just become non-empty, or has room for any write again (see
+     * RING_LOW_WATER)
+     */
+    volatile int  writers_waiting;  /* for room */
+    volatile int  readers_waiting;  /* for a record */
+
+    pthread_mutex_t app_lock;
+    pthread_cond_t  app_cond;
+} byte_ring_t;
+
+/* (an open record whose bytes are in a packet takes no room in the ring,
+ * so out may have caught up with in before it has all been read)
+ */
+#define RING_EMPTY(ring) ((ring)->in == (ring)->out && !(ring)->head_open)
+
 /* mysocket context (and the arguments provided to the transport layer
  * thread).  most of this is mysock/network layer working state, with STCP
  * working state maintained separately by the student.  there is one instance
@@ -88,30 +161,76 @@ typedef struct mysock_context
      */
     mysocket_t listen_sd;
 
+    /* values set with mysetsockopt() */
+    int options[MYSO_NUM_OPTIONS];
+
+    /* how outgoing segments are protected (a stcp_checksum_t) */
+    int checksum;
+
     /* block application until connected (or an error) */
     pthread_cond_t  blocking_cond;
     pthread_mutex_t blocking_lock;
     bool_t          blocking;
     int             stcp_errno;
+    bool_t          connect_pending;    /* MYSO_NONBLOCK myconnect() not
+                                         * yet seen to finish */
 
-    /* STCP thread */
-    pthread_t       transport_thread;
+    /* STCP fiber (see fiber.h); the pointer is under data_ready_lock */
+    struct fiber   *transport_fiber;
     bool_t          transport_thread_started;
 
-    /* is data ready from either network or the app? */
-    pthread_cond_t  data_ready_cond;
+    /* for sleeping until data is ready from either network or the app (or
+     * there is room for it); the queues themselves need no lock.  the app
+     * sleeps on its rings' app_cond, and the transport layer on
+     * transport_cond, unless it is on its fiber.
+     */
+    pthread_cond_t  transport_cond;
     pthread_mutex_t data_ready_lock;
     bool_t          close_requested;    /* myclose() called by app? */
-    bool_t          eof;                /* true once peer finishes writing */
+    bool_t          transport_done;     /* transport_init() has returned */
+    bool_t          transport_deferred; /* MYSO_INLINE: woken, for the app
+                                         * to run (see
+                                         * _mysock_run_transport()) */
+    volatile int    inline_waiters;     /* MYSO_INLINE: app threads that
+                                         * run it when woken */
+    volatile int    transport_waiting;  /* for its queues (as the byte
+                                         * rings' waiters) */
+    volatile bool_t room_waiting;       /* ...or for the app to read */
+    volatile unsigned int app_reads;    /* reads from app_send_queue */
+    unsigned int    app_reads_seen;     /* ...as of the transport layer's
+                                         * last stcp_app_room() (see
+                                         * APP_ROOM) */
+    bool_t          eof[MYSOCK_MAX_STREAMS];  /* true once peer finishes
+                                               * writing */
 
     /* data sent to peer is sent immediately, so no queue is needed for that
      * case.  we keep a queue for the other three cases:  data coming from
      * peer, data sent to the app for consumption with myread(), and data
-     * coming from the app via mywrite().
+     * coming from the app via mywrite().  packets from the peer are queued
+     * as they are; data to and from the app goes through byte rings.  data
+     * for the app is queued per stream; data from the app is queued in
+     * write order, each write tagged with its stream.
      */
     packet_queue_t  network_recv_queue; /* data coming from peer */
-    packet_queue_t  app_send_queue; /* data to be passed up to app */
-    packet_queue_t  app_recv_queue; /* data coming from app */
+    byte_ring_t     app_send_queue[MYSOCK_MAX_STREAMS]; /* data to be passed
+                                                      * up to app */
+    byte_ring_t     app_recv_queue; /* data coming from app */
+
+    /* the epoll sets this mysocket is in (see mysock_poll.c) */
+    struct poll_item *poll_items;
+
+    /* asynchronous operations parked on this mysocket (see mysock_aio.c):
+     * reads per stream, under data_ready_lock, and the rest in order, with
+     * the aio thread's state for the mysocket, under its aio_lock.
+     */
+    struct aio_op   *aio_reads[MYSOCK_MAX_STREAMS];
+    struct aio_op   *aio_ops;
+    int              aio_waiting;   /* parked, or being tried at submission */
+    unsigned int     aio_gen;       /* count of notifications */
+    bool_t           aio_queued;    /* on the aio thread's list */
+    bool_t           aio_busy;      /* its operations are being tried */
+    bool_t           aio_feed;      /* reads to be given what is queued */
+    struct mysock_context *aio_retry_next;
 } mysock_context_t;
 
 
@@ -122,7 +241,19 @@ mysock_context_t *_mysock_get_context(mysocket_t sd);
 
 void _mysock_transport_init(mysocket_t sd, bool_t is_active);
 
-int _mysock_wait_for_connection(mysock_context_t *ctx);
+void _mysock_transport_join(mysock_context_t *ctx);
+
+bool_t _mysock_transport_finished(mysock_context_t *ctx);
+
+void _mysock_wake_transport(mysock_context_t *ctx, bool_t by_app);
+
+void _mysock_run_transport(mysock_context_t *ctx);
+
+void _mysock_run_transport_until(mysock_context_t *ctx,
+                                 byte_ring_t      *ring,
+                                 size_t            room);
+
+int _mysock_wait_for_connection(mysock_context_t *ctx, bool_t block);
 
 void _mysock_free_context(mysock_context_t *ctx);
 
@@ -131,12 +262,91 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             const void       *packet,
                             size_t            packet_len);
 
+packet_buf_t *_mysock_alloc_packet(void);
+
+void _mysock_hold_packet(packet_buf_t *packet);
+
+void _mysock_release_packet(packet_buf_t *packet);
+
+void _mysock_enqueue_packet(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            packet_buf_t     *packet);
+
+packet_buf_t *_mysock_dequeue_packet(mysock_context_t *ctx,
+                                     packet_queue_t   *pq);
+
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
                               void             *dst,
                               size_t            max_len,
                               bool_t            remove_partial);
 
+void _mysock_ring_write(mysock_context_t *ctx,
+                        byte_ring_t      *ring,
+                        int               stream,
+                        const void       *src,
+                        size_t            src_len,
+                        bool_t            block);
+
+size_t _mysock_ring_write_nonblock(mysock_context_t *ctx,
+                                   byte_ring_t      *ring,
+                                   int               stream,
+                                   const void       *src,
+                                   size_t            src_len,
+                                   bool_t            whole);
+
+void _mysock_ring_write_packet(mysock_context_t *ctx,
+                               byte_ring_t      *ring,
+                               int               stream,
+                               packet_buf_t     *packet,
+                               const char       *src,
+                               size_t            src_len);
+
+bool_t _mysock_ring_ready(mysock_context_t *ctx, byte_ring_t *ring);
+
+size_t _mysock_ring_up_room(mysock_context_t *ctx, byte_ring_t *ring,
+                            int writes);
+
+bool_t _mysock_ring_writable(mysock_context_t *ctx, byte_ring_t *ring);
+
+size_t _mysock_ring_read(mysock_context_t *ctx,
+                         byte_ring_t      *ring,
+                         int              *stream,
+                         size_t           *left,
+                         void             *dst,
+                         size_t            max_len,
+                         bool_t            remove_partial);
+
+/* mysock_api.c.  the app interface, waiting only if block is true */
+int _mysock_connect(mysocket_t sd, struct sockaddr *name, int namelen,
+                    bool_t block);
+
+mysocket_t _mysock_accept(mysocket_t sd, struct sockaddr *addr, int *addrlen,
+                          bool_t block);
+
+int _mysock_write(mysocket_t sd, int stream, const void *buf, size_t buf_len,
+                  bool_t block);
+
+int _mysock_read(mysocket_t sd, int stream, void *buf, size_t buf_len,
+                 bool_t block);
+
+int _mysock_close(mysocket_t sd, bool_t block);
+
+/* mysock_poll.c */
+void _mysock_poll_notify(mysock_context_t *ctx);
+
+void _mysock_poll_forget(mysock_context_t *ctx);
+
+/* mysock_aio.c */
+bool_t _mysock_aio_fill(mysock_context_t *ctx, int stream,
+                        const char **src, size_t *len);
+
+void _mysock_aio_notify(mysock_context_t *ctx);
+
+void _mysock_aio_feed(mysock_context_t *ctx);
+
+void _mysock_aio_forget(mysock_context_t *ctx);
+
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
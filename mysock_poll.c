@@ -0,0 +1,491 @@
+/* mysock_poll.c--waiting on several mysockets at once: myepoll_*() and
+ * mypoll() (see mysock.h).
+ *
+ * each mysocket keeps a list of the epoll sets it is in.  wherever the
+ * mysocket layer wakes up a blocked myread(), mywrite(), myaccept() or
+ * myconnect(), it also calls _mysock_poll_notify(), which puts the
+ * mysocket on the ready list of each of those sets.  myepoll_wait() only
+ * looks at the mysockets on its ready list, so it costs nothing for the
+ * ones that are idle.  a level triggered mysocket stays on the list for
+ * as long as it is found ready; an edge triggered one is taken off once
+ * reported, until the next notification.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "connection_demux.h"
+
+
+/* maximum number of epoll sets per process */
+#define MAX_NUM_POLL_SETS MAX_NUM_CONNECTIONS
+
+struct poll_set;
+
+/* a mysocket in an epoll set */
+typedef struct poll_item
+{
+    mysock_context_t     *ctx;
+    struct myepoll_event  event;        /* as registered */
+    struct poll_set      *set;
+    bool_t                listed;       /* on the set's ready list */
+    struct poll_item     *ready_next;   /* on the set's ready list */
+    struct poll_item     *ctx_next;     /* in ctx->poll_items */
+    struct poll_item     *set_next;     /* in set->items */
+} poll_item_t;
+
+typedef struct poll_set
+{
+    pthread_mutex_t  lock;      /* protects the ready list */
+    pthread_cond_t   cond;      /* signaled as items are made ready */
+    poll_item_t     *items;
+    poll_item_t     *ready_head;
+    poll_item_t     *ready_tail;
+} poll_set_t;
+
+/* epoll set table.  poll_lock protects it, the item lists of the sets and
+ * of the mysockets, and the items' registered events.  it is taken before
+ * a set's lock, which is taken before a mysocket's data_ready_lock.
+ */
+static poll_set_t *poll_sets[MAX_NUM_POLL_SETS];
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static poll_set_t *_poll_get_set(int epd);
+static void _poll_list_item(poll_item_t *item);
+static void _poll_free_item(poll_item_t *item);
+static uint32_t _poll_events(mysock_context_t *ctx);
+
+
+/* called wherever something the app may be waiting for happens on a
+ * mysocket, with no mysocket locks held.  this is cheap if the mysocket
+ * isn't in any epoll set.
+ */
+void _mysock_poll_notify(mysock_context_t *ctx)
+{
+    poll_item_t *item;
+
+    /* and asynchronous operations waiting on it (see mysock_aio.c) */
+    if (ctx && ctx->aio_waiting)
+        _mysock_aio_notify(ctx);
+
+    /* (a set being added to reports the item anyway) */
+    if (!ctx || !ctx->poll_items)
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    for (item = ctx->poll_items; item; item = item->ctx_next)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&item->set->lock));
+        _poll_list_item(item);
+        PTHREAD_CALL(pthread_mutex_unlock(&item->set->lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&item->set->cond));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+}
+
+/* take a mysocket that is being closed out of every epoll set */
+void _mysock_poll_forget(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    while (ctx->poll_items)
+        _poll_free_item(ctx->poll_items);
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+}
+
+
+int myepoll_create(void)
+{
+    poll_set_t *set;
+    int k;
+
+    set = (poll_set_t *) calloc(1, sizeof(poll_set_t));
+    assert(set);
+    PTHREAD_CALL(pthread_mutex_init(&set->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&set->cond, NULL));
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    for (k = 0; k < MAX_NUM_POLL_SETS; ++k)
+    {
+        if (!poll_sets[k])
+        {
+            poll_sets[k] = set;
+            PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+            return k;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+
+    PTHREAD_CALL(pthread_cond_destroy(&set->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&set->lock));
+    free(set);
+    errno = EMFILE;
+    return -1;
+}
+
+int myepoll_ctl(int epd, int op, mysocket_t sd, struct myepoll_event *event)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    poll_set_t *set;
+    poll_item_t *item;
+    int rc = 0;
+
+    if (!ctx)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (op != MYEPOLL_CTL_DEL && !event)
+    {
+        errno = EFAULT;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    if (!(set = _poll_get_set(epd)))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+        errno = EBADF;
+        return -1;
+    }
+
+    for (item = ctx->poll_items; item && item->set != set;
+         item = item->ctx_next)
+        ;
+
+    switch (op)
+    {
+    case MYEPOLL_CTL_ADD:
+        if (item)
+        {
+            errno = EEXIST;
+            rc = -1;
+            break;
+        }
+
+        item = (poll_item_t *) calloc(1, sizeof(poll_item_t));
+        assert(item);
+        item->ctx = ctx;
+        item->set = set;
+        item->ctx_next = ctx->poll_items;
+        ctx->poll_items = item;
+        item->set_next = set->items;
+        set->items = item;
+        /* fall through */
+
+    case MYEPOLL_CTL_MOD:
+        if (!item)
+        {
+            errno = ENOENT;
+            rc = -1;
+            break;
+        }
+
+        /* report it if it is ready already */
+        PTHREAD_CALL(pthread_mutex_lock(&set->lock));
+        item->event = *event;
+        item->event.sd = sd;
+        _poll_list_item(item);
+        PTHREAD_CALL(pthread_mutex_unlock(&set->lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&set->cond));
+        break;
+
+    case MYEPOLL_CTL_DEL:
+        if (!item)
+        {
+            errno = ENOENT;
+            rc = -1;
+            break;
+        }
+        _poll_free_item(item);
+        break;
+
+    default:
+        errno = EINVAL;
+        rc = -1;
+        break;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+
+    return rc;
+}
+
+/* wait up to timeout milliseconds (-1 for ever, 0 not at all) for any of
+ * the mysockets in a set to be ready, filling in up to max_events events.
+ * returns the number filled in.
+ */
+int myepoll_wait(int epd, struct myepoll_event *events,
+                 int max_events, int timeout)
+{
+    struct timespec deadline;
+    poll_set_t *set;
+    int num_events = 0;
+
+    if (!events || max_events <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    set = _poll_get_set(epd);
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+    if (!set)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (timeout > 0)
+    {
+        struct timeval now;
+
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + timeout / 1000;
+        deadline.tv_nsec = now.tv_usec * 1000 + (timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&set->lock));
+    for (;;)
+    {
+        poll_item_t *item, *again = NULL, *again_tail = NULL;
+        int rc;
+
+        /* take each item on the ready list off it, and see whether it is
+         * ready after all; level triggered ones that are go back on the
+         * end, to be looked at again next time.
+         */
+        while (num_events < max_events && (item = set->ready_head))
+        {
+            uint32_t ready;
+
+            if (!(set->ready_head = item->ready_next))
+                set->ready_tail = NULL;
+            item->ready_next = NULL;
+            item->listed = FALSE;
+
+            ready = _poll_events(item->ctx) &
+                    (item->event.events | MYPOLLERR | MYPOLLHUP);
+            if (!ready)
+                continue;
+
+            events[num_events] = item->event;
+            events[num_events++].events = ready;
+
+            if (!(item->event.events & MYEPOLLET))
+            {
+                item->listed = TRUE;
+                if (again_tail)
+                    again_tail->ready_next = item;
+                else
+                    again = item;
+                again_tail = item;
+            }
+        }
+
+        if (again)
+        {
+            if (set->ready_tail)
+                set->ready_tail->ready_next = again;
+            else
+                set->ready_head = again;
+            set->ready_tail = again_tail;
+        }
+
+        if (num_events > 0 || timeout == 0)
+            break;
+
+        if (timeout < 0)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&set->cond, &set->lock));
+        }
+        else if ((rc = pthread_cond_timedwait(&set->cond, &set->lock,
+                                              &deadline)) == ETIMEDOUT)
+        {
+            timeout = 0;    /* one last look */
+        }
+        else
+        {
+            PTHREAD_CALL(rc);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&set->lock));
+
+    return num_events;
+}
+
+int myepoll_close(int epd)
+{
+    poll_set_t *set;
+
+    PTHREAD_CALL(pthread_mutex_lock(&poll_lock));
+    if (!(set = _poll_get_set(epd)))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+        errno = EBADF;
+        return -1;
+    }
+
+    while (set->items)
+        _poll_free_item(set->items);
+    poll_sets[epd] = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&poll_lock));
+
+    PTHREAD_CALL(pthread_cond_destroy(&set->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&set->lock));
+    free(set);
+    return 0;
+}
+
+/* a one-off epoll set for the given mysockets */
+int mypoll(struct mypollfd *fds, int nfds, int timeout)
+{
+    struct myepoll_event *events;
+    int epd, num_ready = 0, num_events, k;
+
+    if (nfds < 0 || (nfds > 0 && !fds))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((epd = myepoll_create()) < 0)
+        return -1;
+
+    events = (struct myepoll_event *)
+        calloc(nfds > 0 ? nfds : 1, sizeof(struct myepoll_event));
+    assert(events);
+
+    for (k = 0; k < nfds; ++k)
+    {
+        struct myepoll_event event;
+
+        fds[k].revents = 0;
+        event.events = (unsigned short) fds[k].events;
+        event.data = &fds[k];
+        if (myepoll_ctl(epd, MYEPOLL_CTL_ADD, fds[k].sd, &event) < 0)
+        {
+            /* a mysocket listed twice is reported once */
+            if (errno == EBADF)
+            {
+                fds[k].revents = MYPOLLNVAL;
+                ++num_ready;
+            }
+        }
+    }
+
+    num_events = myepoll_wait(epd, events, nfds > 0 ? nfds : 1,
+                              num_ready ? 0 : timeout);
+    for (k = 0; k < num_events; ++k)
+    {
+        ((struct mypollfd *) events[k].data)->revents = events[k].events;
+        ++num_ready;
+    }
+
+    free(events);
+    myepoll_close(epd);
+    return num_ready;
+}
+
+
+/* an epoll set by number, or NULL.  the caller holds poll_lock. */
+static poll_set_t *_poll_get_set(int epd)
+{
+    return (epd >= 0 && epd < MAX_NUM_POLL_SETS) ? poll_sets[epd] : NULL;
+}
+
+/* put an item on the end of its set's ready list, if it isn't there
+ * already.  the caller holds the set's lock.
+ */
+static void _poll_list_item(poll_item_t *item)
+{
+    poll_set_t *set = item->set;
+
+    if (item->listed)
+        return;
+
+    item->listed = TRUE;
+    item->ready_next = NULL;
+    if (set->ready_tail)
+        set->ready_tail->ready_next = item;
+    else
+        set->ready_head = item;
+    set->ready_tail = item;
+}
+
+/* take an item out of its set and its mysocket's list, and free it.  the
+ * caller holds poll_lock.
+ */
+static void _poll_free_item(poll_item_t *item)
+{
+    poll_set_t *set = item->set;
+    poll_item_t **p;
+
+    for (p = &item->ctx->poll_items; *p != item; p = &(*p)->ctx_next)
+        assert(*p);
+    *p = item->ctx_next;
+
+    for (p = &set->items; *p != item; p = &(*p)->set_next)
+        assert(*p);
+    *p = item->set_next;
+
+    PTHREAD_CALL(pthread_mutex_lock(&set->lock));
+    if (item->listed)
+    {
+        poll_item_t *prev = NULL;
+
+        for (p = &set->ready_head; *p != item; p = &(*p)->ready_next)
+            prev = *p;
+        *p = item->ready_next;
+        if (set->ready_tail == item)
+            set->ready_tail = prev;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&set->lock));
+
+    free(item);
+}
+
+/* what a mysocket is ready for right now */
+static uint32_t _poll_events(mysock_context_t *ctx)
+{
+    uint32_t events = 0;
+    bool_t blocking;
+    int k;
+
+    assert(ctx);
+
+    if (ctx->listening)
+        return _mysock_connection_ready(ctx) ? MYPOLLIN : 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    blocking = ctx->blocking;
+    if (!blocking && ctx->stcp_errno)
+        events |= MYPOLLERR | MYPOLLHUP;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+
+    if (!ctx->transport_thread_started || blocking || events)
+        return events;
+
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+    {
+        if (ctx->eof[k] || _mysock_ring_ready(ctx, &ctx->app_send_queue[k]))
+        {
+            events |= MYPOLLIN;
+            break;
+        }
+    }
+    if (_mysock_ring_writable(ctx, &ctx->app_recv_queue))
+        events |= MYPOLLOUT;
+    if (ctx->transport_done)
+        events |= MYPOLLHUP;
+
+    return events;
+}
@@ -20,16 +20,33 @@
 
 /* helper function for stcp_network_send(); this takes care of unreliable
  * delivery simulation, etc, before passing a packet off to
- * _network_send_packet() for actual transmission over the network.
+ * _network_send_packetv() for actual transmission over the network.
  */
 int _network_send(mysocket_t sd, const void *buf, size_t len)
+{
+    struct iovec iov;
+
+    assert(buf);
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    return _network_sendv(sd, &iov, 1);
+}
+
+/* as _network_send(), for a packet gathered from iovcnt pieces.  they are
+ * only copied if the packet is held back to be sent later.
+ */
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt)
 {
     mysock_context_t *sock_ctx = _mysock_get_context(sd);
     network_context_t *ctx;
+    size_t len = 0;
+    int k;
 
-    assert(sock_ctx && buf);
+    assert(sock_ctx && iov);
     ctx = &sock_ctx->network_state;
 
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
 
     if (!ctx->is_reliable)
     {
@@ -43,15 +60,20 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
         case 1:
             /* send duplicate */
             dprintf("====>network_send:duplicating the packet\n");
-            _network_send_packet(ctx, buf, len);
+            _network_send_packetv(ctx, iov, iovcnt);
             break;
 
         case 2:
             /* store the packet in our queue. Will send it later */
             dprintf("====>network_send:keeping the packet in our queue\n");
             assert(len <= sizeof(ctx->copy_buffer));
-            memcpy(&ctx->copy_buffer, buf, len);
-            ctx->copy_buf_len = len;
+            ctx->copy_buf_len = 0;
+            for (k = 0; k < iovcnt; ++k)
+            {
+                memcpy(ctx->copy_buffer + ctx->copy_buf_len,
+                       iov[k].iov_base, iov[k].iov_len);
+                ctx->copy_buf_len += iov[k].iov_len;
+            }
             ctx->copied = TRUE;
             return len;
 
@@ -68,7 +90,7 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
             else
             {
                 dprintf("====>network_send:duplicating the packet\n");
-                _network_send_packet(ctx, buf, len);
+                _network_send_packetv(ctx, iov, iovcnt);
             }
             return len;
 
@@ -78,7 +100,7 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
         }
     }
 
-    return _network_send_packet(ctx, buf, len);
+    return _network_send_packetv(ctx, iov, iovcnt);
 }
 
 /* helper function for stcp_network_recv() */
@@ -94,3 +116,12 @@ int _network_recv(mysocket_t sd, void *dst, size_t max_len)
     return len;
 }
 
+/* helper function for stcp_network_recv_packet() */
+packet_buf_t *_network_recv_packet_buf(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _mysock_dequeue_packet(ctx, &ctx->network_recv_queue);
+}
+
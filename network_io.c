@@ -19,13 +19,25 @@
 
 uint32_t _network_get_local_addr(network_context_t *ctx)
 {
+    uint32_t peer_ip;
+
     assert(ctx);
 
     assert(ctx->peer_addr_valid);
     assert(ctx->peer_addr_len > 0);
     assert(ctx->peer_addr.sa_family == AF_INET);
 
-    return _network_get_interface_ip(
-        ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
+    /* the lookup costs a gethostname() and a resolver call (and more on
+     * a host named "localhost"), so it is done once per peer rather than
+     * for every packet.
+     */
+    peer_ip = ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr;
+    if (!ctx->local_ip || ctx->local_ip_peer != peer_ip)
+    {
+        ctx->local_ip = _network_get_interface_ip(peer_ip);
+        ctx->local_ip_peer = peer_ip;
+    }
+
+    return ctx->local_ip;
 }
 
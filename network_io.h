@@ -9,6 +9,7 @@
 #ifdef LINUX
 #include <stdint.h>
 #endif
+#include <sys/uio.h>
 #include "mysock.h"
 
 #define MAX_IP_PAYLOAD_LEN 1500
@@ -26,6 +27,14 @@ typedef struct
     /* local address, if known */
     struct sockaddr local_addr;
 
+    /* local port and IP address (network byte order) as last looked up,
+     * or 0.  the port is forgotten whenever the socket's binding changes;
+     * the IP is that of the interface to local_ip_peer.
+     */
+    uint16_t local_port;
+    uint32_t local_ip;
+    uint32_t local_ip_peer;
+
     /* address of peer */
     struct sockaddr peer_addr;
     socklen_t       peer_addr_len;
@@ -52,11 +61,14 @@ int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen);
 /* specify backlog for passive socket */
 int _network_listen(network_context_t *ctx, int backlog);
 
-/* returns local port associated with mysocket, in network byte order */
+/* returns local port associated with mysocket, in network byte order.
+ * the port is cached after the first call, until the mysocket is bound
+ * again.
+ */
 int _network_get_port(network_context_t *ctx);
 
 /* returns local address associated with mysocket, in network byte order.
- * this is only valid once the peer is known.
+ * this is only valid once the peer is known, and is cached for that peer.
  */
 uint32_t _network_get_local_addr(network_context_t *ctx);
 
@@ -65,15 +77,27 @@ uint32_t _network_get_local_addr(network_context_t *ctx);
  */
 uint32_t _network_get_interface_ip(uint32_t peer_addr);
 
+/* returns TRUE if packets sent to the peer all arrive, in order and
+ * intact, i.e. the network layer runs over a reliable transport and none
+ * are dropped or delayed above it (see network.c).
+ */
+bool_t _network_is_reliable(network_context_t *ctx);
+
 /* send an STCP packet to our peer */
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len);
 
-/* start/stop per-mysocket network receive thread.  the stop() interface
- * must not return until the network receive thread has exited.
+/* the same, for a packet gathered from iovcnt (at most NETWORK_MAX_IOV)
+ * pieces, which go out with a single system call where the backend can */
+#define NETWORK_MAX_IOV 16
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt);
+
+/* start/stop passing a mysocket's incoming packets up.  the stop()
+ * interface must not return until no more will be.
  */
-int _network_start_recv_thread(struct mysock_context *ctx);
-void _network_stop_recv_thread(struct mysock_context *ctx);
+int _network_start_recv(struct mysock_context *ctx);
+void _network_stop_recv(struct mysock_context *ctx);
 
 /* called when a SYN packet is dequeued on a passive socket, to update any
  * state in the network layer.
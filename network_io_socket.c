@@ -6,8 +6,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <assert.h>
 #include <net/if.h> 
 #include <sys/ioctl.h>
@@ -26,8 +27,64 @@
 
 
 
-#define EXIT_PIPE_READ_INDEX  0
-#define EXIT_PIPE_WRITE_INDEX 1
+/* incoming packets are read by a few reactor threads, one per processor up
+ * to NETWORK_MAX_REACTORS, each waiting on its share of the sockets with
+ * one epoll set, rather than by a thread per mysocket.  a socket is in the
+ * set from when both _network_start_recv() has been called and the backend
+ * has found it ready to read (_network_recv_ready()), until
+ * _network_stop_recv() or its end of file.  sockets are non-blocking from
+ * then on: a reactor reads what has arrived of one packet from each socket
+ * found readable in turn, keeping the part of a packet that is still to
+ * come with the socket, and passes each packet up once it is all there.
+ * a connection accepted on a listening socket goes in the same set until
+ * the SYN on it is read and passed up (see _network_enqueue_accepted()).
+ *
+ * the epoll set names a socket by the mysocket's descriptor (or for an
+ * accepted connection, MAX_NUM_CONNECTIONS plus its slot in
+ * recv_accepted[]) and the generation at which it was added, looked up in
+ * recv_watch[], so a reactor never follows a pointer to a mysocket that
+ * has gone.  recv_lock protects the tables, the reactors' current
+ * mysockets and the recv_* state of each socket's context.
+ */
+#define NETWORK_MAX_REACTORS 8
+#define NETWORK_MAX_EVENTS 64
+#define NETWORK_MAX_ACCEPTED 64     /* connections waiting for their SYN */
+
+typedef struct
+{
+    pthread_t          thread;
+    int                epfd;
+    mysock_context_t  *current;     /* having a packet read for it */
+} network_reactor_t;
+
+typedef struct
+{
+    mysock_context_t  *ctx;         /* NULL if not in a reactor's set */
+    uint32_t           gen;
+    socket_t           socket;      /* as added */
+    int                reactor;
+} network_watch_t;
+
+typedef struct
+{
+    mysock_context_t  *listen_ctx;  /* accepted on; NULL if slot free */
+    uint32_t           gen;
+    socket_t           socket;
+    int                reactor;     /* (the listening socket's) */
+    struct sockaddr    peer_addr;
+    socklen_t          peer_addr_len;
+    network_partial_t  partial;     /* the SYN, as read so far */
+} network_accepted_t;
+
+static network_reactor_t recv_reactors[NETWORK_MAX_REACTORS];
+static int num_recv_reactors = 0;
+static network_watch_t recv_watch[MAX_NUM_CONNECTIONS];
+static network_accepted_t recv_accepted[NETWORK_MAX_ACCEPTED];
+static uint32_t recv_gen = 0;
+static pthread_mutex_t recv_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t recv_cond = PTHREAD_COND_INITIALIZER;  /* reactors
+                                                               * finishing */
+static pthread_once_t recv_once = PTHREAD_ONCE_INIT;
 
 #ifndef MAXHOSTNAMELEN
 #ifdef HOST_NAME_MAX
@@ -41,7 +98,16 @@
 static network_context_socket_t *
     _network_alloc_context_socket(int socket_type, size_t ctx_len);
 static void _network_destroy_context_socket(network_context_socket_t *ctx);
-static void *network_recv_thread_func(void *arg_ptr);
+static void _network_start_reactors(void);
+static void _network_watch(mysock_context_t *ctx);
+static void _network_unwatch(mysock_context_t *ctx);
+static void _network_watch_accepted(mysock_context_t *ctx, socket_t socket);
+static void _network_unwatch_accepted(network_accepted_t *accepted);
+static void _network_set_nonblocking(socket_t socket);
+static bool_t _network_recv_one(mysock_context_t *ctx);
+static void _network_recv_accepted(network_accepted_t *accepted,
+                                   uint32_t            gen);
+static void *network_reactor_func(void *arg_ptr);
 
 
 
@@ -56,7 +122,9 @@ void _network_close_socket(network_context_t *ctx)
 }
 
 /* return the local port associated with the given network layer context, in
- * network byte order, or 0 (reserved) on error.
+ * network byte order, or 0 (reserved) on error.  once the socket has a port,
+ * it is kept in the context; _network_bind_socket() and a change of socket
+ * on accept clear it.
  */
 int _network_get_port(network_context_t *ctx)
 {
@@ -66,6 +134,9 @@ int _network_get_port(network_context_t *ctx)
     assert(ctx);
     VERIFY_SOCKET(ctx);
 
+    if (ctx->local_port)
+        return ctx->local_port;
+
     if (getsockname(GET_SOCKET(ctx), (struct sockaddr *) &sin, &sin_len) < 0)
     {
         assert(0);
@@ -73,6 +144,7 @@ int _network_get_port(network_context_t *ctx)
     }
 
     assert(sin.sin_family == AF_INET);
+    ctx->local_port = sin.sin_port;     /* (stays 0 until bound) */
     return sin.sin_port;
 }
 
@@ -146,51 +218,92 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr)
     return ((struct in_addr *) *h->h_addr_list)->s_addr;
 }
 
-int _network_start_recv_thread(mysock_context_t *ctx)
+int _network_start_recv(mysock_context_t *ctx)
 {
     network_context_socket_t *net_ctx =
         (network_context_socket_t *) ctx->network_state.impl_data;
 
     assert(net_ctx);
+    assert(ctx->my_sd >= 0 && ctx->my_sd < MAX_NUM_CONNECTIONS);
 
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
-    {
-        perror("signal(SIGPIPE)");
-        assert(0);
+    PTHREAD_CALL(pthread_once(&recv_once, _network_start_reactors));
+    if (!num_recv_reactors)
         return -1;
-    }
 
-    net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
-                                                 ctx, FALSE);
-    net_ctx->recv_thread_started = TRUE;
+    PTHREAD_CALL(pthread_mutex_lock(&recv_lock));
+    assert(!net_ctx->recv_started);
+    net_ctx->recv_ctx = ctx;
+    net_ctx->recv_started = TRUE;
+    if (net_ctx->recv_ready)
+        _network_watch(ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
     return 0;
 }
 
-/* block until the network receive thread completes */
-void _network_stop_recv_thread(mysock_context_t *ctx)
+/* take the socket out of its reactor's set, and wait for the reactor if it
+ * is reading a packet for the mysocket.  connections accepted on it whose
+ * SYN hasn't come are closed once it is done.
+ */
+void _network_stop_recv(mysock_context_t *ctx)
 {
     network_context_socket_t *net_ctx =
         (network_context_socket_t *) ctx->network_state.impl_data;
+    int k;
 
-    DEBUG_LOG(("stopping receive thread\n"));
+    DEBUG_LOG(("stopping receive\n"));
     assert(net_ctx);
 
+    PTHREAD_CALL(pthread_mutex_lock(&recv_lock));
+    if (recv_watch[ctx->my_sd].ctx == ctx)
+        _network_unwatch(ctx);
+    net_ctx->recv_started = FALSE;
+
+    /* (no reactor takes them up again, as no generation is 0) */
+    for (k = 0; k < NETWORK_MAX_ACCEPTED; ++k)
+    {
+        if (recv_accepted[k].listen_ctx == ctx)
+            recv_accepted[k].gen = 0;
+    }
+
+    for (k = 0; k < num_recv_reactors; ++k)
+    {
+        network_reactor_t *reactor = &recv_reactors[k];
+
+        assert(!pthread_equal(reactor->thread, pthread_self()));
+        while (reactor->current == ctx)
+            PTHREAD_CALL(pthread_cond_wait(&recv_cond, &recv_lock));
+    }
 
-    if (net_ctx->recv_thread_started)
+    for (k = 0; k < NETWORK_MAX_ACCEPTED; ++k)
     {
-        char dummy = 'X';
-        if (write(net_ctx->exit_pipe[EXIT_PIPE_WRITE_INDEX],
-                  &dummy, sizeof(dummy)) < 0)
+        network_accepted_t *accepted = &recv_accepted[k];
+
+        if (accepted->listen_ctx == ctx)
         {
-            assert(0);
-            abort();
+            _network_unwatch_accepted(accepted);
+            closesocket(accepted->socket);
         }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
+    DEBUG_LOG(("stopped receive\n"));
+}
 
+void _network_recv_ready(network_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->impl_data;
+
+    assert(net_ctx);
+    _network_set_nonblocking(net_ctx->socket);
 
-        PTHREAD_CALL(pthread_join(net_ctx->recv_thread, NULL));
-        net_ctx->recv_thread_started = FALSE;
+    PTHREAD_CALL(pthread_mutex_lock(&recv_lock));
+    net_ctx->recv_ready = TRUE;
+    if (net_ctx->recv_started &&
+        recv_watch[net_ctx->recv_ctx->my_sd].ctx != net_ctx->recv_ctx)
+    {
+        _network_watch(net_ctx->recv_ctx);
     }
-    DEBUG_LOG(("stopped receive thread\n"));
+    PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
 }
 
 
@@ -224,102 +337,336 @@ int _network_bind_socket(network_context_t *ctx,
 {
     assert(ctx && addr);
     VERIFY_SOCKET(ctx);
+
+    ctx->local_port = 0;
     return bind(GET_SOCKET(ctx), addr, addrlen);
 }
 
 
+/* called once, to start the reactor threads */
+static void _network_start_reactors(void)
+{
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int k;
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE)");
+        assert(0);
+        return;
+    }
+
+    if (num_cpus < 1)
+        num_cpus = 1;
+    if (num_cpus > NETWORK_MAX_REACTORS)
+        num_cpus = NETWORK_MAX_REACTORS;
+
+    for (k = 0; k < num_cpus; ++k)
+    {
+        if ((recv_reactors[k].epfd = epoll_create(MAX_NUM_CONNECTIONS)) < 0)
+        {
+            perror("epoll_create");
+            assert(0);
+            break;
+        }
+        recv_reactors[k].thread = _mysock_create_thread(network_reactor_func,
+                                                        &recv_reactors[k],
+                                                        TRUE);
+    }
+    num_recv_reactors = k;
+}
+
+/* add a mysocket's socket to the set of one of the reactors.  the caller
+ * holds recv_lock.
+ */
+static void _network_watch(mysock_context_t *ctx)
+{
+    network_watch_t *watch = &recv_watch[ctx->my_sd];
+    struct epoll_event event;
+
+    assert(!watch->ctx);
+    watch->ctx = ctx;
+    watch->gen = ++recv_gen;
+    watch->socket = GET_SOCKET((&ctx->network_state));
+    watch->reactor = ctx->my_sd % num_recv_reactors;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t) watch->gen << 32) | (uint32_t) ctx->my_sd;
+    if (epoll_ctl(recv_reactors[watch->reactor].epfd, EPOLL_CTL_ADD,
+                  watch->socket, &event) < 0)
+    {
+        perror("epoll_ctl");
+        assert(0);
+        watch->ctx = NULL;
+    }
+}
+
+/* take a mysocket's socket out of its reactor's set.  the caller holds
+ * recv_lock.
+ */
+static void _network_unwatch(mysock_context_t *ctx)
+{
+    network_watch_t *watch = &recv_watch[ctx->my_sd];
+
+    assert(watch->ctx == ctx);
+    (void) epoll_ctl(recv_reactors[watch->reactor].epfd, EPOLL_CTL_DEL,
+                     watch->socket, NULL);
+    watch->ctx = NULL;
+}
+
+/* put a connection just accepted on a listening mysocket's socket in the
+ * listening socket's reactor's set, to read the SYN that comes on it, or
+ * close it if too many are waiting already.  the caller holds recv_lock.
+ */
+static void _network_watch_accepted(mysock_context_t *ctx, socket_t socket)
+{
+    network_accepted_t *accepted = NULL;
+    struct epoll_event event;
+    int k;
+
+    for (k = 0; k < NETWORK_MAX_ACCEPTED && !accepted; ++k)
+    {
+        if (!recv_accepted[k].listen_ctx)
+            accepted = &recv_accepted[k];
+    }
+    if (!accepted)
+    {
+        DEBUG_LOG(("too many connections accepted, closing %d\n",
+                   (int) socket));
+        closesocket(socket);
+        return;
+    }
+
+    _network_set_nonblocking(socket);
+    accepted->listen_ctx = ctx;
+    accepted->gen = ++recv_gen;
+    accepted->socket = socket;
+    accepted->reactor = recv_watch[ctx->my_sd].reactor;
+    accepted->peer_addr = ctx->network_state.peer_addr;
+    accepted->peer_addr_len = ctx->network_state.peer_addr_len;
+    assert(!accepted->partial.packet && !accepted->partial.len_got);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t) accepted->gen << 32) |
+                     (uint32_t) (MAX_NUM_CONNECTIONS +
+                                 (accepted - recv_accepted));
+    if (epoll_ctl(recv_reactors[accepted->reactor].epfd, EPOLL_CTL_ADD,
+                  socket, &event) < 0)
+    {
+        perror("epoll_ctl");
+        assert(0);
+        accepted->listen_ctx = NULL;
+        closesocket(socket);
+    }
+}
+
+/* take an accepted connection out of its reactor's set, leaving its
+ * socket to the caller, who holds recv_lock
+ */
+static void _network_unwatch_accepted(network_accepted_t *accepted)
+{
+    assert(accepted->listen_ctx);
+    (void) epoll_ctl(recv_reactors[accepted->reactor].epfd, EPOLL_CTL_DEL,
+                     accepted->socket, NULL);
+    accepted->listen_ctx = NULL;
+    if (accepted->partial.packet)
+        _mysock_release_packet(accepted->partial.packet);
+    memset(&accepted->partial, 0, sizeof(accepted->partial));
+}
+
+/* reads from a socket return whatever has arrived, rather than wait */
+static void _network_set_nonblocking(socket_t socket)
+{
+    int flags;
+
+    if ((flags = fcntl(socket, F_GETFL, 0)) < 0 ||
+        fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        perror("fcntl (O_NONBLOCK)");
+        assert(0);
+    }
+}
+
+/* read what has arrived of a packet from a mysocket's socket, which is
+ * ready, and pass it up if that finishes it.  for a listening mysocket,
+ * accept a connection instead.  returns FALSE once there are no more (the
+ * socket was closed, or has failed).
+ */
+static bool_t _network_recv_one(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+    network_partial_t *partial = &net_ctx->recv_partial;
+    packet_buf_t *packet;
+    ssize_t bytes_read;
+
+    if (ctx->listening)
+    {
+        socket_t socket;
+
+        /* (the SYN is read once it comes on the new connection) */
+        if ((socket = _network_accept(&ctx->network_state)) >= 0)
+        {
+            PTHREAD_CALL(pthread_mutex_lock(&recv_lock));
+            _network_watch_accepted(ctx, socket);
+            PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                 errno != EINTR && errno != ECONNABORTED)
+        {
+            perror("accept (network_io_socket)");
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    /* this is the only time the packet is copied on its way to STCP */
+    if ((bytes_read = _network_recv_packet(net_ctx->socket, partial)) <= 0)
+    {
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TRUE;    /* (the rest is still to come) */
+
+        DEBUG_LOG(("_network_recv_packet failed, errno=%d\n", errno));
+        return FALSE;
+    }
+
+    assert(bytes_read <= PACKET_BUF_LEN);
+    packet = partial->packet;
+    partial->packet = NULL;
+    packet->data_len = bytes_read;
+
+    /* enqueue the packet directly for this context */
+    _mysock_enqueue_packet(ctx, &ctx->network_recv_queue, packet);
+    return TRUE;
+}
+
+/* read what has arrived of the SYN on a connection accepted on a listening
+ * mysocket's socket, which is ready, and once it is all there, pass it up
+ * with the connection for a new mysocket to take over.  the connection is
+ * closed if it ends or fails first.
+ */
+static void _network_recv_accepted(network_accepted_t *accepted,
+                                   uint32_t            gen)
+{
+    mysock_context_t *ctx = accepted->listen_ctx;
+    socket_t socket = accepted->socket;
+    struct sockaddr peer_addr = accepted->peer_addr;
+    socklen_t peer_addr_len = accepted->peer_addr_len;
+    packet_buf_t *packet;
+    ssize_t bytes_read;
+
+    /* (only this reactor reads the partial SYN; the caller has made the
+     * listening mysocket its current one, so it can't be taken away)
+     */
+    bytes_read = _network_recv_packet(socket, &accepted->partial);
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&recv_lock));
+    if (accepted->listen_ctx != ctx || accepted->gen != gen)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
+        return;     /* (closed as the listening mysocket was) */
+    }
+    packet = accepted->partial.packet;
+    accepted->partial.packet = NULL;
+    _network_unwatch_accepted(accepted);
+    PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
+
+    if (bytes_read <= 0)
+    {
+        DEBUG_LOG(("no SYN on accepted socket %d, errno=%d\n",
+                   (int) socket, errno));
+        closesocket(socket);
+    }
+    else
+    {
+        _network_enqueue_accepted(ctx, socket, &peer_addr, peer_addr_len,
+                                  packet->data, bytes_read);
+    }
+    _mysock_release_packet(packet);
+}
+
 /* process network input.
- * this just loops around, waiting for data to arrive, and buffering it
- * for later consumption by network_recv().  (outgoing data is sent
- * immediately via network_send(), and so does not require its own thread).
- * 
+ * this just loops around, waiting for data to arrive on any of the
+ * reactor's sockets, and buffering it for later consumption by
+ * network_recv().  (outgoing data is sent immediately via network_send(),
+ * and so does not require its own thread).
+ *
  * this runs in its own thread, mostly because the transport layer needs to
  * wait with a timeout for incoming data from the peer.  [usual mechanisms
  * for I/O with timeouts such as poll(), select(), or asynchronous I/O
  * don't work with all underlying I/O mechanisms we might support (e.g.
  * VNS).  so we implement the timeout in a more generic (I/O-independent)
- * manner using the pthreads API instead].
+ * manner using the pthreads API instead].  no read waits for more than has
+ * arrived, so one slow peer (or one that connects and sends nothing)
+ * holds up no other socket in the set.
  */
-static void *network_recv_thread_func(void *arg_ptr)
+static void *network_reactor_func(void *arg_ptr)
 {
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
-    mysock_context_t *ctx;
-    network_context_socket_t *net_ctx;
+    network_reactor_t *reactor = (network_reactor_t *) arg_ptr;
+    struct epoll_event events[NETWORK_MAX_EVENTS];
 
-    DEBUG_LOG(("started receive thread\n"));
-    ctx = (mysock_context_t *) arg_ptr;
-    assert(ctx);
-
-    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
-    assert(net_ctx);
+    DEBUG_LOG(("started receive reactor\n"));
+    assert(reactor);
 
     for (;;)
     {
-        ssize_t bytes_read;
-        bool_t packet_ready = FALSE;
-        bool_t done = FALSE;
-        struct pollfd fds[] =
-        {
-            { net_ctx->exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
-            { net_ctx->socket, POLLIN, 0 }
-        };
-
+        int num_events, k;
 
-        while (!packet_ready && !done)
+        if ((num_events = epoll_wait(reactor->epfd, events,
+                                     NETWORK_MAX_EVENTS, -1)) < 0)
         {
-            switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
-            {
-            case -1:
-                assert(errno == EINTR);
-                break;
-
-            case 0:
-                assert(0);
-                break;
-
-            default:
-                assert(!(fds[0].revents & POLLERR));
-                assert(!(fds[1].revents & POLLERR));
-
-                if (fds[0].revents)
-                    done = TRUE;
-                if (fds[1].revents)
-                    packet_ready = TRUE;
-                break;
-            }
+            assert(errno == EINTR);
+            continue;
         }
 
-        if (done)
-            break;
-
-        /* block, waiting for network input.  (the system call will be
-         * interrupted by the transport layer thread if we're to exit).
-         */
-        if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
+        for (k = 0; k < num_events; ++k)
         {
-            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
-            break;
-        }
-
-        assert(bytes_read <= (int)sizeof(packet_buf));
-        if (ctx->listening)
-        {
-            /* if the socket was accepting new connections, incoming
-             * packets need to be demultiplexed and dispatched to the
-             * appropriate mysocket context.
+            int sd = (int) (events[k].data.u64 & 0xffffffff);
+            uint32_t gen = (uint32_t) (events[k].data.u64 >> 32);
+            network_watch_t *watch = NULL;
+            network_accepted_t *accepted = NULL;
+            mysock_context_t *ctx, *last;
+
+            PTHREAD_CALL(pthread_mutex_lock(&recv_lock));
+            if (sd < MAX_NUM_CONNECTIONS)
+            {
+                watch = &recv_watch[sd];
+                ctx = (watch->ctx && watch->gen == gen) ? watch->ctx : NULL;
+            }
+            else
+            {
+                accepted = &recv_accepted[sd - MAX_NUM_CONNECTIONS];
+                ctx = (accepted->listen_ctx && accepted->gen == gen)
+                    ? accepted->listen_ctx : NULL;
+            }
+            last = reactor->current;
+            reactor->current = ctx;
+            PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
+            if (last && last != ctx)
+                PTHREAD_CALL(pthread_cond_broadcast(&recv_cond));
+
+            if (ctx && accepted)
+                _network_recv_accepted(accepted, gen);
+            if (!ctx || accepted || _network_recv_one(ctx))
+                continue;
+
+            /* end of file, or an error on the socket (the peer resetting
+             * it after it closed, say): nothing more will come
              */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
-        }
-        else
-        {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
+            PTHREAD_CALL(pthread_mutex_lock(&recv_lock));
+            if (watch->ctx == ctx && watch->gen == gen)
+                _network_unwatch(ctx);
+            PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
         }
+
+        PTHREAD_CALL(pthread_mutex_lock(&recv_lock));
+        reactor->current = NULL;
+        PTHREAD_CALL(pthread_mutex_unlock(&recv_lock));
+        PTHREAD_CALL(pthread_cond_broadcast(&recv_cond));
     }
 
     return NULL;
@@ -343,21 +690,14 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
         ctx = NULL;
     }
 
-    ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
-    if (pipe(ctx->exit_pipe) < 0)
-    {
-        perror("pipe");
-        assert(0);
-        _network_destroy_context_socket(ctx);
-        ctx = NULL;
-    }
-
     return ctx;
 }
 
 static void _network_destroy_context_socket(network_context_socket_t *ctx)
 {
     assert(ctx);
+    if (ctx->recv_partial.packet)
+        _mysock_release_packet(ctx->recv_partial.packet);
     if (ctx->socket >= 0)
     {
         DEBUG_LOG(("socket network layer, closing socket %d\n",
@@ -366,18 +706,6 @@ static void _network_destroy_context_socket(network_context_socket_t *ctx)
         ctx->socket = -1;
     }
 
-    if (ctx->exit_pipe[0] >= 0)
-    {
-        close(ctx->exit_pipe[0]);
-        ctx->exit_pipe[0] = -1;
-    }
-
-    if (ctx->exit_pipe[1] >= 0)
-    {
-        close(ctx->exit_pipe[1]);
-        ctx->exit_pipe[1] = -1;
-    }
-
     free(ctx);
 }
 
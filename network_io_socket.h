@@ -16,16 +16,29 @@
 
 typedef int socket_t;
 
+/* a packet partly read from a non-blocking socket, gone on with whenever
+ * the socket is readable again (see _network_recv_packet())
+ */
+typedef struct
+{
+    packet_buf_t *packet;       /* read into; NULL until needed */
+    uint16_t      len;          /* its length (network byte order)... */
+    size_t        len_got;      /* ...of which this much is read */
+    size_t        data_got;     /* bytes of the packet read so far */
+} network_partial_t;
+
 /* socket-based network layer additional state.
  * this is pointed to by impl_data in the network_context_t structure.
  */
 typedef struct
 {
-    pthread_t          recv_thread;
-    bool_t             recv_thread_started;
-
     socket_t           socket;  /* socket used for communication to peer */
-    int                exit_pipe[2];    /* used to wake up read thread */
+
+    /* receiving (see network_io_socket.c), under its recv_lock */
+    mysock_context_t  *recv_ctx;        /* whose packets arrive on it */
+    bool_t             recv_started;    /* _network_start_recv() called */
+    bool_t             recv_ready;      /* the socket can be read */
+    network_partial_t  recv_partial;    /* (only the reactor touches) */
 } network_context_socket_t;
 
 typedef network_context_socket_t network_context_socket_udp_t;
@@ -69,11 +82,42 @@ int _network_bind_socket(network_context_t *ctx,
                          int                addrlen);
 
 
-/* this is not called directly.  use network_start_recv_thread() and
- * network_stop_recv_thread() instead.
+/* called by the backend once the socket can be waited on for packets
+ * (e.g. once it is connected), to start receiving on it if
+ * _network_start_recv() has been called
+ */
+void _network_recv_ready(network_context_t *ctx);
+
+/* these are not called directly.  use _network_start_recv() and
+ * _network_stop_recv() instead.
+ */
+
+/* read what has arrived of the next packet on a non-blocking socket,
+ * going on from where partial was left.  returns the packet's length once
+ * it is all in partial->packet (which the caller then takes, setting it
+ * to NULL), -1 with errno EAGAIN if more is to come, or 0 or -1 at the
+ * end of the file or on an error.  the part of a packet that doesn't fit
+ * in a packet buffer is read and thrown away.
+ */
+ssize_t _network_recv_packet(socket_t socket, network_partial_t *partial);
+
+/* accept a connection on a listening socket, if one is waiting, putting
+ * the peer's address in ctx->peer_addr.  returns the new socket, or -1
+ * (with errno EAGAIN if there was none).
+ */
+socket_t _network_accept(network_context_t *ctx);
+
+/* pass up the SYN read from a connection accepted on ctx, a listening
+ * mysocket, so that the new mysocket made for it takes the connection's
+ * socket over (see _network_update_passive_state()).  the socket is
+ * closed if no mysocket is made.
  */
-ssize_t _network_recv_packet(network_context_t *ctx,
-                             void *dst, size_t max_len);
+void _network_enqueue_accepted(mysock_context_t      *ctx,
+                               socket_t               socket,
+                               const struct sockaddr *peer_addr,
+                               socklen_t              peer_addr_len,
+                               const void            *syn_packet,
+                               size_t                 syn_len);
 
 
 #endif  /* __NETWORK_IO_SOCKET_H__ */
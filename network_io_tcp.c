@@ -3,22 +3,27 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <alloca.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
+#include "connection_demux.h"
 
 
 #define MAX_NUM_PENDING_CONNECTIONS 10
 
-typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
-
-static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static ssize_t _tcp_read(socket_t, void *, size_t);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static void _tcp_nodelay(socket_t tcp_sd);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -36,6 +41,16 @@ static int _tcp_connect(network_context_t *ctx);
  */
 
 
+/* packets travel over a TCP connection, which loses, reorders and
+ * corrupts nothing--only the simulated losses of an unreliable mysocket
+ * get in the way.
+ */
+bool_t _network_is_reliable(network_context_t *ctx)
+{
+    assert(ctx);
+    return ctx->is_reliable;
+}
+
 /* initialise the network subsystem.  this function should be called before
  * making use of any of the other network layer functions.
  */
@@ -98,7 +113,11 @@ int _network_listen(network_context_t *ctx, int backlog)
     assert(ctx);
     VERIFY_SOCKET(ctx);
 
-    return listen(GET_SOCKET(ctx), backlog);
+    if (listen(GET_SOCKET(ctx), backlog) < 0)
+        return -1;
+
+    _network_recv_ready(ctx);
+    return 0;
 }
 
 void _network_update_passive_state(network_context_t *new_ctx,
@@ -125,20 +144,38 @@ void _network_update_passive_state(network_context_t *new_ctx,
     closesocket(new_tcp_ctx->base.socket);
     new_tcp_ctx->base.socket = accept_tcp_ctx->new_socket;
     new_tcp_ctx->connected = TRUE;
+    new_ctx->local_port = 0;    /* now that of the accepted socket */
     accept_tcp_ctx->new_socket = -1;
     DEBUG_LOG(("passed accepted socket %d on to new context...\n",
                new_tcp_ctx->base.socket));
+    _network_recv_ready(new_ctx);
 }
 
 
 /* send the given packet to the peer */
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+    iov.iov_base = (void *) src;
+    iov.iov_len = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* the length and the pieces of the packet go out in one writev() */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
+    struct iovec packet_iov[NETWORK_MAX_IOV + 1];
     uint16_t packet_len;    /* network byte order */
+    size_t len = 0;
+    int k;
 
-    assert(ctx && src);
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= NETWORK_MAX_IOV);
     assert(ctx->peer_addr_len > 0);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
@@ -150,120 +187,201 @@ ssize_t _network_send_packet(network_context_t *ctx,
     if (_tcp_connect(ctx) < 0)
         return -1;
 
+    for (k = 0; k < iovcnt; ++k)
+    {
+        packet_iov[k + 1] = iov[k];
+        len += iov[k].iov_len;
+    }
+    assert(len <= 0xffff);
+
     packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    packet_iov[0].iov_base = &packet_len;
+    packet_iov[0].iov_len = sizeof(packet_len);
+
+    if (_tcp_writev(GET_SOCKET(ctx), packet_iov, iovcnt + 1) < 0)
         return -1;
 
     return len;
 }
 
-/* read a packet from the peer */
-ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+/* accept a connection waiting on a listening socket (which is
+ * non-blocking).  the new socket is handed over to the mysocket made for
+ * the SYN that comes on it; see _network_enqueue_accepted().
+ */
+socket_t _network_accept(network_context_t *ctx)
 {
-    network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;
-    socket_t io_socket;
-    int rc;
-
-    assert(ctx && dst);
-
-    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
-    assert(tcp_io_ctx);
-    assert(tcp_io_ctx->sock_ctx);
+    socket_t tmp_sd;
 
+    assert(ctx);
     VERIFY_SOCKET(ctx);
-    io_socket = tcp_io_ctx->base.socket;
 
-    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
-        return -1;
+    ctx->peer_addr_len = sizeof(ctx->peer_addr);
+    if ((tmp_sd = accept(GET_SOCKET(ctx),
+                         &ctx->peer_addr,
+                         &ctx->peer_addr_len)) < 0)
+        return tmp_sd;
 
-    if (tcp_io_ctx->sock_ctx->listening/* ||
-        (tcp_io_ctx->sock_ctx->is_active && !tcp_io_ctx->connected)*/)
-    {
-        socket_t tmp_sd;
+    DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+    DEBUG_PEER(ctx);
+    _tcp_nodelay(tmp_sd);
+    return tmp_sd;
+}
 
-        ctx->peer_addr_len = sizeof(ctx->peer_addr);
-        if ((tmp_sd = accept(GET_SOCKET(ctx),
-                             &ctx->peer_addr,
-                             &ctx->peer_addr_len)) < 0)
-        {
-            perror("accept (network_io_tcp)");
-            return tmp_sd;
-        }
+void _network_enqueue_accepted(mysock_context_t      *ctx,
+                               socket_t               socket,
+                               const struct sockaddr *peer_addr,
+                               socklen_t              peer_addr_len,
+                               const void            *syn_packet,
+                               size_t                 syn_len)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
 
-        DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+    assert(ctx && ctx->listening && socket >= 0);
 
-        /* keep listening socket open for futher connection requests */
-        /* we will not reenter this function until this SYN packet has
-         * been dispatched to the right context, and that context's
-         * socket updated to be 'new_socket'
-         */
-        assert(tcp_io_ctx->new_socket == -1);
-        tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
-    }
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->network_state.impl_data;
+    assert(tcp_io_ctx);
 
-    DEBUG_PEER(ctx);
+    /* the listening socket's reactor passes its SYNs up one at a time, and
+     * _network_update_passive_state() takes new_socket while this one is
+     */
+    assert(tcp_io_ctx->new_socket == -1);
+    tcp_io_ctx->new_socket = socket;
+    (void) _mysock_enqueue_connection(ctx, syn_packet, syn_len,
+                                      peer_addr, peer_addr_len, NULL);
 
-#ifdef DEBUG
-    if (getpeername(io_socket, &ctx->peer_addr, &ctx->peer_addr_len) < 0)
+    if (tcp_io_ctx->new_socket != -1)
     {
-        DEBUG_LOG(("getpeername failed (errno=%d)\n", errno));
-        return -1;
+        DEBUG_LOG(("SYN dropped, closing accepted socket %d...\n",
+                   (int) tcp_io_ctx->new_socket));
+        closesocket(tcp_io_ctx->new_socket);
+        tcp_io_ctx->new_socket = -1;
     }
-#endif
+}
 
-    if ((rc = _tcp_io(io_socket, &packet_len, sizeof(packet_len), read)) <= 0)
-    {
-        DEBUG_LOG(("couldn't read packet len: %d\n", rc));
-        return rc;
-    }
+/* read on with a packet from the peer: its length, then the packet */
+ssize_t _network_recv_packet(socket_t io_socket, network_partial_t *partial)
+{
+    size_t packet_len;
+    ssize_t rc;
+
+    assert(io_socket >= 0 && partial);
 
-    packet_len = ntohs(packet_len);
-    if ((rc = _tcp_io(io_socket, dst, MIN(packet_len, max_len), read)) <= 0)
+    if (!partial->packet)
+        partial->packet = _mysock_alloc_packet();
+
+    while (partial->len_got < sizeof(partial->len))
     {
-        DEBUG_LOG(("couldn't read packet: %d\n", rc));
-        return rc;
+        if ((rc = _tcp_read(io_socket,
+                            (char *) &partial->len + partial->len_got,
+                            sizeof(partial->len) - partial->len_got)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packet len: %d\n", (int) rc));
+            return rc;
+        }
+        partial->len_got += rc;
     }
 
-    if (packet_len > max_len)
+    packet_len = ntohs(partial->len);
+    while (partial->data_got < packet_len)
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
+        char discard[256];
+        char *dst = discard;
+        size_t count = MIN(packet_len - partial->data_got, sizeof(discard));
+
+        if (partial->data_got < PACKET_BUF_LEN)
+        {
+            dst = partial->packet->data + partial->data_got;
+            count = MIN(packet_len, PACKET_BUF_LEN) - partial->data_got;
+        }
+
+        if ((rc = _tcp_read(io_socket, dst, count)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packet: %d\n", (int) rc));
+            return rc;
+        }
+        partial->data_got += rc;
     }
 
-    return packet_len;
+    partial->len_got = 0;
+    partial->data_got = 0;
+    return MIN(packet_len, PACKET_BUF_LEN);
 }
 
 
-/* read/write count bytes into/from buf */
-static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
+/* read up to count bytes of what has arrived on a socket */
+static ssize_t _tcp_read(socket_t tcp_sd, void *buf, size_t count)
 {
-    char *cbuf = (char *) buf;
-    size_t bytes_remaining;
+    ssize_t rc;
 
-    assert(buf && io_func);
-    for (bytes_remaining = count; bytes_remaining > 0; )
+    assert(buf && count > 0);
+    while ((rc = read(tcp_sd, buf, count)) < 0 && errno == EINTR)
+        ;
+    return rc;
+}
+
+/* write all of the iovcnt pieces in iov, which is used up as they go.
+ * the socket is non-blocking once it is read from (see
+ * _network_recv_ready()), so this waits for room as a write would.
+ */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
+{
+    size_t count = 0;
+    int k;
+
+    assert(iov && iovcnt > 0);
+    for (k = 0; k < iovcnt; ++k)
+        count += iov[k].iov_len;
+
+    while (iovcnt > 0)
     {
-        int rc;
+        ssize_t rc;
 
-        if ((rc = io_func(tcp_sd, cbuf, bytes_remaining)) <= 0)
+        if ((rc = writev(tcp_sd, iov, iovcnt)) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
         {
-            DEBUG_LOG(("_tcp_io rc: %d\n", rc));
+            struct pollfd pfd;
+
+            pfd.fd = tcp_sd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            (void) poll(&pfd, 1, -1);
+            continue;
+        }
+        if (rc <= 0)
+        {
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
             return rc;
         }
 
-        assert(rc <= (int)bytes_remaining);
-        bytes_remaining -= rc;
-        cbuf += rc;
+        /* skip what was written, leaving iov at a short write's remainder */
+        while (iovcnt > 0 && (size_t) rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
     }
 
     return count;
 }
 
+/* each packet is written whole, so holding a short one back for the next
+ * (Nagle) only delays it--a request/response exchange would otherwise wait
+ * out the peer's delayed ACK on every round trip
+ */
+static void _tcp_nodelay(socket_t tcp_sd)
+{
+    int on = 1;
+
+    if (setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        perror("setsockopt (TCP_NODELAY)");
+}
+
 static int _tcp_connect(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
@@ -291,7 +409,11 @@ static int _tcp_connect(network_context_t *ctx)
             return -1;
         }
 
+        _tcp_nodelay(GET_SOCKET(ctx));
         tcp_io_ctx->connected = TRUE;
+
+        /* nothing can be read from the socket before now */
+        _network_recv_ready(ctx);
     }
     PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
 
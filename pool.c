@@ -0,0 +1,223 @@
+/* pool.c--free-list pools of fixed-size objects, for the things the data
+ * path would otherwise malloc() and free() once per segment: queue nodes
+ * and their buffers, out of order and unacknowledged segments, and timers.
+ * see pool.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "mysock_impl.h"
+#include "pool.h"
+
+
+/* a thread's own free objects from one pool */
+typedef struct
+{
+    pool_t *pool;
+    void *head;
+    int count;
+} pool_cache_t;
+
+/* pools that have been used, for pool_print_stats() */
+static pool_t *pool_list = NULL;
+static pthread_mutex_t pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* free objects are linked through their first word */
+#define NEXT_FREE(obj) (*(void **) (obj))
+
+/* objects are kept 16-byte aligned, as malloc() keeps them */
+static size_t pool_stride(pool_t *pool)
+{
+    size_t size = (pool->size < sizeof(void *)) ? sizeof(void *) : pool->size;
+
+    return (size + 15) & ~(size_t) 15;
+}
+
+/* called at thread exit: the thread's free objects go back to the pool */
+static void pool_cache_destroy(void *arg)
+{
+    pool_cache_t *cache = (pool_cache_t *) arg;
+    pool_t *pool = cache->pool;
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool->lock));
+    while (cache->head)
+    {
+        void *obj = cache->head;
+
+        cache->head = NEXT_FREE(obj);
+        NEXT_FREE(obj) = pool->free_list;
+        pool->free_list = obj;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&pool->lock));
+
+    free(cache);
+}
+
+/* the calling thread's cache for the given pool, set up on first use */
+static pool_cache_t *pool_get_cache(pool_t *pool)
+{
+    pool_cache_t *cache;
+
+    if (!pool->ready)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&pool->lock));
+        if (!pool->ready)
+        {
+            PTHREAD_CALL(pthread_key_create(&pool->key, pool_cache_destroy));
+
+            PTHREAD_CALL(pthread_mutex_lock(&pool_list_lock));
+            pool->next = pool_list;
+            pool_list = pool;
+            PTHREAD_CALL(pthread_mutex_unlock(&pool_list_lock));
+
+            __sync_synchronize();
+            pool->ready = TRUE;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&pool->lock));
+    }
+
+    if ((cache = (pool_cache_t *) pthread_getspecific(pool->key)) == NULL)
+    {
+        cache = (pool_cache_t *) calloc(1, sizeof(pool_cache_t));
+        assert(cache);
+        cache->pool = pool;
+        PTHREAD_CALL(pthread_setspecific(pool->key, cache));
+    }
+
+    return cache;
+}
+
+/* move up to a batch of objects from the shared list into an empty cache,
+ * or a new slab if the shared list is empty too.
+ */
+static void pool_refill(pool_t *pool, pool_cache_t *cache)
+{
+    assert(!cache->head && !cache->count);
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool->lock));
+    if (pool->free_list)
+    {
+        while (pool->free_list && cache->count < POOL_BATCH)
+        {
+            void *obj = pool->free_list;
+
+            pool->free_list = NEXT_FREE(obj);
+            NEXT_FREE(obj) = cache->head;
+            cache->head = obj;
+            ++cache->count;
+        }
+        ++pool->stats.refills;
+    }
+    else
+    {
+        size_t stride = pool_stride(pool);
+        char *slab = (char *) malloc(POOL_SLAB_OBJECTS * stride);
+        int k;
+
+        assert(slab);
+        for (k = POOL_SLAB_OBJECTS - 1; k >= 0; --k)
+        {
+            NEXT_FREE(slab + k * stride) = cache->head;
+            cache->head = slab + k * stride;
+        }
+        cache->count = POOL_SLAB_OBJECTS;
+
+        ++pool->stats.slabs;
+        pool->stats.objects += POOL_SLAB_OBJECTS;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&pool->lock));
+}
+
+/* hand a batch of objects from an overfull cache back to the shared list */
+static void pool_flush(pool_t *pool, pool_cache_t *cache)
+{
+    void *first = cache->head, *last = NULL;
+    int k;
+
+    for (k = 0; k < POOL_BATCH; ++k)
+    {
+        last = cache->head;
+        cache->head = NEXT_FREE(last);
+    }
+    cache->count -= POOL_BATCH;
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool->lock));
+    NEXT_FREE(last) = pool->free_list;
+    pool->free_list = first;
+    PTHREAD_CALL(pthread_mutex_unlock(&pool->lock));
+}
+
+void *pool_alloc(pool_t *pool)
+{
+    pool_cache_t *cache;
+    void *obj;
+
+    assert(pool);
+    cache = pool_get_cache(pool);
+    if (!cache->head)
+        pool_refill(pool, cache);
+
+    obj = cache->head;
+    cache->head = NEXT_FREE(obj);
+    --cache->count;
+
+    __sync_fetch_and_add(&pool->stats.allocs, 1);
+    return obj;
+}
+
+void *pool_zalloc(pool_t *pool)
+{
+    void *obj = pool_alloc(pool);
+
+    memset(obj, 0, pool->size);
+    return obj;
+}
+
+void pool_free(pool_t *pool, void *obj)
+{
+    pool_cache_t *cache;
+
+    assert(pool);
+    if (!obj)
+        return;
+
+    cache = pool_get_cache(pool);
+    NEXT_FREE(obj) = cache->head;
+    cache->head = obj;
+    if (++cache->count > POOL_CACHE_OBJECTS)
+        pool_flush(pool, cache);
+
+    __sync_fetch_and_add(&pool->stats.frees, 1);
+}
+
+void pool_get_stats(pool_t *pool, pool_stats_t *stats)
+{
+    assert(pool && stats);
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool->lock));
+    *stats = pool->stats;
+    PTHREAD_CALL(pthread_mutex_unlock(&pool->lock));
+}
+
+void pool_print_stats(FILE *fp)
+{
+    pool_t *pool;
+
+    assert(fp);
+
+    PTHREAD_CALL(pthread_mutex_lock(&pool_list_lock));
+    for (pool = pool_list; pool; pool = pool->next)
+    {
+        pool_stats_t stats;
+
+        pool_get_stats(pool, &stats);
+        fprintf(fp, "%-10s %5u bytes: %lu allocs, %lu frees, %lu in use, "
+                "%lu refills, %lu slabs (%lu objects)\n",
+                pool->name, (unsigned) pool->size, stats.allocs, stats.frees,
+                stats.allocs - stats.frees, stats.refills, stats.slabs,
+                stats.objects);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&pool_list_lock));
+}
@@ -0,0 +1,62 @@
+/* internal header--free-list pools of fixed-size objects */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include "mysock.h"
+
+/* objects are carved out of slabs of POOL_SLAB_OBJECTS taken from malloc()
+ * as the pool grows; slabs are never given back.  each thread keeps up to
+ * POOL_CACHE_OBJECTS free objects of its own, and trades POOL_BATCH of them
+ * at a time with the pool's shared list, so most allocations and frees
+ * take no lock and, once the pool has grown to the working set, none of
+ * them go to the heap.
+ */
+#define POOL_SLAB_OBJECTS 64
+#define POOL_CACHE_OBJECTS 64
+#define POOL_BATCH (POOL_CACHE_OBJECTS / 2)
+
+typedef struct
+{
+    unsigned long allocs;   /* pool_alloc() calls */
+    unsigned long frees;    /* pool_free() calls */
+    unsigned long refills;  /* batches a thread took from the shared list */
+    unsigned long slabs;    /* slabs taken from malloc() */
+    unsigned long objects;  /* objects in those slabs */
+} pool_stats_t;
+
+typedef struct pool
+{
+    const char *name;
+    size_t size;            /* of each object */
+
+    pthread_mutex_t lock;   /* protects the rest */
+    bool_t ready;           /* key has been created */
+    pthread_key_t key;      /* this thread's pool_cache_t */
+    void *free_list;        /* shared by all threads */
+    pool_stats_t stats;
+    struct pool *next;      /* in the list of pools in use */
+} pool_t;
+
+/* define a pool with "static pool_t foo_pool = POOL_INITIALIZER(...);" */
+#define POOL_INITIALIZER(name, size) \
+    { (name), (size), PTHREAD_MUTEX_INITIALIZER, FALSE, 0, NULL, \
+      { 0, 0, 0, 0, 0 }, NULL }
+
+/* an object of pool->size bytes, uninitialised as from malloc() */
+void *pool_alloc(pool_t *pool);
+
+/* a zeroed object, as calloc(1, pool->size) would give */
+void *pool_zalloc(pool_t *pool);
+
+/* return an object from pool_alloc() on the same pool; NULL is ignored */
+void pool_free(pool_t *pool, void *obj);
+
+void pool_get_stats(pool_t *pool, pool_stats_t *stats);
+
+/* one line per pool that has been used */
+void pool_print_stats(FILE *fp);
+
+#endif  /* __POOL_H__ */
@@ -0,0 +1,323 @@
+/* sched_bench.c--aggregate throughput of many bulk connections over
+ * loopback, with the transport fibers run by 1, 2, 4, ... workers.
+ *
+ * each run is a process of its own (the worker pool is started once), in
+ * which every connection is both made and accepted.  a few app threads,
+ * as many as there are workers, each write to and read from their share
+ * of the connections through a myepoll set.  the clock runs from the last
+ * handshake until the last byte is read.
+ *
+ * usage: sched_bench [-c connections] [-b bytes per connection]
+ *                    [-w most workers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "mysock_impl.h"
+#include "fiber.h"
+
+
+#define CHUNK_SIZE (16 * 1024)
+#define MAX_EVENTS 64
+
+typedef struct
+{
+    int        first, last;     /* connections [first, last) */
+    mysocket_t *client_sds, *server_sds;
+    size_t     *sent, *rcvd;
+    size_t      bytes;          /* per connection */
+} slice_t;
+
+static char chunk[CHUNK_SIZE];
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* move a slice's data until all of it has been read */
+static void *app_thread(void *arg)
+{
+    slice_t *slice = (slice_t *) arg;
+    struct myepoll_event events[MAX_EVENTS];
+    char buf[CHUNK_SIZE];
+    int epd, k, left = 0;
+
+    if ((epd = myepoll_create()) < 0)
+    {
+        perror("myepoll_create");
+        exit(1);
+    }
+
+    /* (data is twice the connection's index, plus one for the server's
+     * end: clients write, servers read)
+     */
+    for (k = slice->first; k < slice->last; ++k)
+    {
+        struct myepoll_event event;
+
+        event.events = MYPOLLOUT;
+        event.data = (void *) (long) (2 * k);
+        if (myepoll_ctl(epd, MYEPOLL_CTL_ADD, slice->client_sds[k],
+                        &event) < 0)
+        {
+            perror("myepoll_ctl");
+            exit(1);
+        }
+        event.events = MYPOLLIN;
+        event.data = (void *) (long) (2 * k + 1);
+        if (myepoll_ctl(epd, MYEPOLL_CTL_ADD, slice->server_sds[k],
+                        &event) < 0)
+        {
+            perror("myepoll_ctl");
+            exit(1);
+        }
+        ++left;
+    }
+
+    while (left > 0)
+    {
+        int num_events = myepoll_wait(epd, events, MAX_EVENTS, -1);
+
+        for (k = 0; k < num_events; ++k)
+        {
+            long conn = (long) events[k].data / 2;
+            mysocket_t sd = events[k].sd;
+            int n;
+
+            if (!((long) events[k].data & 1))
+            {
+                size_t *sent = &slice->sent[conn];
+
+                n = mywrite(sd, chunk,
+                            MIN(sizeof(chunk), slice->bytes - *sent));
+                if (n > 0 && (*sent += n) == slice->bytes)
+                    (void) myepoll_ctl(epd, MYEPOLL_CTL_DEL, sd, NULL);
+            }
+            else
+            {
+                size_t *rcvd = &slice->rcvd[conn];
+
+                n = myread(sd, buf, sizeof(buf));
+                if (n == 0)
+                {
+                    fprintf(stderr, "connection closed early\n");
+                    exit(1);
+                }
+                if (n > 0 && (*rcvd += n) == slice->bytes)
+                {
+                    (void) myepoll_ctl(epd, MYEPOLL_CTL_DEL, sd, NULL);
+                    --left;
+                }
+            }
+            if (n < 0 && errno != EAGAIN)
+            {
+                perror("mywrite/myread");
+                exit(1);
+            }
+        }
+    }
+
+    (void) myepoll_close(epd);
+    return NULL;
+}
+
+/* one run, in a child process; the MB/s is written to fd */
+static void run(int num_workers, int num_conns, size_t bytes, int fd)
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    mysocket_t lsd, *client_sds, *server_sds;
+    struct mypollfd *fds;
+    pthread_t threads[FIBER_MAX_WORKERS];
+    slice_t slices[FIBER_MAX_WORKERS];
+    size_t *sent, *rcvd;
+    double start, rate;
+    int k, pending;
+
+    fiber_set_workers(num_workers);
+
+    client_sds = (mysocket_t *) calloc(num_conns, sizeof(mysocket_t));
+    server_sds = (mysocket_t *) calloc(num_conns, sizeof(mysocket_t));
+    sent = (size_t *) calloc(num_conns, sizeof(size_t));
+    rcvd = (size_t *) calloc(num_conns, sizeof(size_t));
+    fds = (struct mypollfd *) calloc(num_conns, sizeof(struct mypollfd));
+    assert(client_sds && server_sds && sent && rcvd && fds);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((lsd = mysocket(TRUE)) < 0 ||
+        mysetsockopt(lsd, MYSO_FASTPATH, 1) < 0 ||
+        mybind(lsd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        mylisten(lsd, num_conns) < 0 ||
+        mygetsockname(lsd, (struct sockaddr *) &sin, &sin_len) < 0)
+    {
+        perror("listening mysocket");
+        exit(1);
+    }
+
+    /* start all the handshakes, then accept them all */
+    for (k = 0; k < num_conns; ++k)
+    {
+        if ((client_sds[k] = mysocket(TRUE)) < 0 ||
+            mysetsockopt(client_sds[k], MYSO_FASTPATH, 1) < 0 ||
+            mysetsockopt(client_sds[k], MYSO_NONBLOCK, 1) < 0 ||
+            (myconnect(client_sds[k], (struct sockaddr *) &sin,
+                       sizeof(sin)) < 0 && errno != EINPROGRESS))
+        {
+            perror("myconnect");
+            exit(1);
+        }
+        fds[k].sd = client_sds[k];
+        fds[k].events = MYPOLLOUT;
+    }
+    for (k = 0; k < num_conns; ++k)
+    {
+        if ((server_sds[k] = myaccept(lsd, NULL, NULL)) < 0 ||
+            mysetsockopt(server_sds[k], MYSO_NONBLOCK, 1) < 0)
+        {
+            perror("myaccept");
+            exit(1);
+        }
+    }
+    /* (the ones still connecting are kept at the front of fds) */
+    for (pending = num_conns; pending > 0; )
+    {
+        if (mypoll(fds, pending, -1) < 0)
+        {
+            perror("mypoll");
+            exit(1);
+        }
+        for (k = 0; k < pending; )
+        {
+            if (!fds[k].revents)
+            {
+                ++k;
+                continue;
+            }
+            if (fds[k].revents & (MYPOLLERR | MYPOLLHUP))
+            {
+                fprintf(stderr, "connection failed\n");
+                exit(1);
+            }
+            fds[k] = fds[--pending];
+        }
+    }
+
+    start = now();
+    for (k = 0; k < num_workers; ++k)
+    {
+        slices[k].first = num_conns * k / num_workers;
+        slices[k].last = num_conns * (k + 1) / num_workers;
+        slices[k].client_sds = client_sds;
+        slices[k].server_sds = server_sds;
+        slices[k].sent = sent;
+        slices[k].rcvd = rcvd;
+        slices[k].bytes = bytes;
+        PTHREAD_CALL(pthread_create(&threads[k], NULL, app_thread,
+                                    &slices[k]));
+    }
+    for (k = 0; k < num_workers; ++k)
+        PTHREAD_CALL(pthread_join(threads[k], NULL));
+    rate = (double) bytes * num_conns / (now() - start) / 1e6;
+
+    if (write(fd, &rate, sizeof(rate)) != sizeof(rate))
+        exit(1);
+
+    /* (the connections go with the process) */
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int num_conns = 200, max_workers, num_workers, opt;
+    size_t bytes = 256 * 1024;
+    double base = 0;
+
+    max_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "c:b:w:")) != EOF)
+    {
+        switch (opt)
+        {
+        case 'c': num_conns = atoi(optarg); break;
+        case 'b': bytes = (size_t) atol(optarg); break;
+        case 'w': max_workers = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c connections] "
+                    "[-b bytes per connection] [-w most workers]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_workers < 1)
+        max_workers = 1;
+    if (max_workers > FIBER_MAX_WORKERS)
+        max_workers = FIBER_MAX_WORKERS;
+    if (num_conns < 1 || 2 * num_conns + 1 > MAX_NUM_CONNECTIONS ||
+        bytes == 0)
+    {
+        fprintf(stderr, "between 1 and %d connections, of at least a byte\n",
+                (MAX_NUM_CONNECTIONS - 1) / 2);
+        return 1;
+    }
+    memset(chunk, 'x', sizeof(chunk));
+
+    printf("%d connections, %lu bytes each\n", num_conns,
+           (unsigned long) bytes);
+    printf("workers      MB/s  speedup\n");
+    for (num_workers = 1; ; num_workers *= 2)
+    {
+        int fds[2], status;
+        double rate;
+        pid_t pid;
+
+        if (num_workers > max_workers)
+            num_workers = max_workers;
+
+        /* the transport layer prints on stdout, so the child's result
+         * comes back down a pipe
+         */
+        fflush(stdout);
+        if (pipe(fds) < 0 || (pid = fork()) < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0)
+        {
+            close(fds[0]);
+            if (!freopen("/dev/null", "w", stdout))
+                exit(1);
+            run(num_workers, num_conns, bytes, fds[1]);
+        }
+
+        close(fds[1]);
+        if (read(fds[0], &rate, sizeof(rate)) != sizeof(rate) ||
+            waitpid(pid, &status, 0) < 0 || status != 0)
+        {
+            fprintf(stderr, "run with %d workers failed\n", num_workers);
+            return 1;
+        }
+        close(fds[0]);
+
+        if (!base)
+            base = rate;
+        printf("%7d  %8.1f  %6.2fx\n", num_workers, rate, rate / base);
+        if (num_workers == max_workers)
+            break;
+    }
+
+    return 0;
+}
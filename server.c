@@ -5,6 +5,10 @@
  * client to send it something, which it interprets as the name of some
  * file. It then sends an OK to the client (if it can access the requested
  * file) and finally sends the file.
+ *
+ * The connection is in message mode, so each request and response is one
+ * message.  Connections are served side by side, a request at a time from
+ * whichever have one waiting (see myepoll_wait()).
  * 
  */
 
@@ -26,10 +30,12 @@
 
 
 
-static char usage[] = "usage: %s [-U]\n";
+static char usage[] = "usage: %s [-U] [-F] [-z] [-c] [-p]\n";
+
+#define MAX_EVENTS 16
 
-static void do_connection(mysocket_t bindsd);
-static int get_nvt_line(int sd, char *);
+static int do_request(mysocket_t sd);
+static int get_request(int sd, char *, size_t);
 static int process_line(int sd, char *);
 static int local_name(mysocket_t sd, char *name);
 
@@ -39,19 +45,36 @@ main(int argc, char *argv[])
 {
     struct sockaddr_in sin;
     mysocket_t bindsd;
-    int len, opt, errflg = 0;
+    struct myepoll_event event;
+    int epd, len, opt, errflg = 0;
     char localname[256];
     bool_t reliable = TRUE;
+    bool_t fastopen = FALSE;
+    bool_t compress = FALSE;
+    bool_t crc32c = FALSE;
+    bool_t fastpath = FALSE;
 
 
     /* Parse the command line */
-    while ((opt = getopt(argc, argv, "U")) != EOF)
+    while ((opt = getopt(argc, argv, "UFzcp")) != EOF)
     {
         switch (opt)
         {
         case 'U':
             reliable = FALSE;
             break;
+        case 'F':
+            fastopen = TRUE;
+            break;
+        case 'z':
+            compress = TRUE;
+            break;
+        case 'c':
+            crc32c = TRUE;
+            break;
+        case 'p':
+            fastpath = TRUE;
+            break;
         case '?':
             ++errflg;
             break;
@@ -83,6 +106,16 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (mysetsockopt(bindsd, MYSO_MESSAGES, 1) < 0 ||
+        mysetsockopt(bindsd, MYSO_COMPRESS, compress) < 0 ||
+        mysetsockopt(bindsd, MYSO_CRC32C, crc32c) < 0 ||
+        mysetsockopt(bindsd, MYSO_FASTPATH, fastpath) < 0 ||
+        (fastopen && mysetsockopt(bindsd, MYSO_FASTOPEN, 1) < 0))
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     if (mylisten(bindsd, 5) < 0)
     {
         perror("mylisten");
@@ -96,105 +129,113 @@ main(int argc, char *argv[])
         fprintf(stderr, "Server's address is %s\n", localname);
         fflush(stderr);
 
+    if ((epd = myepoll_create()) < 0)
+    {
+        perror("myepoll_create");
+        exit(EXIT_FAILURE);
+    }
+
+    event.events = MYPOLLIN;
+    event.data = NULL;
+    if (myepoll_ctl(epd, MYEPOLL_CTL_ADD, bindsd, &event) < 0)
+    {
+        perror("myepoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
     for (;;)
     {
-        mysocket_t sd;
+        struct myepoll_event events[MAX_EVENTS];
+        int num_events, k;
 
-        /* just keep accepting connections forever */
-        if ((sd = myaccept(bindsd, (struct sockaddr *) &sin, &len)) < 0)
+        if ((num_events = myepoll_wait(epd, events, MAX_EVENTS, -1)) < 0)
         {
-            perror("myaccept");
+            perror("myepoll_wait");
             exit(EXIT_FAILURE);
         }
 
-        assert(sin.sin_family == AF_INET);
-        fprintf(stderr, "connected to %s at port %u\n",
-                inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-
-        do_connection(sd);
+        for (k = 0; k < num_events; ++k)
+        {
+            mysocket_t sd = events[k].sd;
+
+            if (sd != bindsd)
+            {
+                /* a request (or the end of the connection) is waiting */
+                if (do_request(sd) < 0 && myclose(sd) < 0)
+                    perror("myclose (sd)");
+                continue;
+            }
+
+            /* just keep accepting connections forever */
+            len = sizeof(struct sockaddr_in);
+            if ((sd = myaccept(bindsd, (struct sockaddr *) &sin, &len)) < 0)
+            {
+                perror("myaccept");
+                if (errno == ETIMEDOUT)
+                    continue;   /* client went away during the handshake */
+                exit(EXIT_FAILURE);
+            }
+
+            assert(sin.sin_family == AF_INET);
+            fprintf(stderr, "connected to %s at port %u\n",
+                    inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+
+            event.events = MYPOLLIN;
+            if (myepoll_ctl(epd, MYEPOLL_CTL_ADD, sd, &event) < 0)
+            {
+                perror("myepoll_ctl");
+                exit(EXIT_FAILURE);
+            }
+        }
     }                           /* end for(;;) */
 
+    myepoll_close(epd);
     if (myclose(bindsd) < 0)
         perror("myclose (bindsd)");
     return 0;
 }
 
-/* process a single client connection */
-static void do_connection(mysocket_t sd)
+/* process the next request on a client connection.  returns -1 once the
+ * connection is over, and should be closed.
+ */
+static int do_request(mysocket_t sd)
 {
     char line[256];
-    int rc;
 
+    if (get_request(sd, line, sizeof(line)) < 0 || !*line)
+        return -1;
+    fprintf(stderr, "client: %s\n", line);
 
-    /* loop over: 
-       - get a request from the client
-       - process the request
-     */
-
-    for (;;)
-    {
-        rc = get_nvt_line(sd, line);
-        if (rc < 0 || !*line)
-            goto done;
-        fprintf(stderr, "client: %s\n", line);
-
-        if (process_line(sd, line) < 0)
-        {
-            perror("process_line");
-            goto done;
-        }
-    }   /* for (;;) */
-
-done:
-    if (myclose(sd) < 0)
+    if (process_line(sd, line) < 0)
     {
-        perror("myclose (sd)");
+        perror("process_line");
+        return -1;
     }
+
+    return 0;
 }
 
 
 /**********************************************************************/
-/* get_nvt_line
+/* get_request
  * 
- * Retrieves the next line of NVT ASCII from mysocket layer.
+ * Retrieves the next request (one message) from mysocket layer as a
+ * string; an empty string means the connection ended.
  *
  * Returns 
  *  0 on success
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_request(int sd, char *line, size_t size)
 {
-    char last_char;
-    char this_char;
     int len;
 
-    last_char = '\0';
-    for (;;)
-    {
-        len = myread(sd, &this_char, sizeof(this_char));
-        if (len < 0)
-            return -1;
-
-        if (len == 0)
-        {
-            /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
-            return 0;
-        }
-    /** fprintf(stderr, "read character %c\n", this_char); **/
-        if (last_char == '\r' && this_char == '\n')
-        {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
-            return 0;
-        }
+    if ((len = myread(sd, line, size - 1)) < 0)
+        return -1;
 
-        *line++ = this_char;
-        last_char = this_char;
-    }
-    return -1;
+    line[len] = '\0';
+    return 0;
 }
 
 /**********************************************************************/
@@ -216,17 +257,17 @@ process_line(int sd, char *line)
 
     if (!*line || access(line, R_OK) < 0)
     {
-        sprintf(resp, "%s,-1,File does not exist or access denied\r\n", line);
+        sprintf(resp, "%s,-1,File does not exist or access denied", line);
     }
     else
     {
         if ((fd = open(line, O_RDONLY)) < 0)
         {
-            sprintf(resp, "%s,-1,File could not be opened\r\n", line);
+            sprintf(resp, "%s,-1,File could not be opened", line);
         }
         else
         {
-            sprintf(resp, "%s,%lu,Ok\r\n", line, lseek(fd, 0, SEEK_END));
+            sprintf(resp, "%s,%lu,Ok", line, lseek(fd, 0, SEEK_END));
             lseek(fd, 0, SEEK_SET);
         }
     }
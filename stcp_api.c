@@ -14,6 +14,7 @@
 #include "connection_demux.h"
 #include "tcp_sum.h"
 #include "transport.h"
+#include "fiber.h"
 
 
 /* called by the transport layer thread to unblock the calling application,
@@ -39,6 +40,7 @@ void stcp_unblock_application(mysocket_t sd)
         ctx->stcp_errno = 0;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
     PTHREAD_CALL(pthread_cond_signal(&ctx->blocking_cond));
+    _mysock_poll_notify(ctx);
 
     if (!ctx->is_active)
     {
@@ -65,18 +67,23 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
 {
     unsigned int rc = 0;
     mysock_context_t *ctx = _mysock_get_context(sd);
+    bool_t waiting = FALSE;
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     for (;;)
     {
-        if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
+        if ((flags & APP_DATA) && !RING_EMPTY(&ctx->app_recv_queue))
             rc |= APP_DATA;
 
-        if ((flags & NETWORK_DATA) && (ctx->network_recv_queue.head != NULL))
+        if ((flags & NETWORK_DATA) &&
+            !PACKET_QUEUE_EMPTY(&ctx->network_recv_queue))
             rc |= NETWORK_DATA;
 
+        if ((flags & APP_ROOM) && ctx->app_reads != ctx->app_reads_seen)
+            rc |= APP_ROOM;
+
         if (/*(flags & APP_CLOSE_REQUESTED) &&*/
-            ctx->close_requested && (ctx->app_recv_queue.head == NULL))
+            ctx->close_requested && RING_EMPTY(&ctx->app_recv_queue))
         {
             /* we should only wake up on this event once.  also, we don't
              * pass the close event down to STCP until we've already passed
@@ -89,10 +96,33 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
         if (rc)
             break;
 
-        if (abstime)
+        if (!waiting)
+        {
+            /* the network and the app only wake us up once we count as
+             * waiting, so look again after that
+             */
+            ++ctx->transport_waiting;
+            ctx->room_waiting = (flags & APP_ROOM) != 0;
+            __sync_synchronize();
+            waiting = TRUE;
+            continue;
+        }
+
+        if (fiber_self())
+        {
+            /* give the fiber's worker to another connection meanwhile */
+            bool_t woken;
+
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+            woken = fiber_park(abstime);
+            PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+            if (!woken)
+                goto done;
+        }
+        else if (abstime)
         {
             /* wait with timeout */
-            switch (pthread_cond_timedwait(&ctx->data_ready_cond,
+            switch (pthread_cond_timedwait(&ctx->transport_cond,
                                            &ctx->data_ready_lock,
                                            abstime))
             {
@@ -115,12 +145,17 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
         else
         {
             /* block indefinitely */
-            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+            PTHREAD_CALL(pthread_cond_wait(&ctx->transport_cond,
                                            &ctx->data_ready_lock));
         }
     }
 
 done:
+    if (waiting)
+    {
+        --ctx->transport_waiting;
+        ctx->room_waiting = FALSE;
+    }
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
     return rc;
@@ -144,6 +179,97 @@ void *stcp_get_context(mysocket_t sd)
     return ctx->stcp_state;
 }
 
+/* returns the value of a mysetsockopt() option for the given mysocket */
+int stcp_get_option(mysocket_t sd, int option)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    assert(option >= 0 && option < MYSO_NUM_OPTIONS);
+    return ctx->options[option];
+}
+
+void stcp_set_option(mysocket_t sd, int option, int value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    assert(option >= 0 && option < MYSO_NUM_OPTIONS);
+    ctx->options[option] = value;
+}
+
+void stcp_set_checksum(mysocket_t sd, stcp_checksum_t checksum)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    assert(checksum != STCP_CHECKSUM_NONE ||
+           _network_is_reliable(&ctx->network_state));
+    ctx->checksum = checksum;
+}
+
+bool_t stcp_network_is_reliable(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _network_is_reliable(&ctx->network_state);
+}
+
+/* the checksum a segment with the given TCP header goes out with: the
+ * connection's, except that a SYN or SYN-ACK is always summed, as the peer
+ * only takes a segment without one once it has agreed to MYSO_FASTPATH.
+ */
+static stcp_checksum_t _stcp_send_checksum(const mysock_context_t *ctx,
+                                           const struct tcphdr    *header)
+{
+    if (ctx->checksum == STCP_CHECKSUM_NONE && (header->th_flags & TH_SYN))
+        return STCP_CHECKSUM_TCP;
+    return ctx->checksum;
+}
+
+/* check the checksum (or CRC32C) of a datagram of len bytes just received,
+ * returning its length without any trailer, or 0 if it is too short or
+ * doesn't check out.  such a segment is dropped, as a real TCP drops one
+ * with a bad checksum, and the peer sends it again as though it were lost.
+ */
+static ssize_t _stcp_check_packet(mysocket_t sd, void *dst, ssize_t len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct tcphdr *header = (struct tcphdr *) dst;
+
+    if (len < (ssize_t) sizeof(struct tcphdr))
+        return 0;
+
+    /* a segment with a CRC32C (MYSO_CRC32C) is passed up without it; one
+     * sent without a checksum (MYSO_FASTPATH) is only taken once this end
+     * has agreed to that too, over a network that doesn't corrupt
+     * anything.  (the SYN and SYN-ACK that agree on it are summed; see
+     * _stcp_send_checksum().)
+     */
+    if (header->th_x2 & TH_X2_NOSUM)
+    {
+        if (ctx->checksum != STCP_CHECKSUM_NONE ||
+            !_network_is_reliable(&ctx->network_state))
+            return 0;
+        header->th_x2 &= ~TH_X2_NOSUM;
+    }
+    else if (header->th_x2 & TH_X2_CRC32C)
+    {
+        if (len < (ssize_t) (sizeof(struct tcphdr) + CRC32C_LEN))
+            return 0;
+        len -= CRC32C_LEN;
+        if (!_mysock_verify_crc32c(ctx, dst, len))
+            return 0;
+        header->th_x2 &= ~TH_X2_CRC32C;
+    }
+    else if (!_mysock_verify_checksum(ctx, dst, len))
+    {
+        return 0;
+    }
+    return len;
+}
+
 /* stcp_network_recv
  *
  * Receive a datagram from the peer.  The call blocks until data is
@@ -153,20 +279,109 @@ void *stcp_get_context(mysocket_t sd)
  * dst      A pointer to a buffer to receive the data.
  * max_len  The size in bytes of the buffer pointed to by dst.
  *
- * This call returns the actual amount of data read into dst.
+ * This call returns the actual amount of data read into dst, or 0 if the
+ * datagram was dropped as corrupt (it should be treated as lost).
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
-    ssize_t len = _network_recv(sd, dst, max_len);
+    return _stcp_check_packet(sd, dst, _network_recv(sd, dst, max_len));
+}
 
-    /* checksum should have been verified by underlying network layer in
-     * this implementation.
-     */
-    assert(len <= 0 ||
-           _mysock_verify_checksum(_mysock_get_context(sd), dst, len));
+/* stcp_network_recv_packet
+ *
+ * As stcp_network_recv(), without copying the datagram: it is left in the
+ * packet it arrived in, which is handed to the caller in *packet, with
+ * *datagram pointing at the datagram.
+ */
+ssize_t stcp_network_recv_packet(mysocket_t sd, stcp_packet_t **packet,
+                                 char **datagram)
+{
+    packet_buf_t *buf = _network_recv_packet_buf(sd);
+    ssize_t len;
+
+    assert(packet && datagram && buf);
+
+    len = _stcp_check_packet(sd, buf->data, buf->data_len);
+    buf->data_len = MAX(len, 0);
+
+    *packet = buf;
+    *datagram = buf->data;
     return len;
 }
 
+/* give up a packet from stcp_network_recv_packet() */
+void stcp_packet_release(stcp_packet_t *packet)
+{
+    _mysock_release_packet(packet);
+}
+
+/* add the buffer/length pairs in argptr (up to a NULL buffer) to the
+ * iovcnt pieces in iov, leaving room for a CRC32C after them.  returns the
+ * new number of pieces.
+ */
+static int _stcp_gather_iov(struct iovec *iov, int iovcnt, va_list argptr)
+{
+    const void *next_buf;
+
+    while ((next_buf = va_arg(argptr, const void *)))
+    {
+        size_t next_len = va_arg(argptr, size_t);
+
+        assert(iovcnt < NETWORK_MAX_IOV - 1);
+        iov[iovcnt].iov_base = (void *) next_buf;
+        iov[iovcnt++].iov_len = next_len;
+    }
+    return iovcnt;
+}
+
+/* fill in the fields of the TCP header at the start of the datagram in
+ * iov that aren't handled by students, and its checksum, or (with
+ * STCP_CHECKSUM_CRC32C) its CRC32C in *crc, which is added to iov as a
+ * trailer.  returns the new number of pieces.
+ */
+static int _stcp_finish_packet(mysocket_t sd, struct iovec *iov, int iovcnt,
+                               uint32_t *crc)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct tcphdr    *header = (struct tcphdr *) iov[0].iov_base;
+    uint32_t          src_addr, dst_addr;
+    stcp_checksum_t   checksum;
+
+    assert(ctx && iov[0].iov_len >= sizeof(*header));
+
+    /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
+    header->th_sport = _network_get_port(&ctx->network_state);
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+    header->th_dport =
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
+    assert(header->th_dport > 0);
+    header->th_sum = 0; /* set below */
+    header->th_urp = 0; /* ignored */
+
+    src_addr = _network_get_local_addr(&ctx->network_state);
+    dst_addr =
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_addr.s_addr;
+
+    checksum = _stcp_send_checksum(ctx, header);
+    if (checksum == STCP_CHECKSUM_CRC32C)
+    {
+        header->th_x2 |= TH_X2_CRC32C;
+        *crc = htonl(_mysock_tcp_crc32c_iov(src_addr, dst_addr, iov, iovcnt));
+        iov[iovcnt].iov_base = crc;
+        iov[iovcnt++].iov_len = CRC32C_LEN;
+    }
+    else if (checksum == STCP_CHECKSUM_NONE)
+    {
+        header->th_x2 |= TH_X2_NOSUM;
+    }
+    else
+    {
+        header->th_sum = _mysock_tcp_checksum_iov(src_addr, dst_addr,
+                                                  iov, iovcnt);
+    }
+    return iovcnt;
+}
+
 /* stcp_network_send()
  *
  * Send data (unreliably) to the peer.
@@ -186,52 +401,123 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
  * operating in unreliable mode, we decide in there whether to drop the
  * datagram or send it later.
  *
+ * The datagram isn't put together here: the TCP header is copied to the
+ * stack to be filled in, and the rest of the pieces are checksummed where
+ * they lie and handed down as they are, for the network layer to gather
+ * in a single write.
+ *
  * Returns the number of bytes transferred on success, or -1 on failure.
  *
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
-    size_t            packet_len;
-    const void       *next_buf;
+    struct tcphdr     header;
+    struct iovec      iov[NETWORK_MAX_IOV];
+    uint32_t          crc;
+    int               iovcnt = 0;
     va_list           argptr;
-    struct tcphdr    *header;
 
-    assert(ctx && src);
+    assert(src && src_len >= sizeof(header));
 
-    assert(src_len <= sizeof(packet));
-    memcpy(packet, src, src_len);
-    packet_len = src_len;
+    memcpy(&header, src, sizeof(header));
+    iov[iovcnt].iov_base = &header;
+    iov[iovcnt++].iov_len = sizeof(header);
+    if (src_len > sizeof(header))
+    {
+        iov[iovcnt].iov_base = (char *) src + sizeof(header);
+        iov[iovcnt++].iov_len = src_len - sizeof(header);
+    }
 
     va_start(argptr, src_len);
-    while ((next_buf = va_arg(argptr, const void *)))
-    {
-        size_t next_len = va_arg(argptr, size_t);
+    iovcnt = _stcp_gather_iov(iov, iovcnt, argptr);
+    va_end(argptr);
 
-        assert(packet_len + next_len <= sizeof(packet));
-        memcpy(packet + packet_len, next_buf, next_len);
-        packet_len += next_len;
-    }
+    iovcnt = _stcp_finish_packet(sd, iov, iovcnt, &crc);
+    return _network_sendv(sd, iov, iovcnt);
+}
+
+/* stcp_network_send_kept()
+ *
+ * As stcp_network_send(), but the first buffer (the TCP header and
+ * anything that goes with it) is copied to kept and filled in there, and
+ * left as it went out for stcp_network_resend().  The rest are only
+ * referred to, as ever.
+ */
+ssize_t stcp_network_send_kept(mysocket_t sd, stcp_kept_t *kept,
+                               const void *src, size_t src_len, ...)
+{
+    struct iovec      iov[NETWORK_MAX_IOV];
+    uint32_t          crc;
+    int               iovcnt;
+    va_list           argptr;
+
+    assert(kept && src);
+    assert(src_len >= sizeof(struct tcphdr) && src_len <= sizeof(kept->head));
+
+    memcpy(kept->head, src, src_len);
+    kept->len = src_len;
+    iov[0].iov_base = kept->head;
+    iov[0].iov_len = src_len;
+
+    va_start(argptr, src_len);
+    iovcnt = _stcp_gather_iov(iov, 1, argptr);
     va_end(argptr);
 
-    /* fill in fields in the TCP header that aren't handled by students */
-    assert(packet_len >= sizeof(struct tcphdr));
-    header = (struct tcphdr *) packet;
+    iovcnt = _stcp_finish_packet(sd, iov, iovcnt, &crc);
+    return _network_sendv(sd, iov, iovcnt);
+}
 
-    header->th_sport = _network_get_port(&ctx->network_state);
-    /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
+/* stcp_network_resend()
+ *
+ * Send a segment from stcp_network_send_kept() again, after the same
+ * buffers as before, with its sequence and acknowledgement numbers (host
+ * byte order) changed to seq and ack.  The checksum is patched for the new
+ * numbers (RFC 1624) rather than computed over the whole datagram again;
+ * a CRC32C is computed again.
+ */
+ssize_t stcp_network_resend(mysocket_t sd, stcp_kept_t *kept,
+                            uint32_t seq, uint32_t ack, ...)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct tcphdr    *header = (struct tcphdr *) kept->head;
+    struct iovec      iov[NETWORK_MAX_IOV];
+    uint32_t          crc;
+    int               iovcnt;
+    va_list           argptr;
 
-    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
-    header->th_dport =
-        ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
-    assert(header->th_dport > 0);
+    assert(ctx && kept->len >= sizeof(struct tcphdr));
 
-    header->th_sum = 0; /* set below */
-    header->th_urp = 0; /* ignored */
+    iov[0].iov_base = kept->head;
+    iov[0].iov_len = kept->len;
+
+    va_start(argptr, ack);
+    iovcnt = _stcp_gather_iov(iov, 1, argptr);
+    va_end(argptr);
+
+    seq = htonl(seq);
+    ack = htonl(ack);
 
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
+    if (!(header->th_x2 & (TH_X2_NOSUM | TH_X2_CRC32C)))
+    {
+        header->th_sum = _mysock_checksum_update32(header->th_sum,
+                                                   header->th_seq, seq);
+        header->th_sum = _mysock_checksum_update32(header->th_sum,
+                                                   header->th_ack, ack);
+    }
+    header->th_seq = seq;
+    header->th_ack = ack;
+
+    if (header->th_x2 & TH_X2_CRC32C)
+    {
+        crc = htonl(_mysock_tcp_crc32c_iov(
+            _network_get_local_addr(&ctx->network_state),
+            ((struct sockaddr_in *) &ctx->network_state.peer_addr)->
+                sin_addr.s_addr,
+            iov, iovcnt));
+        iov[iovcnt].iov_base = &crc;
+        iov[iovcnt++].iov_len = CRC32C_LEN;
+    }
+    return _network_sendv(sd, iov, iovcnt);
 }
 
 /* receive data from the application (sent to us using mywrite()).
@@ -246,28 +532,89 @@ size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
      * passed down to the transport layer.  if it doesn't fit in the specified
      * buffer, any left over is kept for the next call to app_recv().
      */
-    return _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
-                                  dst, max_len, TRUE);
+    return _mysock_ring_read(ctx, &ctx->app_recv_queue, NULL, NULL,
+                             dst, max_len, TRUE);
+}
+
+/* as stcp_app_recv(), also returning the stream the data was written to
+ * and how much of that write is left */
+size_t stcp_app_recv_stream(mysocket_t sd, int *stream, size_t *left,
+                            void *dst, size_t max_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx && stream && left && dst);
+
+    return _mysock_ring_read(ctx, &ctx->app_recv_queue,
+                             stream, left, dst, max_len, TRUE);
 }
 
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
+{
+    stcp_app_send_stream(sd, 0, src, src_len);
+}
+
+/* pass data up for myread_stream() without copying it, if it lies in the
+ * given packet */
+void stcp_app_send_packet(mysocket_t sd, int stream, stcp_packet_t *packet,
+                          const void *src, size_t src_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    const char *data = (const char *) src;
+
+    assert(ctx && src);
+    assert(stream >= 0 && stream < MYSOCK_MAX_STREAMS);
+    if (!packet || (uintptr_t) data < (uintptr_t) packet->data ||
+        (uintptr_t) (data + src_len) >
+            (uintptr_t) (packet->data + packet->data_len))
+    {
+        stcp_app_send_stream(sd, stream, src, src_len);
+    }
+    else if (src_len > 0)
+    {
+        DEBUG_LOG(("stcp_app_send_packet(%d):  passing %u bytes up to app "
+                   "(stream %d)\n", sd, src_len, stream));
+        _mysock_ring_write_packet(ctx, &ctx->app_send_queue[stream], stream,
+                                  packet, data, src_len);
+    }
+}
+
+/* pass data up to the application for consumption by myread_stream() */
+void stcp_app_send_stream(mysocket_t sd, int stream,
+                          const void *src, size_t src_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
     assert(ctx && src);
+    assert(stream >= 0 && stream < MYSOCK_MAX_STREAMS);
     if (src_len > 0)
     {
-        DEBUG_LOG(("stcp_app_send(%d):  sending %u bytes up to app\n",
-                   sd, src_len));
-        _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, src, src_len);
+        DEBUG_LOG(("stcp_app_send(%d):  sending %u bytes up to app "
+                   "(stream %d)\n", sd, src_len, stream));
+        _mysock_ring_write(ctx, &ctx->app_send_queue[stream], stream,
+                           src, src_len, FALSE);
     }
 }
 
+/* room left for data passed up to the application on a stream */
+size_t stcp_app_room(mysocket_t sd, int stream, int writes)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    assert(stream >= 0 && stream < MYSOCK_MAX_STREAMS);
+    ctx->app_reads_seen = ctx->app_reads;
+    __sync_synchronize();
+    return _mysock_ring_up_room(ctx, &ctx->app_send_queue[stream], writes);
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    int k;
+
     assert(ctx);
     DEBUG_LOG(("stcp_fin_received(%d):  setting eof flag\n", sd));
-    _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, NULL, 0);
+    for (k = 0; k < MYSOCK_MAX_STREAMS; ++k)
+        _mysock_ring_write(ctx, &ctx->app_send_queue[k], k, NULL, 0, FALSE);
 }
 
@@ -17,6 +17,7 @@ typedef enum
     APP_DATA            = 1,
     NETWORK_DATA        = 2,
     APP_CLOSE_REQUESTED = 4,
+    APP_ROOM            = 8,    /* the app has read since stcp_app_room() */
     ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED
 } stcp_event_type_t;
 
@@ -71,6 +72,34 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
 void stcp_set_context(mysocket_t sd, const void *stcp_state);
 void *stcp_get_context(mysocket_t my_sd);
 
+/* returns the value the application set for a mysocket option (one of the
+ * MYSO_* constants in mysock.h) with mysetsockopt(), or 0 if it was never
+ * set.
+ */
+int stcp_get_option(mysocket_t sd, int option);
+
+/* changes the value of a mysocket option, e.g. to report what was
+ * negotiated with the peer back to the application.
+ */
+void stcp_set_option(mysocket_t sd, int option, int value);
+
+/* how outgoing segments are protected.  incoming ones are checked with
+ * whatever they carry.
+ */
+typedef enum
+{
+    STCP_CHECKSUM_TCP = 0,  /* the 16-bit TCP checksum (the default) */
+    STCP_CHECKSUM_CRC32C,   /* a CRC32C trailer, once MYSO_CRC32C is agreed */
+    STCP_CHECKSUM_NONE      /* none, if stcp_network_is_reliable() */
+} stcp_checksum_t;
+
+void stcp_set_checksum(mysocket_t sd, stcp_checksum_t checksum);
+
+/* returns TRUE if every datagram sent to the peer arrives, in order and
+ * intact--a reliable mysocket over a network layer that runs on TCP.
+ */
+bool_t stcp_network_is_reliable(mysocket_t sd);
+
 /* Receive a datagram from the peer.
  *
  * sd       Mysocket descriptor.
@@ -81,6 +110,18 @@ void *stcp_get_context(mysocket_t my_sd);
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* a datagram from the peer, in the buffer it was read into */
+typedef struct packet_buf stcp_packet_t;
+
+/* As stcp_network_recv(), but the datagram isn't copied anywhere: *datagram
+ * is set to point at it in *packet, which belongs to the caller until it is
+ * passed to stcp_packet_release().  Parts of it may be passed up to the
+ * application with stcp_app_send_packet() in the meantime.
+ */
+ssize_t stcp_network_recv_packet(mysocket_t sd, stcp_packet_t **packet,
+                                 char **datagram);
+void stcp_packet_release(stcp_packet_t *packet);
+
 /* Send data (unreliably) to the peer.
  *
  * sd           Mysocket descriptor
@@ -98,12 +139,68 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
+/* the first buffer of a segment sent with stcp_network_send_kept() (its
+ * TCP header, up to the largest one there is), as it went out
+ */
+typedef struct
+{
+    char   head[64];
+    size_t len;
+} stcp_kept_t;
+
+/* As stcp_network_send(), but the first buffer is kept in *kept, to send
+ * the segment again with stcp_network_resend().  The rest aren't copied.
+ */
+ssize_t stcp_network_send_kept(mysocket_t sd, stcp_kept_t *kept,
+                               const void *src, size_t src_len, ...);
+
+/* Send a segment kept by stcp_network_send_kept() again, with its sequence
+ * and acknowledgement numbers changed to seq and ack (host byte order),
+ * followed by the same buffer and length pairs as the first time (again
+ * ending with a NULL pointer).  Only the checksum of the changed fields is
+ * redone.
+ */
+ssize_t stcp_network_resend(mysocket_t sd, stcp_kept_t *kept,
+                            uint32_t seq, uint32_t ack, ...);
+
 /* receive data from the application (sent to us using mywrite()) */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
+/* multi-stream versions of the above (see MYSO_STREAMS in mysock.h).
+ * stcp_app_recv_stream() returns data from a single mywrite_stream() (or
+ * mywrite(), for stream 0) call, setting *stream to the stream it was
+ * written to and *left to the number of bytes of that call still queued
+ * (0 once all of it has been returned).  stcp_app_send_stream() passes
+ * data up for myread_stream(); each call makes one message in message
+ * mode (see MYSO_MESSAGES).
+ */
+size_t stcp_app_recv_stream(mysocket_t sd, int *stream, size_t *left,
+                            void *dst, size_t max_len);
+void stcp_app_send_stream(mysocket_t sd, int stream,
+                          const void *src, size_t src_len);
+
+/* as stcp_app_send_stream(), for data in the datagram of a packet from
+ * stcp_network_recv_packet().  it is passed up without being copied; the
+ * application's queue keeps the packet until the data has been read.
+ * data that isn't in the packet (or with a NULL packet) is copied as
+ * stcp_app_send_stream() would.
+ */
+void stcp_app_send_packet(mysocket_t sd, int stream, stcp_packet_t *packet,
+                          const void *src, size_t src_len);
+
+/* the number of bytes that may still be passed up to the application on a
+ * stream, in up to the given number of calls of stcp_app_send_stream() or
+ * stcp_app_send_packet(), before it reads some.  the application's queue
+ * for each stream holds a fixed amount, and no more may be passed up than
+ * this allows.  (there is always room for stcp_fin_received().)  once the
+ * application reads anything after this call, stcp_wait_for_event()
+ * reports APP_ROOM.
+ */
+size_t stcp_app_room(mysocket_t sd, int stream, int writes);
+
 /* once you receive a FIN segment from the peer, we need to let the
  * application know there's no more data arriving (by returning 0 bytes for
  * subsequent myread() calls).  call stcp_fin_received() to indicate the
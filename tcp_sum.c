@@ -2,19 +2,66 @@
 
 #include <stddef.h>
 #include <assert.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
 #include "transport.h"
 #include "tcp_sum.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+
+/* the part of the IP header covered by the checksum */
+typedef struct
+{
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    uint8_t  zero;
+    uint8_t  protocol;
+    uint16_t len;
+} __attribute__ ((packed)) pseudo_header_t;
+
+typedef uint64_t (*sum_func_t)(const void *buf, size_t len);
+typedef uint64_t (*copy_sum_func_t)(void *dst, const void *src, size_t len);
+
+static uint64_t _sum_scalar(const void *buf, size_t len);
+static uint64_t _copy_sum_scalar(void *dst, const void *src, size_t len);
+#ifdef CHECKSUM_X86
+static uint64_t _sum_sse2(const void *buf, size_t len);
+static uint64_t _sum_avx2(const void *buf, size_t len);
+static uint64_t _copy_sum_sse2(void *dst, const void *src, size_t len);
+static uint64_t _copy_sum_avx2(void *dst, const void *src, size_t len);
+#endif
+
+static sum_func_t sum_func;
+static copy_sum_func_t copy_sum_func;
+static pthread_once_t sum_func_once = PTHREAD_ONCE_INIT;
+
+/* CRC32C (Castagnoli), for MYSO_CRC32C */
+#define CRC32C_POLY 0x82f63b78  /* reversed */
+
+typedef uint32_t (*crc_func_t)(uint32_t crc, const void *buf, size_t len);
+
+#ifdef CHECKSUM_X86
+static uint32_t _crc32c_sse42(uint32_t crc, const void *buf, size_t len);
+#endif
+
+static uint32_t crc32c_table[256];
+static crc_func_t crc_func;
+static pthread_once_t crc_func_once = PTHREAD_ONCE_INIT;
+
 
 /* computes checksum for TCP segment, based on description in RFCs 793 and
- * 1071, and Berkeley in_cksum().
+ * 1071, and Berkeley in_cksum().  this adds a 16-bit word at a time, and is
+ * kept as the reference for the faster _mysock_tcp_checksum().
  */
-uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
-                              uint32_t dst_addr /*network byte order*/,
-                              const void *packet,
-                              size_t len /*host byte order*/)
+uint16_t _mysock_tcp_checksum_ref(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const void *packet,
+                                  size_t len /*host byte order*/)
 {
     struct
     {
@@ -66,6 +113,484 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
     return (uint16_t) ~sum;
 }
 
+/* fold a 64-bit ones' complement sum down to 16 bits */
+static uint16_t _fold_sum(uint64_t sum)
+{
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    return (uint16_t) sum;
+}
+
+/* the fastest sum the CPU supports */
+static void _choose_sum_func(void)
+{
+    sum_func = _sum_scalar;
+    copy_sum_func = _copy_sum_scalar;
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        sum_func = _sum_avx2;
+        copy_sum_func = _copy_sum_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        sum_func = _sum_sse2;
+        copy_sum_func = _copy_sum_sse2;
+    }
+#endif
+}
+
+/* sum of the pseudo header for a segment of len bytes */
+static uint64_t _pseudo_header_sum(uint32_t src_addr, uint32_t dst_addr,
+                                   size_t len)
+{
+    pseudo_header_t pseudo_header =
+    {
+        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
+    };
+
+    assert(src_addr > 0);
+    assert(dst_addr > 0);
+    return _sum_scalar(&pseudo_header, sizeof(pseudo_header));
+}
+
+/* computes the same checksum as _mysock_tcp_checksum_ref(), summing
+ * 32-bit words (or vectors of them) into 64-bit accumulators and folding
+ * the carries in once at the end.  rather than skipping th_sum, the sum
+ * covers it and then takes it off again (adding its complement).
+ */
+uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
+                              uint32_t dst_addr /*network byte order*/,
+                              const void *packet,
+                              size_t len /*host byte order*/)
+{
+    uint64_t sum;
+
+    assert(packet && len >= sizeof(struct tcphdr));
+
+    PTHREAD_CALL(pthread_once(&sum_func_once, _choose_sum_func));
+
+    sum = _pseudo_header_sum(src_addr, dst_addr, len);
+    sum += sum_func(packet, len);
+    sum += (uint16_t) ~((const struct tcphdr *) packet)->th_sum;
+
+    return (uint16_t) ~_fold_sum(sum);
+}
+
+/* copy len bytes from src to dst, adding them to the partial sum of a
+ * segment being put together.  offset is where dst lies in the segment;
+ * bytes at an odd offset land in the other half of their words, so the
+ * sum of the piece is byte swapped (RFC 1071).  returns the new partial
+ * sum, which _mysock_tcp_checksum_finish() turns into the checksum.
+ */
+uint16_t _mysock_checksum_copy(void *dst, const void *src, size_t len,
+                               size_t offset, uint16_t sum)
+{
+    uint16_t piece;
+
+    assert(dst && (src || !len));
+
+    PTHREAD_CALL(pthread_once(&sum_func_once, _choose_sum_func));
+
+    piece = _fold_sum(copy_sum_func(dst, src, len));
+    if (offset & 1)
+        piece = (uint16_t) ((piece << 8) | (piece >> 8));
+
+    return _fold_sum((uint64_t) sum + piece);
+}
+
+/* the checksum of a segment gathered from iovcnt pieces, the first of
+ * which holds at least the TCP header.  nothing is copied: each piece is
+ * summed where it lies, byte swapped if it starts at an odd offset, as in
+ * _mysock_checksum_copy().
+ */
+uint16_t _mysock_tcp_checksum_iov(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const struct iovec *iov, int iovcnt)
+{
+    uint64_t sum = 0;
+    size_t len = 0;
+    int k;
+
+    assert(iov && iovcnt > 0 && iov[0].iov_len >= sizeof(struct tcphdr));
+
+    PTHREAD_CALL(pthread_once(&sum_func_once, _choose_sum_func));
+
+    for (k = 0; k < iovcnt; ++k)
+    {
+        uint16_t piece = _fold_sum(sum_func(iov[k].iov_base, iov[k].iov_len));
+
+        if (len & 1)
+            piece = (uint16_t) ((piece << 8) | (piece >> 8));
+        sum += piece;
+        len += iov[k].iov_len;
+    }
+    sum += (uint16_t) ~((const struct tcphdr *) iov[0].iov_base)->th_sum;
+    sum += _pseudo_header_sum(src_addr, dst_addr, len);
+
+    return (uint16_t) ~_fold_sum(sum);
+}
+
+/* the checksum of a len byte segment whose partial sum (with th_sum
+ * taken as zero) is sum */
+uint16_t _mysock_tcp_checksum_finish(uint32_t src_addr /*network byte order*/,
+                                     uint32_t dst_addr /*network byte order*/,
+                                     size_t len /*host byte order*/,
+                                     uint16_t sum)
+{
+    return (uint16_t) ~_fold_sum(_pseudo_header_sum(src_addr, dst_addr, len) +
+                                 sum);
+}
+
+/* incremental update of checksum check after a 16-bit word of the segment
+ * changes from old_word to new_word, following equation 3 of RFC 1624:
+ * HC' = ~(~HC + ~m + m').  both words are as stored in the segment.
+ */
+uint16_t _mysock_checksum_update16(uint16_t check,
+                                   uint16_t old_word, uint16_t new_word)
+{
+    uint64_t sum = (uint16_t) ~check;
+
+    sum += (uint16_t) ~old_word;
+    sum += new_word;
+    return (uint16_t) ~_fold_sum(sum);
+}
+
+/* the same for an aligned 32-bit field, such as th_seq or th_ack */
+uint16_t _mysock_checksum_update32(uint16_t check,
+                                   uint32_t old_word, uint32_t new_word)
+{
+    uint64_t sum = (uint16_t) ~check;
+
+    sum += (uint16_t) ~old_word + (uint16_t) ~(old_word >> 16);
+    sum += (uint16_t) new_word + (uint16_t) (new_word >> 16);
+    return (uint16_t) ~_fold_sum(sum);
+}
+
+/* make _mysock_tcp_checksum() use the given sum (for benchmarks).  returns
+ * -1 if the CPU doesn't support it.
+ */
+int _mysock_checksum_use(int kind)
+{
+    PTHREAD_CALL(pthread_once(&sum_func_once, _choose_sum_func));
+
+    switch (kind)
+    {
+    case CHECKSUM_SCALAR:
+        sum_func = _sum_scalar;
+        copy_sum_func = _copy_sum_scalar;
+        return 0;
+
+#ifdef CHECKSUM_X86
+    case CHECKSUM_SSE2:
+        if (!__builtin_cpu_supports("sse2"))
+            return -1;
+        sum_func = _sum_sse2;
+        copy_sum_func = _copy_sum_sse2;
+        return 0;
+
+    case CHECKSUM_AVX2:
+        if (!__builtin_cpu_supports("avx2"))
+            return -1;
+        sum_func = _sum_avx2;
+        copy_sum_func = _copy_sum_avx2;
+        return 0;
+#endif
+
+    default:
+        return -1;
+    }
+}
+
+/* ones' complement sum of 32-bit words in a 64-bit accumulator; the tail is
+ * taken as 16-bit words, an odd byte padded with zero (RFC 1071).
+ */
+static uint64_t _sum_scalar(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    uint64_t sum0 = 0, sum1 = 0;
+    uint32_t w0, w1;
+    uint16_t tmp;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        memcpy(&w0, p, sizeof(w0));
+        memcpy(&w1, p + 4, sizeof(w1));
+        sum0 += w0;
+        sum1 += w1;
+    }
+    if (len >= 4)
+    {
+        memcpy(&w0, p, sizeof(w0));
+        sum0 += w0;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2)
+    {
+        memcpy(&tmp, p, sizeof(tmp));
+        sum0 += tmp;
+        p += 2;
+        len -= 2;
+    }
+    if (len)
+    {
+        tmp = 0;
+        *(uint8_t *) &tmp = *p;
+        sum0 += tmp;
+    }
+
+    return sum0 + sum1;
+}
+
+/* _sum_scalar(), storing each word to dst as it is summed */
+static uint64_t _copy_sum_scalar(void *dst, const void *src, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) src;
+    uint8_t *q = (uint8_t *) dst;
+    uint64_t sum0 = 0, sum1 = 0;
+    uint32_t w0, w1;
+
+    for (; len >= 8; len -= 8, p += 8, q += 8)
+    {
+        memcpy(&w0, p, sizeof(w0));
+        memcpy(&w1, p + 4, sizeof(w1));
+        memcpy(q, &w0, sizeof(w0));
+        memcpy(q + 4, &w1, sizeof(w1));
+        sum0 += w0;
+        sum1 += w1;
+    }
+
+    memcpy(q, p, len);
+    return sum0 + sum1 + _sum_scalar(q, len);
+}
+
+#ifdef CHECKSUM_X86
+/* the same with SSE2: each 128-bit load is widened into two pairs of 64-bit
+ * lanes */
+__attribute__ ((target("sse2")))
+static uint64_t _sum_sse2(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero, v;
+    uint64_t lanes[2];
+
+    for (; len >= 16; len -= 16, p += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *) p);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return lanes[0] + lanes[1] + _sum_scalar(p, len);
+}
+
+__attribute__ ((target("sse2")))
+static uint64_t _copy_sum_sse2(void *dst, const void *src, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) src;
+    uint8_t *q = (uint8_t *) dst;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero, v;
+    uint64_t lanes[2];
+
+    for (; len >= 16; len -= 16, p += 16, q += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *) p);
+        _mm_storeu_si128((__m128i *) q, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    return lanes[0] + lanes[1] + _copy_sum_scalar(q, p, len);
+}
+
+/* and with AVX2, 256 bits at a time */
+__attribute__ ((target("avx2")))
+static uint64_t _sum_avx2(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, v;
+    uint64_t lanes[4];
+
+    for (; len >= 32; len -= 32, p += 32)
+    {
+        v = _mm256_loadu_si256((const __m256i *) p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + _sum_sse2(p, len);
+}
+
+__attribute__ ((target("avx2")))
+static uint64_t _copy_sum_avx2(void *dst, const void *src, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) src;
+    uint8_t *q = (uint8_t *) dst;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero, v;
+    uint64_t lanes[4];
+
+    for (; len >= 32; len -= 32, p += 32, q += 32)
+    {
+        v = _mm256_loadu_si256((const __m256i *) p);
+        _mm256_storeu_si256((__m256i *) q, v);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           _copy_sum_sse2(q, p, len);
+}
+#endif  /*CHECKSUM_X86*/
+
+/* build the CRC32C lookup table, and pick the instruction if there is one */
+static void _choose_crc_func(void)
+{
+    uint32_t crc;
+    int k, bit;
+
+    for (k = 0; k < 256; ++k)
+    {
+        crc = k;
+        for (bit = 0; bit < 8; ++bit)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[k] = crc;
+    }
+
+    crc_func = _mysock_crc32c_ref;
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc_func = _crc32c_sse42;
+#endif
+}
+
+/* CRC32C of len bytes, continuing from crc (0 to start), a byte at a time
+ * from a table.  this is the fallback where the CPU has no crc32
+ * instruction.
+ */
+uint32_t _mysock_crc32c_ref(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+
+    PTHREAD_CALL(pthread_once(&crc_func_once, _choose_crc_func));
+
+    crc = ~crc;
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* the same, with SSE4.2 if the CPU has it */
+uint32_t _mysock_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    PTHREAD_CALL(pthread_once(&crc_func_once, _choose_crc_func));
+    return crc_func(crc, buf, len);
+}
+
+#ifdef CHECKSUM_X86
+__attribute__ ((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+#ifdef __x86_64__
+    uint64_t crc64 = (uint32_t) ~crc, w64;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        memcpy(&w64, p, sizeof(w64));
+        crc64 = _mm_crc32_u64(crc64, w64);
+    }
+    crc = (uint32_t) crc64;
+#else
+    crc = ~crc;
+#endif
+    {
+        uint32_t w32;
+
+        for (; len >= 4; len -= 4, p += 4)
+        {
+            memcpy(&w32, p, sizeof(w32));
+            crc = _mm_crc32_u32(crc, w32);
+        }
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return ~crc;
+}
+#endif  /*CHECKSUM_X86*/
+
+/* CRC32C of a TCP segment and its pseudo header, used in place of the
+ * checksum when both ends agree to MYSO_CRC32C.  th_sum is left out.
+ */
+uint32_t _mysock_tcp_crc32c(uint32_t src_addr /*network byte order*/,
+                            uint32_t dst_addr /*network byte order*/,
+                            const void *packet,
+                            size_t len /*host byte order*/)
+{
+    pseudo_header_t pseudo_header =
+    {
+        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
+    };
+
+    const uint8_t *p = (const uint8_t *) packet;
+    size_t sum_offset = offsetof(struct tcphdr, th_sum);
+    uint32_t crc;
+
+    assert(packet && len >= sizeof(struct tcphdr));
+    assert(src_addr > 0);
+    assert(dst_addr > 0);
+
+    crc = _mysock_crc32c(0, &pseudo_header, sizeof(pseudo_header));
+    crc = _mysock_crc32c(crc, p, sum_offset);
+    return _mysock_crc32c(crc, p + sum_offset + sizeof(uint16_t),
+                          len - sum_offset - sizeof(uint16_t));
+}
+
+/* the same for a segment gathered from iovcnt pieces, the first of which
+ * holds at least the TCP header */
+uint32_t _mysock_tcp_crc32c_iov(uint32_t src_addr /*network byte order*/,
+                                uint32_t dst_addr /*network byte order*/,
+                                const struct iovec *iov, int iovcnt)
+{
+    pseudo_header_t pseudo_header = { src_addr, dst_addr, 0, IPPROTO_TCP, 0 };
+    const uint8_t *p;
+    size_t len = 0, sum_offset = offsetof(struct tcphdr, th_sum);
+    uint32_t crc;
+    int k;
+
+    assert(iov && iovcnt > 0 && iov[0].iov_len >= sizeof(struct tcphdr));
+    assert(src_addr > 0);
+    assert(dst_addr > 0);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    pseudo_header.len = htons(len);
+
+    p = (const uint8_t *) iov[0].iov_base;
+    crc = _mysock_crc32c(0, &pseudo_header, sizeof(pseudo_header));
+    crc = _mysock_crc32c(crc, p, sum_offset);
+    crc = _mysock_crc32c(crc, p + sum_offset + sizeof(uint16_t),
+                         iov[0].iov_len - sum_offset - sizeof(uint16_t));
+    for (k = 1; k < iovcnt; ++k)
+        crc = _mysock_crc32c(crc, iov[k].iov_base, iov[k].iov_len);
+
+    return crc;
+}
+
 /* update checksum in the given STCP segment */
 void _mysock_set_checksum(const mysock_context_t *ctx,
                           void *packet, size_t len)
@@ -104,3 +629,47 @@ bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
     return my_sum == ((struct tcphdr *) packet)->th_sum;
 }
 
+/* append the CRC32C of the given STCP segment (of len bytes) to it, and
+ * flag it in th_x2.  the buffer must have room for CRC32C_LEN more bytes.
+ */
+void _mysock_set_crc32c(const mysock_context_t *ctx,
+                        void *packet, size_t len)
+{
+    uint32_t crc;
+
+    assert(ctx && packet);
+    assert(len >= sizeof(struct tcphdr));
+
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+
+    ((struct tcphdr *) packet)->th_x2 |= TH_X2_CRC32C;
+    crc = htonl(_mysock_tcp_crc32c(
+        _network_get_local_addr((network_context_t *)
+                                &ctx->network_state), /*src*/
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
+            sin_addr.s_addr,
+        packet, len));
+    memcpy((char *) packet + len, &crc, CRC32C_LEN);
+}
+
+/* returns TRUE if the CRC32C following a segment of len bytes is correct,
+ * FALSE otherwise */
+bool_t _mysock_verify_crc32c(const mysock_context_t *ctx,
+                             const void *packet, size_t len)
+{
+    uint32_t crc;
+
+    assert(ctx && packet);
+    assert(len >= sizeof(struct tcphdr));
+
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+
+    crc = htonl(_mysock_tcp_crc32c(
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*src*/
+            sin_addr.s_addr,
+        _network_get_local_addr((network_context_t *)
+                                &ctx->network_state), /*dst*/
+        packet, len));
+
+    return memcmp((const char *) packet + len, &crc, CRC32C_LEN) == 0;
+}
@@ -3,6 +3,7 @@
 #ifndef __TCP_CHECKSUM_H__
 #define __TCP_CHECKSUM_H__
 
+#include <sys/uio.h>
 #include "mysock.h"
 
 struct mysock_context;
@@ -12,11 +13,77 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/);
 
+/* word at a time version of _mysock_tcp_checksum(), for reference */
+uint16_t _mysock_tcp_checksum_ref(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const void *packet,
+                                  size_t len /*host byte order*/);
+
+/* ways of summing the segment; by default _mysock_tcp_checksum() uses the
+ * fastest one the CPU supports.  _mysock_checksum_use() picks one (for
+ * benchmarks), returning -1 if the CPU doesn't support it.
+ */
+enum { CHECKSUM_SCALAR, CHECKSUM_SSE2, CHECKSUM_AVX2, CHECKSUM_NUM_KINDS };
+
+int _mysock_checksum_use(int kind);
+
+/* checksumming a segment as it is put together (see tcp_sum.c) */
+uint16_t _mysock_checksum_copy(void *dst, const void *src, size_t len,
+                               size_t offset, uint16_t sum);
+uint16_t _mysock_tcp_checksum_finish(uint32_t src_addr /*network byte order*/,
+                                     uint32_t dst_addr /*network byte order*/,
+                                     size_t len /*host byte order*/,
+                                     uint16_t sum);
+
+/* checksumming a segment gathered from pieces, the first holding at
+ * least the header, without copying it */
+uint16_t _mysock_tcp_checksum_iov(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const struct iovec *iov, int iovcnt);
+
+/* patching the checksum when a field changes (RFC 1624) */
+uint16_t _mysock_checksum_update16(uint16_t check,
+                                   uint16_t old_word, uint16_t new_word);
+uint16_t _mysock_checksum_update32(uint16_t check,
+                                   uint32_t old_word, uint32_t new_word);
+
+/* CRC32C (Castagnoli), continuing from crc (0 to start).  the first uses
+ * the SSE4.2 crc32 instruction if the CPU has it, the second a table.
+ */
+uint32_t _mysock_crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t _mysock_crc32c_ref(uint32_t crc, const void *buf, size_t len);
+
+/* CRC32C of a segment (without th_sum) and its pseudo header */
+uint32_t _mysock_tcp_crc32c(uint32_t src_addr /*network byte order*/,
+                            uint32_t dst_addr /*network byte order*/,
+                            const void *packet,
+                            size_t len /*host byte order*/);
+
+/* the same, gathered from pieces as for _mysock_tcp_checksum_iov() */
+uint32_t _mysock_tcp_crc32c_iov(uint32_t src_addr /*network byte order*/,
+                                uint32_t dst_addr /*network byte order*/,
+                                const struct iovec *iov, int iovcnt);
+
+/* with MYSO_CRC32C, a segment is followed by its CRC32C (network byte
+ * order), and flagged with this bit in th_x2; th_sum is then 0.
+ */
+#define TH_X2_CRC32C 0x1
+#define CRC32C_LEN 4
+
+/* th_x2 flag for a segment sent without a checksum (MYSO_FASTPATH) */
+#define TH_X2_NOSUM 0x2
+
 void _mysock_set_checksum(const struct mysock_context *ctx,
                           void *packet, size_t len);
 
 bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
                                const void *packet, size_t len);
 
+void _mysock_set_crc32c(const struct mysock_context *ctx,
+                        void *packet, size_t len);
+
+bool_t _mysock_verify_crc32c(const mysock_context_t *ctx,
+                             const void *packet, size_t len);
+
 #endif  /* __TCP_CHECKSUM_H__ */
 
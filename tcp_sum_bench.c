@@ -0,0 +1,270 @@
+/* tcp_sum_bench.c--checks the checksum kernels against the reference
+ * implementation, then reports how fast each one is for MSS and MTU sized
+ * segments, next to CRC32C (MYSO_CRC32C) with and without SSE4.2.
+ *
+ * usage: tcp_sum_bench [-n iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "mysock_impl.h"
+#include "transport.h"
+#include "tcp_sum.h"
+
+
+#define SRC_ADDR 0x0100007f     /* 127.0.0.1 in network byte order */
+#define DST_ADDR 0x0200007f
+#define NUM_CHECKS 10000
+
+typedef uint16_t (*checksum_func_t)(uint32_t, uint32_t, const void *, size_t);
+
+static const char *kind_names[CHECKSUM_NUM_KINDS] = { "scalar", "sse2", "avx2" };
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* compare the current kernel with the reference over random segments of
+ * every length (and both alignments of the tail).  each segment is also
+ * summed in three pieces with _mysock_tcp_checksum_iov(), copied in two
+ * with _mysock_checksum_copy(), and has its th_ack patched with
+ * _mysock_checksum_update32().  returns the number of mismatches.
+ */
+static int check(char *buf, size_t max_len)
+{
+    static uint16_t copy[MAX_IP_PAYLOAD_LEN / 2];
+    struct tcphdr *header = (struct tcphdr *) copy;
+    int k, errors = 0;
+    size_t len;
+
+    for (k = 0; k < NUM_CHECKS; ++k)
+    {
+        struct iovec iov[3];
+        size_t i, split;
+        uint16_t sum;
+        uint32_t ack;
+
+        len = sizeof(struct tcphdr) + rand() % (max_len - sizeof(struct tcphdr));
+        for (i = 0; i < len; ++i)
+            buf[i] = rand();
+
+        if (_mysock_tcp_checksum(SRC_ADDR, DST_ADDR, buf, len) !=
+            _mysock_tcp_checksum_ref(SRC_ADDR, DST_ADDR, buf, len))
+        {
+            fprintf(stderr, "mismatch for %u byte segment\n", (unsigned) len);
+            ++errors;
+        }
+
+        split = sizeof(struct tcphdr) +
+                rand() % (len - sizeof(struct tcphdr) + 1);
+        iov[0].iov_base = buf;
+        iov[0].iov_len = sizeof(struct tcphdr);
+        iov[1].iov_base = buf + iov[0].iov_len;
+        iov[1].iov_len = split - iov[0].iov_len;
+        iov[2].iov_base = buf + split;
+        iov[2].iov_len = len - split;
+        if (_mysock_tcp_checksum_iov(SRC_ADDR, DST_ADDR, iov, 3) !=
+            _mysock_tcp_checksum_ref(SRC_ADDR, DST_ADDR, buf, len))
+        {
+            fprintf(stderr, "iov mismatch for %u byte segment split at %u\n",
+                    (unsigned) len, (unsigned) split);
+            ++errors;
+        }
+
+        ((struct tcphdr *) buf)->th_sum = 0;
+        split = rand() % len;
+        sum = _mysock_checksum_copy(copy, buf, split, 0, 0);
+        sum = _mysock_checksum_copy((char *) copy + split, buf + split,
+                                    len - split, split, sum);
+        if (memcmp(copy, buf, len) != 0)
+        {
+            fprintf(stderr, "bad copy of %u byte segment\n", (unsigned) len);
+            ++errors;
+        }
+
+        header->th_sum = _mysock_tcp_checksum_finish(SRC_ADDR, DST_ADDR,
+                                                     len, sum);
+        if (header->th_sum !=
+            _mysock_tcp_checksum_ref(SRC_ADDR, DST_ADDR, copy, len))
+        {
+            fprintf(stderr, "copy mismatch for %u byte segment split at %u\n",
+                    (unsigned) len, (unsigned) split);
+            ++errors;
+        }
+
+        ack = rand();
+        header->th_sum = _mysock_checksum_update32(header->th_sum,
+                                                   header->th_ack, ack);
+        header->th_ack = ack;
+        if (header->th_sum !=
+            _mysock_tcp_checksum_ref(SRC_ADDR, DST_ADDR, copy, len))
+        {
+            fprintf(stderr, "update mismatch for %u byte segment\n",
+                    (unsigned) len);
+            ++errors;
+        }
+    }
+
+    return errors;
+}
+
+/* CRC32C against the reference, and the check value for "123456789" */
+static int check_crc32c(char *buf, size_t max_len)
+{
+    int k, errors = 0;
+    size_t len, i;
+
+    if (_mysock_crc32c(0, "123456789", 9) != 0xe3069283 ||
+        _mysock_crc32c_ref(0, "123456789", 9) != 0xe3069283)
+    {
+        fprintf(stderr, "wrong CRC32C check value\n");
+        ++errors;
+    }
+
+    for (k = 0; k < NUM_CHECKS; ++k)
+    {
+        len = rand() % max_len;
+        for (i = 0; i < len; ++i)
+            buf[i] = rand();
+
+        if (_mysock_crc32c(0, buf, len) != _mysock_crc32c_ref(0, buf, len))
+        {
+            fprintf(stderr, "CRC32C mismatch for %u bytes\n", (unsigned) len);
+            ++errors;
+        }
+
+        if (len >= sizeof(struct tcphdr))
+        {
+            struct iovec iov[2];
+            size_t split = sizeof(struct tcphdr) +
+                           rand() % (len - sizeof(struct tcphdr) + 1);
+
+            iov[0].iov_base = buf;
+            iov[0].iov_len = split;
+            iov[1].iov_base = buf + split;
+            iov[1].iov_len = len - split;
+            if (_mysock_tcp_crc32c_iov(SRC_ADDR, DST_ADDR, iov, 2) !=
+                _mysock_tcp_crc32c(SRC_ADDR, DST_ADDR, buf, len))
+            {
+                fprintf(stderr, "CRC32C iov mismatch for %u bytes\n",
+                        (unsigned) len);
+                ++errors;
+            }
+        }
+    }
+
+    return errors;
+}
+
+/* the CRC32C functions, shaped for measure() */
+static uint16_t crc32c(uint32_t src_addr, uint32_t dst_addr,
+                       const void *buf, size_t len)
+{
+    return _mysock_crc32c(0, buf, len);
+}
+
+static uint16_t crc32c_ref(uint32_t src_addr, uint32_t dst_addr,
+                           const void *buf, size_t len)
+{
+    return _mysock_crc32c_ref(0, buf, len);
+}
+
+/* GB/s for checksumming a len byte segment */
+static double measure(checksum_func_t checksum,
+                      char *buf, size_t len, long iterations)
+{
+    volatile uint16_t sum;
+    double start;
+    long k;
+
+    start = now();
+    for (k = 0; k < iterations; ++k)
+    {
+        buf[0] = k;     /* keep the compiler from hoisting the call */
+        sum = checksum(SRC_ADDR, DST_ADDR, buf, len);
+    }
+    (void) sum;
+
+    return (double) len * iterations / (now() - start) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t sizes[] = { STCP_MSS, MAX_IP_PAYLOAD_LEN };
+    static uint16_t buf[MAX_IP_PAYLOAD_LEN / 2];
+    long iterations = 1000000;
+    int opt, kind, errors = 0;
+    unsigned int k;
+
+    while ((opt = getopt(argc, argv, "n:")) != EOF)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    srand(1);
+    printf("%-8s", "kernel");
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k)
+        printf("  %4u bytes", (unsigned) sizes[k]);
+    printf("\n");
+
+    for (kind = 0; kind < CHECKSUM_NUM_KINDS; ++kind)
+    {
+        if (_mysock_checksum_use(kind) < 0)
+        {
+            printf("%-8s  (not supported)\n", kind_names[kind]);
+            continue;
+        }
+
+        errors += check((char *) buf, sizeof(buf));
+
+        printf("%-8s", kind_names[kind]);
+        for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k)
+            printf("  %5.2f GB/s",
+                   measure(_mysock_tcp_checksum,
+                           (char *) buf, sizes[k], iterations));
+        printf("\n");
+    }
+
+    /* the word at a time reference, for comparison */
+    printf("%-8s", "ref");
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k)
+        printf("  %5.2f GB/s",
+               measure(_mysock_tcp_checksum_ref,
+                       (char *) buf, sizes[k], iterations));
+    printf("\n");
+
+    errors += check_crc32c((char *) buf, sizeof(buf));
+
+    printf("%-8s", "crc32c");
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k)
+        printf("  %5.2f GB/s",
+               measure(crc32c, (char *) buf, sizes[k], iterations));
+    printf("\n");
+
+    printf("%-8s", "crc-sw");
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k)
+        printf("  %5.2f GB/s",
+               measure(crc32c_ref, (char *) buf, sizes[k], iterations));
+    printf("\n");
+
+    if (errors)
+        fprintf(stderr, "%d mismatches\n", errors);
+    return errors ? 1 : 0;
+}
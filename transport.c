@@ -25,31 +25,73 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include "mysock.h"
 #include "stcp_api.h"
 #include "transport.h"
+#include "lz.h"
+#include "pool.h"
 
 #define WINDOWS_SIZE 3072 /* receiver window size */
+#define FASTPATH_WINDOW (16 * WINDOWS_SIZE) /* send window on the fast path */
 #define FULLOPTION 44  /* TCP Header : 20byte -> 64byte (full option) */
 
 #define SEC 1000000000 /* You need some nanosecond calculation */
 #define MSEC 1000000   
 #define USEC 1000
 
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_FASTOPEN 34  /* TCP Fast Open cookie (RFC 7413) */
+#define TFO_COOKIE_LEN 8
+#define TCPOPT_STCP 253     /* experimental kind (RFC 4727): features */
+#define TCPOPT_SKIP 254     /* experimental kind: forward skip segment */
+#define TCPOPT_PARITY 252   /* private kind: FEC parity segment */
+
+/* STCP features agreed in the handshake (flags in TCPOPT_STCP) */
+#define FEATURE_MESSAGES 0x01   /* MYSO_MESSAGES */
+#define FEATURE_PARTIAL 0x02    /* forward skips (MYSO_LIFETIME) */
+#define FEATURE_FEC 0x04        /* MYSO_FEC */
+#define FEATURE_COMPRESS 0x08   /* MYSO_COMPRESS */
+#define FEATURE_CRC32C 0x10     /* MYSO_CRC32C */
+#define FEATURE_FASTPATH 0x20   /* MYSO_FASTPATH */
+
+/* forward error correction: one XOR parity segment per group of data
+ * segments, the group size following the loss rate */
+#define FEC_MIN_GROUP 2
+#define FEC_INIT_GROUP 4
+#define FEC_MAX_GROUP 16
+#define FEC_PERIOD 64       /* segments sent per loss rate estimate */
+#define FEC_HISTORY 16      /* segments the receiver keeps for rebuilds */
+
+#define PEER_CACHE_SIZE 16  /* peers remembered across connections */
+
+
+/* SYN and SYN-ACK retransmission */
+#define CONNECT_TIMEOUT_MS 7000   /* default for MYSO_CONNECT_TIMEOUT */
+#define SYN_RTO_MS 1000           /* initial RTO for an unknown peer */
+#define SYN_MIN_RTO_MS 200        /* bounds for an RTO from a cached RTT */
+#define SYN_MAX_RTO_MS 8000
+
 enum { CSTATE_ESTABLISHED, CSTATE_CLOSED, CSTATE_LISTEN, CSTATE_SYN_SENT,\
        CSTATE_SYN_RCVD, CSTATE_FIN_WAIT_1, CSTATE_FIN_WAIT_2, \
        CSTATE_CLOSE_WAIT, CSTATE_LAST_ACK, CSTATE_CLOSING};    /* obviously you should have more states */
 
-typedef enum { NORMAL, SYN, SYNACK, ACK, FIN } packet_type;
+/* (LOST is a segment the network layer dropped as corrupt; MSG_START is a
+ * data segment that starts a message, sent with TH_PUSH in message mode so
+ * that whole messages can be picked out beyond a hole, see receive_skip) */
+typedef enum { NORMAL, SYN, SYNACK, ACK, FIN, LOST, MSG_START } packet_type;
 
 /* for buffer, save the some data out of order  */ 
 typedef struct save_packet save_packet;
 typedef struct save_packet
 {
-  int start;
-  int end;
+  tcp_seq start;
+  tcp_seq end;
   char data[STCP_MSS];
+  int msg_start;            /* starts a message (MSG_START) */
 
   save_packet *next;
 } save_packet;
@@ -61,10 +103,38 @@ typedef struct preack_packet
   tcp_seq sequence_num;
   int size;
   char data[STCP_MSS];
+  struct timeval deadline;  /* given up on after this (0: never) */
+  int msg_start;            /* starts a message (or is plain data) */
+  /* its header as first sent, for resending (sent.len 0 until then) */
+  stcp_kept_t sent;
   
   preack_packet *next;
 } preack_packet;
 
+/* segments kept around and timers come from pools rather than the heap */
+static pool_t save_pool = POOL_INITIALIZER ("save", sizeof (save_packet));
+static pool_t preack_pool = POOL_INITIALIZER ("preack", sizeof (preack_packet));
+static pool_t timer_pool = POOL_INITIALIZER ("timer", sizeof (struct timespec));
+
+/* every segment is padded out to STCP_MSS bytes of data with this */
+static const char padding[STCP_MSS];
+
+/* a message being put back together (message mode) */
+typedef struct
+{
+  char hdr[4];            /* length header */
+  int hdr_got;
+  char *buf;
+  uint32_t len;
+  uint32_t got;
+} msg_assembly;
+
+#define MSG_HDR_LEN 4
+
+/* compressed data is sent as blocks, each with this header: the length of
+ * the data and of the block (the same if it is stored uncompressed) */
+#define BLOCK_HDR_LEN 4
+
 /* this structure is global to a mysocket descriptor */
 typedef struct
 {
@@ -78,12 +148,64 @@ typedef struct
     int ERTT_ms;                  /* estimate RTT (millisecond) */
     int ERTT_s;                   /* estimate RTT (second) */
 
-    int iserror;                  /* error detecting when connection */
+    int iserror;                  /* errno to report for a failed connection */
+    int timeouts;                 /* consecutive data timeouts */
+    int peer_full;                /* the peer's last ACK had no window */
 
     save_packet *save;            /* linked list for buffer */
+    int rcv_full;                 /* data turned away for want of room in
+                                   * the app's queue (see rcv_window) */
     preack_packet *preack;        /* linked list for retransmission */
+    stcp_packet_t *rx_packet;     /* segment being handled, whose data is
+                                   * passed up without copying it */
 
     struct timespec *timer;       /* for timeout    */
+
+    /* last pure ACK, resent with new numbers (ack_sent.len 0 until then) */
+    stcp_kept_t ack_sent;
+    int ack_sent_win;             /* ...and the window it advertises */
+
+    char cookie[TFO_COOKIE_LEN];  /* TFO cookie (cached, or issued to peer) */
+    int cookie_len;               /* -1 if no TFO option on our SYN(ACK) */
+    int syn_data_size;            /* app data carried in our SYN */
+    int tfo_accepted;             /* passive side took data from the SYN */
+    int close_pending;            /* myclose() seen, FIN not sent yet */
+
+    int features;                 /* FEATURE_* flags */
+    int fast_path;                /* FEATURE_FASTPATH agreed */
+    tcp_seq snd_una;              /* fast path: oldest unacked sequence num */
+    int num_streams;              /* 0 for a plain byte stream */
+    uint32_t stream_snd_next[MYSOCK_MAX_STREAMS]; /* next offset to send */
+    uint32_t stream_rcv_next[MYSOCK_MAX_STREAMS]; /* next offset to deliver */
+    int msg_open;                 /* app message partly sent */
+    msg_assembly msg_in[MYSOCK_MAX_STREAMS];  /* messages being received */
+
+    struct timeval msg_deadline;  /* deadline of the message being sent */
+    tcp_seq skip_seq;             /* forward skip not acked yet, or 0 */
+    uint32_t skip_offset[MYSOCK_MAX_STREAMS]; /* stream offsets at skip_seq */
+
+    int fec_group;                /* data segments per parity segment */
+    int fec_count;                /* data segments in the current group */
+    tcp_seq fec_start;            /* first sequence number of the group */
+    int fec_len;                  /* longest segment in the group */
+    char fec_parity[STCP_MSS];    /* XOR of the group's segments */
+    int fec_sent;                 /* segments sent this FEC_PERIOD */
+    int fec_losses;               /* losses seen (dup ACKs) this period */
+    tcp_seq fec_dup_ack;          /* last ack number counted as a loss */
+    save_packet *fec_history;     /* latest segments received, newest first */
+
+    lz_stream_t lz_out[MYSOCK_MAX_STREAMS];   /* compression histories */
+    lz_stream_t lz_in[MYSOCK_MAX_STREAMS];
+    char block[BLOCK_HDR_LEN + LZ_MAX_BLOCK]; /* compressed block to send */
+    int block_len;
+    int block_sent;               /* bytes of block already in segments */
+    int block_stream;
+    msg_assembly block_in[MYSOCK_MAX_STREAMS];  /* blocks being received */
+
+    int syn_rto_ms;               /* current SYN(ACK) retransmission timeout */
+    int syn_retransmits;          /* SYN(ACK)s resent so far */
+    struct timeval syn_time;      /* when our SYN(ACK) was first sent */
+    struct timeval connect_deadline;  /* handshake fails after this */
     /* any other connection-wide global variables go here */
 } context_t;
 
@@ -95,15 +217,131 @@ typedef struct
   char data[STCP_MSS];    /* data */
 } STCPPacket;
 
+/* with several streams, each data segment starts with this header */
+typedef struct
+{
+  uint16_t stream;        /* stream number */
+  uint16_t flags;         /* unused, 0 */
+  uint32_t offset;        /* stream offset of the first data byte */
+} stream_header;
+
+#define STREAM_HDR_LEN ((int) sizeof (stream_header))
+
+/* per-peer state remembered across connections */
+typedef struct
+{
+  uint32_t addr;                /* peer IP (network byte order), 0 if free */
+  int cookie_len;
+  char cookie[TFO_COOKIE_LEN];  /* TFO cookie the peer issued us */
+  long rtt_us;                  /* smoothed handshake RTT, 0 if unknown */
+} peer_cache_entry;
+
+static peer_cache_entry peer_cache[PEER_CACHE_SIZE];
+static pthread_mutex_t peer_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* key for the TFO cookies we issue as a server, read from /dev/urandom;
+ * without one, we issue none */
+static uint64_t tfo_secret[2];
+static int tfo_have_secret;
+static pthread_once_t tfo_secret_once = PTHREAD_ONCE_INIT;
+
 static void generate_initial_seq_num(context_t *ctx);
 static void control_loop(mysocket_t sd, context_t *ctx);
 void our_dprintf(const char *format,...);
 int send_packet (mysocket_t sd, tcp_seq seq_num, tcp_seq ack_num, \
                  packet_type type, char *data, int size);
+int send_packet_opt (mysocket_t sd, tcp_seq seq_num, tcp_seq ack_num, \
+                     packet_type type, const char *opt, int opt_len, \
+                     char *data, int size);
+static int send_packet_kept (mysocket_t sd, tcp_seq seq_num, \
+                             tcp_seq ack_num, packet_type type, \
+                             const char *opt, int opt_len, \
+                             char *data, int size, int window, \
+                             stcp_kept_t *kept);
+static int rcv_window (mysocket_t sd, context_t *ctx);
+static void send_ack (mysocket_t sd, context_t *ctx);
+static int send_fast (mysocket_t sd, context_t *ctx, int max_len);
+static void send_preack (mysocket_t sd, context_t *ctx, \
+                         preack_packet *preack);
 int rcvd_packet (mysocket_t sd, tcp_seq *seq_num, tcp_seq *ack_num, \
                  packet_type *type, char *data, int *data_size);
+static stcp_packet_t *rcvd_segment (mysocket_t sd, int *size, \
+                                    tcp_seq *seq_num, tcp_seq *ack_num, \
+                                    packet_type *type, char **data, \
+                                    int *data_size, char *opt, int *opt_len, \
+                                    int *window);
+int rcvd_packet_opt (mysocket_t sd, tcp_seq *seq_num, tcp_seq *ack_num, \
+                     packet_type *type, char *data, int *data_size, \
+                     char *opt, int *opt_len, int *window);
 void cal_timer (mysocket_t sd, context_t *ctx);
 void set_timer (mysocket_t sd, context_t *ctx);
+static void process_ack (mysocket_t sd, context_t *ctx, tcp_seq ack_num, \
+                         int window);
+static void receive_data (mysocket_t sd, context_t *ctx, tcp_seq seq_num, \
+                          char *data, int size, int msg_start);
+static int receive_fin (mysocket_t sd, context_t *ctx, tcp_seq fin_seq);
+static void receive_skip (mysocket_t sd, context_t *ctx, tcp_seq skip_to, \
+                          char *data, int size);
+static void deliver_contiguous (mysocket_t sd, context_t *ctx);
+static int app_fits (mysocket_t sd, context_t *ctx, const char *data, \
+                     int size);
+static int inflated_size (context_t *ctx, int stream, const char *data, \
+                          int size, int *blocks);
+static save_packet *message_end (mysocket_t sd, context_t *ctx, \
+                                 save_packet *save, tcp_seq skip_to);
+static void set_deadline (mysocket_t sd, context_t *ctx, \
+                          preack_packet *preack);
+static int abandon_expired (mysocket_t sd, context_t *ctx);
+static void send_skip (mysocket_t sd, context_t *ctx);
+static void fec_add (mysocket_t sd, context_t *ctx, tcp_seq seq_num, \
+                     const char *data, int size);
+static void fec_flush (mysocket_t sd, context_t *ctx);
+static void fec_remember (context_t *ctx, tcp_seq seq_num, \
+                          const char *data, int size);
+static void receive_parity (mysocket_t sd, context_t *ctx, tcp_seq start, \
+                            const char *opt, int len, char *data, int size);
+static void deliver_segment (mysocket_t sd, context_t *ctx, char *data, \
+                             int size);
+static int stream_deliver (mysocket_t sd, context_t *ctx, char *data, \
+                           int size);
+static void stream_deliver_saved (mysocket_t sd, context_t *ctx, int stream);
+static void app_deliver (mysocket_t sd, context_t *ctx, int stream, \
+                         const char *data, int size);
+static void inflate_deliver (mysocket_t sd, context_t *ctx, int stream, \
+                             const char *data, int size);
+static void message_deliver (mysocket_t sd, context_t *ctx, int stream, \
+                             const char *data, int size);
+static void drop_connection (context_t *ctx, int error, const char *why, \
+                             int stream);
+static int frame_overhead (context_t *ctx);
+static int frame_app_data (mysocket_t sd, context_t *ctx, char *data, \
+                           int max_len);
+static int frame_messages (mysocket_t sd, context_t *ctx, int *stream, \
+                           char *data, int max_len);
+static int frame_compressed (mysocket_t sd, context_t *ctx, int *stream, \
+                             char *data, int max_len);
+static void request_features (mysocket_t sd, context_t *ctx);
+static int negotiate_features (mysocket_t sd, context_t *ctx, \
+                               const char *opt, int opt_len);
+static int syn_options (context_t *ctx, char *opt);
+static void tfo_reframe (context_t *ctx, int req_features, int req_streams);
+static void retransmit_preack (mysocket_t sd, context_t *ctx);
+static void send_syn (mysocket_t sd, context_t *ctx);
+static void send_synack (mysocket_t sd, context_t *ctx);
+static void tfo_prepare_syn (mysocket_t sd, context_t *ctx);
+static const char *find_option (const char *opt, int opt_len, int kind, \
+                                int *len);
+static uint32_t peer_ip (mysocket_t sd);
+static int peer_cache_get_cookie (uint32_t addr, char *cookie);
+static void peer_cache_put_cookie (uint32_t addr, const char *cookie);
+static int tfo_make_cookie (uint32_t addr, char *cookie);
+static long peer_cache_get_rtt (uint32_t addr);
+static void peer_cache_put_rtt (uint32_t addr, long rtt_us);
+static void handshake_start (mysocket_t sd, context_t *ctx);
+static int handshake_backoff (context_t *ctx);
+static void handshake_done (mysocket_t sd, context_t *ctx);
+static void set_timer_ms (context_t *ctx, long ms);
+static long ms_until (const struct timeval *when);
 
 /* initialise the transport layer, and start the main loop, handling
  * any data from the peer or the application.  this function should not
@@ -112,11 +350,14 @@ void set_timer (mysocket_t sd, context_t *ctx);
 void transport_init(mysocket_t sd, bool_t is_active)
 {
     context_t *ctx;
+    int k;
 
     ctx = (context_t *) calloc(1, sizeof(context_t));
     assert(ctx);
 
     generate_initial_seq_num(ctx);
+    ctx->cookie_len = -1;
+    ctx->fec_group = FEC_INIT_GROUP;
 
     /* XXX: you should send a SYN packet here if is_active, or wait for one
      * to arrive if !is_active.  after the handshake completes, unblock the
@@ -128,30 +369,47 @@ void transport_init(mysocket_t sd, bool_t is_active)
 
     if (is_active)  /* client */
     { 
-      struct timeval *now;
-      struct timespec *timer;
-      now = (struct timeval *) calloc (1, sizeof (struct timeval));
-      timer = (struct timespec *) calloc (1, sizeof (struct timespec));
-      ctx->timer = timer;
-
-      gettimeofday (now, NULL);
-      
-      /* start timer : 1sec */
-      ctx->timer->tv_sec = now->tv_sec + 1;
-      ctx->timer->tv_nsec = now->tv_usec * USEC;
-      free (now);
-
+      handshake_start (sd, ctx);
+      request_features (sd, ctx);
       ctx->connection_state = CSTATE_SYN_SENT;
-      send_packet (sd, ctx->initial_sequence_num, 0, SYN, NULL, 0);
+      if (stcp_get_option (sd, MYSO_FASTOPEN))
+        tfo_prepare_syn (sd, ctx);
+      send_syn (sd, ctx);
     }
     else ctx->connection_state = CSTATE_LISTEN; /* server */
 
     control_loop(sd, ctx);
 
-    if (ctx->iserror == 1)    /* connection is bad */
-      errno = ECONNREFUSED;
+    if (ctx->iserror)    /* connection is bad */
+      errno = ctx->iserror;
 
     /* do any cleanup here */
+    while (ctx->save != NULL)
+    {
+      save_packet *save = ctx->save;
+      ctx->save = save->next;
+      pool_free (&save_pool, save);
+    }
+    while (ctx->preack != NULL)
+    {
+      preack_packet *preack = ctx->preack;
+      ctx->preack = preack->next;
+      pool_free (&preack_pool, preack);
+    }
+    while (ctx->fec_history != NULL)
+    {
+      save_packet *save = ctx->fec_history;
+      ctx->fec_history = save->next;
+      pool_free (&save_pool, save);
+    }
+    pool_free (&timer_pool, ctx->timer);
+    for (k = 0; k < MYSOCK_MAX_STREAMS; k++)
+    {
+      free (ctx->msg_in[k].buf);
+      free (ctx->block_in[k].buf);
+      lz_free (&ctx->lz_out[k]);
+      lz_free (&ctx->lz_in[k]);
+    }
     free(ctx);
 }
 
@@ -184,48 +442,124 @@ static void control_loop(mysocket_t sd, context_t *ctx)
     assert(ctx);
     tcp_seq seq_num, ack_num;
     packet_type type;
-    save_packet *save, *save_temp;
+    int window;         /* the peer's, from its last segment */
     preack_packet *preack, *preack_temp;
+    struct timespec poll_time = { 0, 0 };   /* already past: don't block */
 
     int is_full = 0;    /* If window is full, is_full = 1 */
-    int timeout = 0;    /* number of timeout. timeout > 5 -> terminate */
 
     while (!ctx->done)
     {
         unsigned int event;
+        /* data held back for want of room goes up once the app reads */
+        unsigned int room = ctx->rcv_full ? APP_ROOM : 0;
+        /* a passive TFO connection may send before the handshake is over,
+         * and we keep sending after the peer's FIN until myclose() */
+        int can_send = (ctx->connection_state == CSTATE_ESTABLISHED ||
+                        ctx->connection_state == CSTATE_CLOSE_WAIT ||
+                        (ctx->connection_state == CSTATE_SYN_RCVD &&
+                         ctx->tfo_accepted));
+
+        /* myclose() is acted on once the handshake is over, and all the
+         * data is in segments */
+        if (ctx->close_pending && ctx->block_sent == ctx->block_len &&
+            ctx->connection_state == CSTATE_ESTABLISHED)
+        {
+          fec_flush (sd, ctx);
+          send_packet (sd, ctx->present_sequence_num, ctx->present_ack_num,\
+                       FIN, NULL, 0);
+          if (ctx->timer == NULL) set_timer (sd, ctx);
+          ctx->connection_state = CSTATE_FIN_WAIT_1;
+          ctx->close_pending = 0;
+          continue;
+        }
+
+        if (ctx->close_pending && ctx->block_sent == ctx->block_len &&
+            ctx->connection_state == CSTATE_CLOSE_WAIT)
+        {
+          fec_flush (sd, ctx);
+          send_packet (sd, ctx->present_sequence_num, ctx->present_ack_num,\
+                       FIN, NULL, 0);
+          if (ctx->timer == NULL) set_timer (sd, ctx);
+          ctx->connection_state = CSTATE_LAST_ACK;
+          ctx->close_pending = 0;
+          continue;
+        }
+
         /* see stcp_api.h or stcp_api.c for details of this function */
         /* XXX: you will need to change some of these arguments! */
 
-        if (is_full == 0) event = stcp_wait_for_event(sd, ANY_EVENT, ctx->timer); 
-        else if (is_full == 1)
-          event = stcp_wait_for_event (sd, NETWORK_DATA, ctx->timer);
-        
+        /* app data is left queued until we can send it.  the rest of a
+         * compressed block is sent as if the app had written it */
+        if (is_full == 0 && can_send && ctx->block_sent < ctx->block_len)
+          event = APP_DATA | \
+                  stcp_wait_for_event (sd, NETWORK_DATA | room, &poll_time);
+        else if (is_full == 0 && can_send)
+          event = stcp_wait_for_event(sd, ANY_EVENT | room, ctx->timer); 
+        else
+          event = stcp_wait_for_event (sd, NETWORK_DATA | room, ctx->timer);
+
+        if (event & APP_CLOSE_REQUESTED)
+          ctx->close_pending = 1;
+
+        if (event & APP_ROOM)
+        {
+          tcp_seq acked = ctx->present_ack_num;
+
+          ctx->rcv_full = 0;
+          deliver_contiguous (sd, ctx);
+          if (!ctx->rcv_full || ctx->present_ack_num != acked)
+            send_ack (sd, ctx);   /* (the peer may be waiting for it) */
+          if (!(event & (APP_DATA | NETWORK_DATA)))
+            continue;
+        }
 
 
         /* check whether it was the network, app, or a close request */
         if (event & APP_DATA)       
         {
           int packet_size = STCP_MSS;
-          if (ctx->connection_state == CSTATE_ESTABLISHED)
+          if (can_send)
           {
-            void *data = calloc (1, STCP_MSS);
+            /* late data isn't worth sending either; the peer hears of
+             * it now rather than at the next timeout */
+            if (abandon_expired (sd, ctx))
+              send_skip (sd, ctx);
 
-            if (ctx->window == WINDOWS_SIZE) set_timer (sd, ctx);  
-            else if (ctx->window <= STCP_MSS) packet_size = ctx->window;
+            if (ctx->window <= STCP_MSS) packet_size = ctx->window;
             
-            if (packet_size == 0)
+            /* a segment must have room for data after its headers */
+            if (packet_size <= frame_overhead (ctx))
             {
               is_full = 1;
-              free (data);
               continue;
             }
 
-            int data_size = stcp_app_recv (sd, data, packet_size);
-            preack = (preack_packet *) calloc (1, sizeof (preack_packet));
+            if (ctx->fast_path)
+            {
+              send_fast (sd, ctx, packet_size);
+              continue;
+            }
+
+            /* the data is framed straight into the retransmission list */
+            preack = (preack_packet *) pool_zalloc (&preack_pool);
+            preack->msg_start = !ctx->msg_open;
+            int data_size = frame_app_data (sd, ctx, preack->data, \
+                                            packet_size);
+            if (data_size < 0)   /* for a stream the peer doesn't have */
+            {
+              pool_free (&preack_pool, preack);
+              continue;
+            }
+            /* (until the handshake is over, the SYN-ACK's timer resends
+             * this too; see handshake_backoff) */
+            if (ctx->window == WINDOWS_SIZE && \
+                ctx->connection_state != CSTATE_SYN_RCVD)
+              set_timer (sd, ctx);
             preack->sequence_num = ctx->present_sequence_num;
             preack->size = data_size;
+            set_deadline (sd, ctx, preack);
 
-            memcpy (preack->data, data, data_size);
             if (ctx->preack == NULL) ctx->preack = preack;
             else 
             {
@@ -234,11 +568,10 @@ static void control_loop(mysocket_t sd, context_t *ctx)
               preack_temp->next = preack;
             }
 
-            send_packet (sd, ctx->present_sequence_num, \
-                         ctx->present_ack_num, NORMAL, data, data_size);
+            send_preack (sd, ctx, preack);
             ctx->present_sequence_num += data_size;
             ctx->window -= data_size;
-            free (data);
+            fec_add (sd, ctx, preack->sequence_num, preack->data, data_size);
           }
         }
 
@@ -249,30 +582,97 @@ static void control_loop(mysocket_t sd, context_t *ctx)
         {
           if (ctx->connection_state == CSTATE_LISTEN)
           {
-            rcvd_packet (sd, &seq_num, &ack_num, &type, NULL, NULL);
+            char opt[FULLOPTION];
+            int opt_len, size, cookie_len, agreed;
+            const char *cookie;
+            char data[STCP_MSS];
+
+            rcvd_packet_opt (sd, &seq_num, &ack_num, &type, data, &size, \
+                             opt, &opt_len, NULL);
             if (type == SYN)
             {
               ctx->connection_state = CSTATE_SYN_RCVD;
               ctx->present_ack_num = seq_num + 1;
-              send_packet (sd, ctx->initial_sequence_num, seq_num + 1, SYNACK,\
-                           NULL, 0);
+              ctx->present_sequence_num = ctx->initial_sequence_num + 1;
+              handshake_start (sd, ctx);
+              agreed = negotiate_features (sd, ctx, opt, opt_len);
+
+              /* TFO: hand out a cookie to a client that asks for one, and
+               * take the SYN's data straight away if it proves it has one
+               * (and the data is framed the way we agreed) */
+              cookie = find_option (opt, opt_len, TCPOPT_FASTOPEN, \
+                                    &cookie_len);
+              if (cookie != NULL && stcp_get_option (sd, MYSO_FASTOPEN) && \
+                  tfo_make_cookie (peer_ip (sd), ctx->cookie) == 0)
+              {
+                ctx->cookie_len = TFO_COOKIE_LEN;
+
+                if (cookie_len == 2 + TFO_COOKIE_LEN && size > 0 && \
+                    agreed && !memcmp (cookie + 2, ctx->cookie, TFO_COOKIE_LEN))
+                {
+                  ctx->present_ack_num += size;
+                  ctx->window = WINDOWS_SIZE;
+                  ctx->ERTT_ms = 500;
+                  ctx->tfo_accepted = 1;
+                  deliver_segment (sd, ctx, data, size);
+                  errno = 0;    /* connected */
+                  stcp_unblock_application (sd);
+                }
+              }
+              send_synack (sd, ctx);
             }
           }
 
 
           else if (ctx->connection_state == CSTATE_SYN_SENT)
           {
-            rcvd_packet (sd, &seq_num, &ack_num, &type, NULL, NULL);
+            char opt[FULLOPTION];
+            int opt_len, cookie_len;
+            int req_features = ctx->features, req_streams = ctx->num_streams;
+            const char *cookie;
+
+            rcvd_packet_opt (sd, &seq_num, &ack_num, &type, NULL, NULL, \
+                             opt, &opt_len, NULL);
             if (type == SYNACK)
             {
+              cookie = find_option (opt, opt_len, TCPOPT_FASTOPEN, \
+                                    &cookie_len);
+              if (cookie != NULL && cookie_len == 2 + TFO_COOKIE_LEN)
+                peer_cache_put_cookie (peer_ip (sd), cookie + 2);
+              handshake_done (sd, ctx);
+              negotiate_features (sd, ctx, opt, opt_len);
+
+              /* SYN data the server didn't take may need new framing */
+              if (ctx->preack != NULL && ack_num <= ctx->preack->sequence_num)
+                tfo_reframe (ctx, req_features, req_streams);
+
               send_packet (sd, ack_num, seq_num + 1, ACK, NULL, 0);
-              ctx->present_sequence_num = ack_num;
+              ctx->present_sequence_num = ctx->initial_sequence_num + 1 + \
+                                          ctx->syn_data_size;
               ctx->present_ack_num = seq_num + 1;
               ctx->window = WINDOWS_SIZE;
               ctx->ERTT_ms = 500;
               ctx->connection_state = CSTATE_ESTABLISHED;
-              free (ctx->timer);
+              pool_free (&timer_pool, ctx->timer);
               ctx->timer = NULL;
+
+              if (ctx->preack != NULL)
+              {
+                if (ack_num > ctx->preack->sequence_num)
+                {
+                  /* the server took the data in our SYN */
+                  pool_free (&preack_pool, ctx->preack);
+                  ctx->preack = NULL;
+                }
+                else
+                {
+                  /* cookie refused; send the data the usual way */
+                  ctx->window -= ctx->preack->size;
+                  set_timer (sd, ctx);
+                  retransmit_preack (sd, ctx);
+                }
+              }
+              errno = 0;    /* connected */
               stcp_unblock_application (sd);
             }
           }
@@ -281,766 +681,289 @@ static void control_loop(mysocket_t sd, context_t *ctx)
           else if (ctx->connection_state == CSTATE_SYN_RCVD)
           {
             rcvd_packet (sd, &seq_num, &ack_num, &type, NULL, NULL);
-            if (type == ACK)
+            if (type == ACK && ctx->tfo_accepted)
+            {
+              /* app is already running; the ACK may cover data we sent.
+               * the handshake timer goes, and any data still unacked gets
+               * a retransmission timer of its own in process_ack */
+              handshake_done (sd, ctx);
+              ctx->present_ack_num = seq_num;
+              ctx->connection_state = CSTATE_ESTABLISHED;
+              pool_free (&timer_pool, ctx->timer);
+              ctx->timer = NULL;
+              process_ack (sd, ctx, ack_num, -1);
+              is_full = 0;
+            }
+            else if (type == ACK)
             {
+              handshake_done (sd, ctx);
               ctx->present_sequence_num = ack_num;
               ctx->present_ack_num = seq_num;
               ctx->window = WINDOWS_SIZE;
               ctx->ERTT_ms = 500;
               ctx->connection_state = CSTATE_ESTABLISHED;
-              free (ctx->timer);
+              pool_free (&timer_pool, ctx->timer);
               ctx->timer = NULL;
+              errno = 0;    /* connected */
               stcp_unblock_application (sd);
             }
+            else if (type == SYN)
+              send_synack (sd, ctx);
           }
 
 
           else if (ctx->connection_state == CSTATE_ESTABLISHED)
           {  
-            void *data = calloc (1, STCP_MSS);
-            int size;
-            rcvd_packet (sd, &seq_num, &ack_num, &type, data, &size);
-
-            if (type == SYNACK)    /* delay ACK of SYNACK */
-              send_packet (sd, ctx->present_sequence_num, \
-                           ctx->present_ack_num, ACK, NULL, 0);
-
-            else if (type == NORMAL) /* Data Receive */
-            {
-              if (seq_num < ctx->present_ack_num)  /* Duplicate Data */
-                send_packet (sd, ctx->present_sequence_num,\
-                             ctx->present_ack_num, ACK, NULL, 0);
-              
-              else if (seq_num > ctx->present_ack_num) /* Buffer out of order */
-              {
-                send_packet (sd, ctx->present_sequence_num,\
-                             ctx->present_ack_num, ACK, NULL, 0);
-
-                save_temp = ctx->save;
-                while (save_temp != NULL)
-                {
-                  if (save_temp->start == \
-                      (int)(seq_num - ctx->present_ack_num))
-                    break;
-                  save_temp = save_temp->next;
-                }
-                if (save_temp != NULL) 
-                {
-                  free (data);
-                  continue;
-                }
+            stcp_packet_t *packet;
+            char opt[FULLOPTION], *data;
+            const char *parity;
+            int size, opt_len, len, datagram_len;
+            packet = rcvd_segment (sd, &datagram_len, &seq_num, &ack_num, \
+                                   &type, &data, &size, opt, &opt_len, \
+                                   &window);
+            ctx->rx_packet = packet;
 
-                save = (save_packet *) calloc (1, sizeof (save_packet));
-                save->start = seq_num - ctx->present_ack_num;
-                if (save->start >= WINDOWS_SIZE)
-                {
-                  free (save);
-                  free (data);
-                  continue;
-                }
-                save->end = save->start + size;
-                if (save->end > WINDOWS_SIZE)
-                  save->end = WINDOWS_SIZE;
-                memcpy (save->data, data, save->end - save->start);
-
-                if (ctx->save == NULL) ctx->save = save;
-                else
-                {
-                  save_temp = ctx->save;
-                  while (save_temp->next != NULL) save_temp = save_temp->next;
-                  save_temp->next = save;
-                }
-              }
-
-              else /* Naturally Data arrive */ 
-              {
-                int size_temp = size;
-                
-                save_temp = ctx->save;
-                while (save_temp != NULL) /* Search that out of order data */
-                {
-                  if (save_temp->start == size_temp)
-                  {
-                    size_temp += save_temp->end - save_temp->start;
-                    save_temp = save_temp->next;
-                  }
-                  else break;
-                }
+            if (find_option (opt, opt_len, TCPOPT_SKIP, &len) != NULL)
+              receive_skip (sd, ctx, seq_num, data, size);
 
-                send_packet (sd, ctx->present_sequence_num, \
-                             seq_num + size_temp, ACK, NULL, 0);
-                
-                void *data_merge = calloc (1, WINDOWS_SIZE);
-                memcpy (data_merge, data, size);
-                
-                save_temp = ctx->save;   /* if out of buffer data exists, merge that */
-                while (save_temp != NULL)
-                {
-                  if (save_temp->start == size)
-                  {
-                    memcpy (data_merge + size, save_temp->data,\
-                            save_temp->end - save_temp->start);
-                    size += save_temp->end - save_temp->start;
-                    save = save_temp;
-                    save_temp = save_temp->next;
-                    ctx->save = save_temp;
-                    free (save);
-                  }
-                  else
-                  {
-                    while (save_temp != NULL)
-                    {
-                      save_temp->start -= size;
-                      save_temp->end -= size;
-                      save_temp = save_temp->next;
-                    }
-                  }
-                }
+            else if ((parity = find_option (opt, opt_len, TCPOPT_PARITY, \
+                                            &len)) != NULL)
+              receive_parity (sd, ctx, seq_num, parity, len, data, size);
 
-                ctx->present_ack_num = seq_num + size;
+            else if (type == SYNACK)    /* delay ACK of SYNACK */
+              send_ack (sd, ctx);
 
-                stcp_app_send (sd, data_merge, size);
-                free (data_merge);
-              }
-            }
+            else if (type == NORMAL || type == MSG_START) /* Data Receive */
+              receive_data (sd, ctx, seq_num, data, size, \
+                            type == MSG_START);
 
             else if (type == ACK)  /* ACK arrive */
             {
               /* move the window */
-              if (ctx->preack != NULL && ack_num > ctx->preack->sequence_num)
-              {
-                cal_timer (sd, ctx);
-                preack_temp = ctx->preack;
-                while (preack_temp != NULL)
-                {
-                  if (preack_temp->sequence_num < ack_num)
-                  {
-                    preack = preack_temp;
-                    preack_temp = preack_temp->next;
-                    ctx->preack = preack_temp;
-                    free (preack);
-                  }
-                  else break;
-                }
-                is_full = 0;
-              }
-
-              if (ctx->preack == NULL) ctx->window = WINDOWS_SIZE;
-              else
-              {
-                ctx->window = WINDOWS_SIZE -\
-                              (ctx->present_sequence_num -\
-                               ctx->preack->sequence_num);
-                set_timer (sd, ctx);
-              }
-              our_dprintf ("ctx->window = %d\n", ctx->window);
-              assert (ctx->window <= WINDOWS_SIZE);
+              process_ack (sd, ctx, ack_num, window);
+              is_full = 0;
 
-              /* Our code can handling data with ack 
-               * (Actually almost same as receive data) */
+              /* Our code can handling data with ack */
               if (size != 0)
-              { 
-                if (seq_num < ctx->present_ack_num)
-                  send_packet (sd, ctx->present_sequence_num,\
-                               ctx->present_ack_num, ACK, NULL, 0);
-                else if (seq_num > ctx->present_ack_num)
-                {
-                  send_packet (sd, ctx->present_sequence_num,\
-                               ctx->present_ack_num, ACK, NULL, 0);
-
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == \
-                        (int)(seq_num - ctx->present_ack_num))
-                      break;
-                    save_temp = save_temp->next;
-                  }
-
-                  if (save_temp != NULL) 
-                  {
-                    free (data);
-                    continue;
-                  }
-
-                  save = (save_packet *) calloc (1, sizeof (save_packet));
-                  save->start = seq_num - ctx->present_ack_num;
-                  if (save->start >= WINDOWS_SIZE)
-                  {
-                    free (save);
-                    free (data);
-                    continue;
-                  }
-                  save->end = save->start + size;
-                  if (save->end > WINDOWS_SIZE)
-                    save->end = WINDOWS_SIZE;
-                  memcpy (save->data, data, save->end - save->start);
-
-                  if (ctx->save == NULL) ctx->save = save;
-                  else
-                  {
-                    save_temp = ctx->save;
-                    while (save_temp->next != NULL) save_temp = save_temp->next;
-                    save_temp->next = save;
-                  }
-                }
-
-                else
-                {
-                  int size_temp = size;
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == size_temp)
-                    {
-                      size_temp += save_temp->end - save_temp->start;
-                      save_temp = save_temp->next;
-                    }
-                    else break;
-                  }
-                  send_packet (sd, ctx->present_sequence_num, \
-                               seq_num + size_temp, ACK, NULL, 0);
-                
-                  void *data_merge = calloc (1, WINDOWS_SIZE);
-                  memcpy (data_merge, data, size);
-                
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == size)
-                    {
-                      memcpy (data_merge + size, save_temp->data,\
-                              save_temp->end - save_temp->start);
-                      size += save_temp->end - save_temp->start;
-                      save = save_temp;
-                      save_temp = save_temp->next;
-                      ctx->save = save_temp;
-                      free (save);
-                    }
-                    else
-                    {
-                      while (save_temp != NULL)
-                      {
-                        save_temp->start -= size;
-                        save_temp->end -= size;
-                        save_temp = save_temp->next;
-                      }
-                    }
-                  }
-
-                  ctx->present_ack_num = seq_num + size;
-
-                  our_dprintf ("data transmission : %s\n", data_merge);
-                  stcp_app_send (sd, data_merge, size);
-                  free (data_merge);
-                } 
-              }
+                receive_data (sd, ctx, seq_num, data, size, 0);
             }
 
             else if (type == FIN) /* ready to terminate */
             {
-              send_packet (sd, ack_num, seq_num + 1, ACK, NULL, 0);
-              ctx->present_ack_num = seq_num + 1;
-              ctx->connection_state = CSTATE_CLOSE_WAIT;
-
-              /* Our code can handling data with fin 
-               * (Actually almost same as receive data) */
               if (size != 0)
-              { 
-                if (seq_num < ctx->present_ack_num)
-                  send_packet (sd, ctx->present_sequence_num,\
-                               ctx->present_ack_num, ACK, NULL, 0);
-                else if (seq_num > ctx->present_ack_num)
-                {
-                  send_packet (sd, ctx->present_sequence_num,\
-                               ctx->present_ack_num, ACK, NULL, 0);
-                  
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == \
-                        (int)(seq_num - ctx->present_ack_num))
-                      break;
-                    save_temp = save_temp->next;
-                  }
-
-                  if (save_temp != NULL) 
-                  {
-                    free (data);
-                    continue;
-                  }
-
-                  save = (save_packet *) calloc (1, sizeof (save_packet));
-                  save->start = seq_num - ctx->present_ack_num;
-                  if (save->start >= WINDOWS_SIZE)
-                  {
-                    free (save);
-                    free (data);
-                    continue;
-                  }
-                  save->end = save->start + size;
-                  if (save->end > WINDOWS_SIZE)
-                    save->end = WINDOWS_SIZE;
-                  memcpy (save->data, data, save->end - save->start);
-
-                  if (ctx->save == NULL) ctx->save = save;
-                  else
-                  {
-                    save_temp = ctx->save;
-                    while (save_temp->next != NULL) save_temp = save_temp->next;
-                    save_temp->next = save;
-                  }
-                }
+                receive_data (sd, ctx, seq_num, data, size, 0);
 
-                else
-                {
-                  int size_temp = size;
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == size_temp)
-                    {
-                      size_temp += save_temp->end - save_temp->start;
-                      save_temp = save_temp->next;
-                    }
-                    else break;
-                  }
-                  send_packet (sd, ctx->present_sequence_num, \
-                               seq_num + size_temp, ACK, NULL, 0);
-                
-                  void *data_merge = calloc (1, WINDOWS_SIZE);
-                  memcpy (data_merge, data, size);
-                
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == size)
-                    {
-                      memcpy (data_merge + size, save_temp->data,\
-                              save_temp->end - save_temp->start);
-                      size += save_temp->end - save_temp->start;
-                      save = save_temp;
-                      save_temp = save_temp->next;
-                      ctx->save = save_temp;
-                      free (save);
-                    }
-                    else
-                    {
-                      while (save_temp != NULL)
-                      {
-                        save_temp->start -= size;
-                        save_temp->end -= size;
-                        save_temp = save_temp->next;
-                      }
-                    }
-                  }
-
-                  ctx->present_ack_num = seq_num + size;
-
-                  our_dprintf ("data transmission : %s\n", data_merge);
-                  stcp_app_send (sd, data_merge, size);
-                  free (data_merge);
-                } 
-              }
+              if (receive_fin (sd, ctx, seq_num + size))
+              {
+                ctx->connection_state = CSTATE_CLOSE_WAIT;
 
-              /* request to application to close connection */
-              stcp_fin_received (sd); 
+                /* request to application to close connection */
+                stcp_fin_received (sd); 
+              }
             }
 
-            free (data);
+            ctx->rx_packet = NULL;
+            stcp_packet_release (packet);
           }
 
 
-          else if (ctx->connection_state == CSTATE_FIN_WAIT_1)
+          else if (ctx->connection_state == CSTATE_CLOSE_WAIT)
           {
-            void *data = calloc (1, STCP_MSS);
-            int size;
-            rcvd_packet (sd, &seq_num, &ack_num, &type, data, &size);
-            
-            if (type == FIN)
+            rcvd_packet_opt (sd, &seq_num, &ack_num, &type, NULL, NULL, \
+                             NULL, NULL, &window);
+            if (type == ACK)
             {
-              send_packet (sd, ack_num, seq_num + 1, ACK, NULL, 0);
-              ctx->present_ack_num = seq_num + 1;
-              ctx->connection_state = CSTATE_CLOSING;
+              process_ack (sd, ctx, ack_num, window);
+              is_full = 0;
             }
+            else if (type == FIN)  /* our ACK of it was lost */
+              receive_fin (sd, ctx, seq_num);
+          }
 
-            /* Before the ack packet arrive, Our code can receive data
-             * (Actually almost same as receive data) */
-            else if (type == NORMAL)
-            {
-              if (seq_num < ctx->present_ack_num)
-              {
-                our_dprintf ("BEFORE!\n");
-                send_packet (sd, ctx->present_sequence_num,\
-                             ctx->present_ack_num, ACK, NULL, 0);
-              }
-              else if (seq_num > ctx->present_ack_num)
-              {
-                our_dprintf ("AFTER!\n");
-                send_packet (sd, ctx->present_sequence_num,\
-                             ctx->present_ack_num, ACK, NULL, 0);
-                save_temp = ctx->save;
-                while (save_temp != NULL)
-                {
-                  if (save_temp->start == \
-                      (int)(seq_num - ctx->present_ack_num))
-                    break;
-                  save_temp = save_temp->next;
-                }
-
-                if (save_temp != NULL) 
-                {
-                  free (data);
-                  continue;
-                }
-
-                save = (save_packet *) calloc (1, sizeof (save_packet));
-                save->start = seq_num - ctx->present_ack_num;
-                if (save->start >= WINDOWS_SIZE)
-                {
-                  free (save);
-                  free (data);
-                  continue;
-                }
-                save->end = save->start + size;
-                if (save->end > WINDOWS_SIZE)
-                  save->end = WINDOWS_SIZE;
-                memcpy (save->data, data, save->end - save->start);
-
-                if (ctx->save == NULL) ctx->save = save;
-                else
-                {
-                  save_temp = ctx->save;
-                  while (save_temp->next != NULL) save_temp = save_temp->next;
-                  save_temp->next = save;
-                }
-              }
-
-              else
-              {
-                our_dprintf ("PRINT!\n");
-                int size_temp = size;
-                save_temp = ctx->save;
-                while (save_temp != NULL)
-                {
-                  if (save_temp->start == size_temp)
-                  {
-                    size_temp += save_temp->end - save_temp->start;
-                    save_temp = save_temp->next;
-                  }
-                  else break;
-                }
-                send_packet (sd, ctx->present_sequence_num, \
-                             seq_num + size_temp, ACK, NULL, 0);
-                
-                void *data_merge = calloc (1, WINDOWS_SIZE);
-                memcpy (data_merge, data, size);
-                
-                save_temp = ctx->save;
-                while (save_temp != NULL)
-                {
-                  if (save_temp->start == size)
-                  {
-                    memcpy (data_merge + size, save_temp->data,\
-                            save_temp->end - save_temp->start);
-                    size += save_temp->end - save_temp->start;
-                    save = save_temp;
-                    save_temp = save_temp->next;
-                    ctx->save = save_temp;
-                    free (save);
-                  }
-                  else
-                  {
-                    while (save_temp != NULL)
-                    {
-                      save_temp->start -= size;
-                      save_temp->end -= size;
-                      save_temp = save_temp->next;
-                    }
-                  }
-                }
-
-                ctx->present_ack_num = seq_num + size;
-
-                our_dprintf ("data transmission : %s\n", data_merge);
-                stcp_app_send (sd, data_merge, size);
-                free (data_merge);
-              }
-            }
 
-            /* Our code can handling data with ack 
-             * (Actually almost same as receive data) */
-            else if (type == ACK)
+          else if (ctx->connection_state == CSTATE_FIN_WAIT_1)
+          {
+            stcp_packet_t *packet;
+            char opt[FULLOPTION], *data;
+            const char *parity;
+            int size, opt_len, len, datagram_len;
+            packet = rcvd_segment (sd, &datagram_len, &seq_num, &ack_num, \
+                                   &type, &data, &size, opt, &opt_len, \
+                                   &window);
+            ctx->rx_packet = packet;
+            
+            if (type == ACK)
             {
-              if (ctx->preack != NULL && ack_num > ctx->preack->sequence_num)
-              {
-                cal_timer (sd, ctx);
-                preack_temp = ctx->preack;
-                while (preack_temp != NULL)
-                {
-                  if (preack_temp->sequence_num < ack_num)
-                  {
-                    preack = preack_temp;
-                    preack_temp = preack_temp->next;
-                    ctx->preack = preack_temp;
-                    free (preack);
-                  }
-                  else break;
-                }
-                is_full = 0;
-              }
-
-              if (ctx->preack == NULL) ctx->window = WINDOWS_SIZE;
-              else
-              {
-                ctx->window = WINDOWS_SIZE -\
-                              (ctx->present_sequence_num -\
-                               ctx->preack->sequence_num);
-                set_timer (sd, ctx);
-              }
-              our_dprintf ("ctx->window = %d\n", ctx->window);
-              assert (ctx->window <= WINDOWS_SIZE);
-              our_dprintf ("ACK\n");
+              process_ack (sd, ctx, ack_num, window);
+              is_full = 0;
+            }
 
-              printf ("size : %d\n", size);
-              if (size != 0)
-              { 
-              our_dprintf ("Here?\n");
-                if (seq_num < ctx->present_ack_num)
-                  send_packet (sd, ctx->present_sequence_num,\
-                               ctx->present_ack_num, ACK, NULL, 0);
-                else if (seq_num > ctx->present_ack_num)
-                {
-                  send_packet (sd, ctx->present_sequence_num,\
-                               ctx->present_ack_num, ACK, NULL, 0);
-
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == \
-                        (int)(seq_num - ctx->present_ack_num))
-                      break;
-                    save_temp = save_temp->next;
-                  }
-
-                  if (save_temp != NULL) 
-                  {
-                    free (data);
-                    continue;
-                  }
-
-                  save = (save_packet *) calloc (1, sizeof (save_packet));
-                  save->start = seq_num - ctx->present_ack_num;
-                  if (save->start >= WINDOWS_SIZE)
-                  {
-                    free (save);
-                    free (data);
-                    continue;
-                  }
-                  save->end = save->start + size;
-                  if (save->end > WINDOWS_SIZE)
-                    save->end = WINDOWS_SIZE;
-                  memcpy (save->data, data, save->end - save->start);
-
-                  if (ctx->save == NULL) ctx->save = save;
-                  else
-                  {
-                    save_temp = ctx->save;
-                    while (save_temp->next != NULL) save_temp = save_temp->next;
-                    save_temp->next = save;
-                  }
-                }
+            /* Before the FIN is acknowledged, Our code can receive data */
+            if (find_option (opt, opt_len, TCPOPT_SKIP, &len) != NULL)
+              receive_skip (sd, ctx, seq_num, data, size);
+            else if ((parity = find_option (opt, opt_len, TCPOPT_PARITY, \
+                                            &len)) != NULL)
+              receive_parity (sd, ctx, seq_num, parity, len, data, size);
+            else if (size != 0)
+              receive_data (sd, ctx, seq_num, data, size, \
+                            type == MSG_START);
 
-                else
-                {
-                  int size_temp = size;
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == size_temp)
-                    {
-                      size_temp += save_temp->end - save_temp->start;
-                      save_temp = save_temp->next;
-                    }
-                    else break;
-                  }
-                  send_packet (sd, ctx->present_sequence_num, \
-                               seq_num + size_temp, ACK, NULL, 0);
-                
-                  void *data_merge = calloc (1, WINDOWS_SIZE);
-                  memcpy (data_merge, data, size);
-                
-                  save_temp = ctx->save;
-                  while (save_temp != NULL)
-                  {
-                    if (save_temp->start == size)
-                    {
-                      memcpy (data_merge + size, save_temp->data,\
-                              save_temp->end - save_temp->start);
-                      size += save_temp->end - save_temp->start;
-                      save = save_temp;
-                      save_temp = save_temp->next;
-                      ctx->save = save_temp;
-                      free (save);
-                    }
-                    else
-                    {
-                      while (save_temp != NULL)
-                      {
-                        save_temp->start -= size;
-                        save_temp->end -= size;
-                        save_temp = save_temp->next;
-                      }
-                    }
-                  }
-
-                  ctx->present_ack_num = seq_num + size;
-
-                  our_dprintf ("data transmission : %s\n", data_merge);
-                  stcp_app_send (sd, data_merge, size);
-                  free (data_merge);
-                } 
-              
-              }
-              
-              ctx->connection_state = CSTATE_FIN_WAIT_2;
+            if (type == FIN)
+            {
+              if (receive_fin (sd, ctx, seq_num + size))
+                ctx->connection_state = CSTATE_CLOSING;
             }
+            else if (type == ACK && ack_num > ctx->present_sequence_num)
+              ctx->connection_state = CSTATE_FIN_WAIT_2;  /* FIN is acked */
 
-            free (data);
+            ctx->rx_packet = NULL;
+            stcp_packet_release (packet);
           }
 
 
           else if (ctx->connection_state == CSTATE_FIN_WAIT_2)
           {
-            rcvd_packet (sd, &seq_num, &ack_num, &type, NULL, NULL);
-            if (type == FIN)
-            {
-              send_packet (sd, ack_num, seq_num + 1, ACK, NULL, 0);
-              cal_timer (sd, ctx);
+            stcp_packet_t *packet;
+            char opt[FULLOPTION], *data;
+            const char *parity;
+            int size, opt_len, len, datagram_len;
+            packet = rcvd_segment (sd, &datagram_len, &seq_num, &ack_num, \
+                                   &type, &data, &size, opt, &opt_len, \
+                                   &window);
+            ctx->rx_packet = packet;
+
+            /* the peer may still be sending */
+            if (find_option (opt, opt_len, TCPOPT_SKIP, &len) != NULL)
+              receive_skip (sd, ctx, seq_num, data, size);
+            else if ((parity = find_option (opt, opt_len, TCPOPT_PARITY, \
+                                            &len)) != NULL)
+              receive_parity (sd, ctx, seq_num, parity, len, data, size);
+            else if (size != 0)
+              receive_data (sd, ctx, seq_num, data, size, \
+                            type == MSG_START);
+
+            if (type == FIN && receive_fin (sd, ctx, seq_num + size))
               ctx->done = TRUE;
-            }
+
+            ctx->rx_packet = NULL;
+            stcp_packet_release (packet);
           }
 
 
           else if (ctx->connection_state == CSTATE_CLOSING)
           {
             rcvd_packet (sd, &seq_num, &ack_num, &type, NULL, NULL);
-            if (type == ACK)
-            {
-              cal_timer (sd, ctx);
+            if (type == ACK && ack_num > ctx->present_sequence_num)
               ctx->done = TRUE;
-            }
+            else if (type == FIN)
+              receive_fin (sd, ctx, seq_num);
           }
 
 
           else if (ctx->connection_state == CSTATE_LAST_ACK)
           {
-            rcvd_packet (sd, &seq_num, &ack_num, &type, NULL, NULL);
+            rcvd_packet_opt (sd, &seq_num, &ack_num, &type, NULL, NULL, \
+                             NULL, NULL, &window);
             if (type == ACK) 
             {
-              cal_timer (sd, ctx);
-              ctx->done = TRUE;
+              process_ack (sd, ctx, ack_num, window);
+              if (ack_num > ctx->present_sequence_num)
+                ctx->done = TRUE;
             }
+            else if (type == FIN)
+              receive_fin (sd, ctx, seq_num);
           }
         }
           
 
 
-        else if (event & APP_CLOSE_REQUESTED)
-        {
-          if (ctx->connection_state == CSTATE_ESTABLISHED)
-          {
-            send_packet (sd, ctx->present_sequence_num, ctx->present_ack_num,\
-                         FIN, NULL, 0);
-            if (ctx->timer == NULL) set_timer (sd, ctx);
-            ctx->connection_state = CSTATE_FIN_WAIT_1;
-          }
-
 
-          if (ctx->connection_state == CSTATE_CLOSE_WAIT)
-          {
-            send_packet (sd, ctx->present_sequence_num, ctx->present_ack_num,\
-                         FIN, NULL, 0);
-            if (ctx->timer == NULL) set_timer (sd, ctx);
-            ctx->connection_state = CSTATE_LAST_ACK;
-          }
-        }
-  
 
 
         else if (event == TIMEOUT)
         {
-          if (timeout++ > 5)
+          if (ctx->connection_state == CSTATE_SYN_SENT ||\
+              ctx->connection_state == CSTATE_SYN_RCVD)
           {
-            if (ctx->connection_state == CSTATE_SYN_SENT ||\
-                ctx->connection_state == CSTATE_SYN_RCVD)
+            if (handshake_backoff (ctx) < 0)  /* connect timeout is over */
             {
-              stcp_unblock_application (sd);
-              ctx->iserror = 1;
+              ctx->iserror = ETIMEDOUT;
+              if (ctx->connection_state == CSTATE_SYN_SENT)
+              {
+                errno = ETIMEDOUT;
+                stcp_unblock_application (sd);
+              }
+              return;
             }
-            return;
-          }
 
-          if (ctx->connection_state == CSTATE_SYN_SENT)
-          {
-            send_packet (sd, ctx->initial_sequence_num, 0, SYN, NULL, 0);
-            ctx->timer->tv_sec++;
+            if (ctx->connection_state == CSTATE_SYN_SENT)
+              send_syn (sd, ctx);
+            else
+            {
+              send_synack (sd, ctx);
+              retransmit_preack (sd, ctx);
+            }
           }
 
-          else if (ctx->connection_state == CSTATE_SYN_RCVD)
-          {
-            send_packet (sd, ctx->initial_sequence_num, ctx->present_ack_num,\
-                         SYNACK, NULL, 0);
-            ctx->timer->tv_sec++;
-          }
+          else if (!ctx->peer_full && ctx->timeouts++ > 5)
+            return;
 
-          else if (ctx->connection_state == CSTATE_ESTABLISHED)
+          else if ((ctx->connection_state == CSTATE_ESTABLISHED ||\
+                    ctx->connection_state == CSTATE_CLOSE_WAIT) &&\
+                   (ctx->preack != NULL || ctx->skip_seq != 0))
           {
-            assert (ctx->preack != NULL);
+            /* late data isn't worth resending */
+            abandon_expired (sd, ctx);
+            is_full = 0;
 
             /* If timeout occurs when data exchange, 
-             * timeout value will be one and a half */
-            free (ctx->timer);
+             * timeout value will be one and a half
+             * (a peer with no room is asked again at the same pace) */
+            pool_free (&timer_pool, ctx->timer);
             ctx->timer = NULL;
-            int RTT = ctx->ERTT_s * SEC + ctx->ERTT_ms * MSEC;
-            RTT = RTT * 3 / 2;
+            long RTT = (long) ctx->ERTT_s * SEC + ctx->ERTT_ms * MSEC;
+            if (!ctx->peer_full)
+              RTT = RTT * 3 / 2;
             ctx->ERTT_s = RTT / SEC;
             ctx->ERTT_ms = (RTT / MSEC) % 1000;
 
             set_timer (sd, ctx);
             
             /* retransmission */
-            preack_temp = ctx->preack;
-            while (preack_temp != NULL)
-            {
-              send_packet (sd, preack_temp->sequence_num, \
-                           ctx->present_ack_num, NORMAL, \
-                           preack_temp->data, preack_temp->size);
-              preack_temp = preack_temp->next;
-            }
+            if (ctx->skip_seq != 0)
+              send_skip (sd, ctx);
+            retransmit_preack (sd, ctx);
           }
 
           else if (ctx->connection_state == CSTATE_FIN_WAIT_1)
           {
+            abandon_expired (sd, ctx);
+            if (ctx->skip_seq != 0)
+              send_skip (sd, ctx);
+            retransmit_preack (sd, ctx);
             send_packet (sd, ctx->present_sequence_num, ctx->present_ack_num,\
                          FIN, NULL, 0);
-            free (ctx->timer);
+            pool_free (&timer_pool, ctx->timer);
             ctx->timer = NULL;
             set_timer (sd, ctx);
           }
 
           else if (ctx->connection_state == CSTATE_LAST_ACK)
           {
+            abandon_expired (sd, ctx);
+            if (ctx->skip_seq != 0)
+              send_skip (sd, ctx);
+            retransmit_preack (sd, ctx);
             send_packet (sd, ctx->present_sequence_num, ctx->present_ack_num,\
                          FIN, NULL, 0);
-            free (ctx->timer);
+            pool_free (&timer_pool, ctx->timer);
             ctx->timer = NULL;
             set_timer (sd, ctx);
           }
 
           else
           {
-            free (ctx->timer);
+            pool_free (&timer_pool, ctx->timer);
             ctx->timer = NULL;
             set_timer (sd, ctx); 
           }
@@ -1052,125 +975,1698 @@ static void control_loop(mysocket_t sd, context_t *ctx)
 /* send_packet : send a packet with lots of parameter */
 int send_packet (mysocket_t sd, tcp_seq seq_num, tcp_seq ack_num, \
                  packet_type type, char *data, int size)
+{
+  return send_packet_opt (sd, seq_num, ack_num, type, NULL, 0, data, size);
+}
+
+/* send_packet_opt : send a packet carrying TCP options (opt_len bytes,
+ * padded with EOL up to a multiple of four) between header and data */
+int send_packet_opt (mysocket_t sd, tcp_seq seq_num, tcp_seq ack_num, \
+                     packet_type type, const char *opt, int opt_len, \
+                     char *data, int size)
+{
+  return send_packet_kept (sd, seq_num, ack_num, type, opt, opt_len, \
+                           data, size, WINDOWS_SIZE, NULL);
+}
+
+/* send_packet_kept : send_packet_opt, advertising the given window, and
+ * also keeping the header as sent in kept (no options) if it isn't NULL,
+ * to resend the segment with.  the header, the data and the padding out
+ * to STCP_MSS are handed down separately, and gathered into the datagram
+ * as it is written */
+static int send_packet_kept (mysocket_t sd, tcp_seq seq_num, \
+                             tcp_seq ack_num, packet_type type, \
+                             const char *opt, int opt_len, \
+                             char *data, int size, int window, \
+                             stcp_kept_t *kept)
 {
   int success;
-  STCPPacket *packet = (STCPPacket *) calloc (1, sizeof (STCPPacket));
-  packet->header.th_seq = htonl (seq_num);
-  packet->header.th_ack = htonl (ack_num);
-  packet->header.th_off = 5;
-  if (type == SYN) packet->header.th_flags = TH_SYN;
-  else if (type == SYNACK) packet->header.th_flags = (TH_SYN | TH_ACK);
-  else if (type == ACK) packet->header.th_flags = TH_ACK;
-  else if (type == FIN) packet->header.th_flags = TH_FIN;
-  packet->header.th_win = htonl (WINDOWS_SIZE);
-  packet->data_size = size;
-
-  if (data != NULL) 
+  int opt_words = (opt_len + 3) / 4;
+  char packet[sizeof (STCPHeader) + FULLOPTION];
+  STCPHeader *header = (STCPHeader *) packet;
+  int head_len = sizeof (STCPHeader) + opt_words * 4 + sizeof (int);
+  int data_len = (data != NULL) ? size : 0;
+
+  assert (opt_len <= FULLOPTION - (int) sizeof (int));
+  assert (kept == NULL || opt_len == 0);
+  assert (data_len >= 0 && data_len <= STCP_MSS);
+  memset (packet, 0, sizeof (packet));
+  header->th_seq = htonl (seq_num);
+  header->th_ack = htonl (ack_num);
+  header->th_off = 5 + opt_words;
+  if (type == SYN) header->th_flags = TH_SYN;
+  else if (type == SYNACK) header->th_flags = (TH_SYN | TH_ACK);
+  else if (type == ACK) header->th_flags = TH_ACK;
+  else if (type == FIN) header->th_flags = TH_FIN;
+  else if (type == MSG_START) header->th_flags = TH_PUSH;
+  header->th_win = htons (window);
+
+  if (opt_len > 0)
+    memcpy (packet + sizeof (STCPHeader), opt, opt_len);
+  memcpy (packet + TCP_DATA_START (packet), &size, sizeof (int));
+
+  /* (a NULL buffer ends the list, so an empty one is left out) */
+  if (kept != NULL && data_len > 0)
+    success = stcp_network_send_kept (sd, kept, packet, head_len, \
+                                      data, data_len, \
+                                      padding, STCP_MSS - data_len, NULL);
+  else if (kept != NULL)
+    success = stcp_network_send_kept (sd, kept, packet, head_len, \
+                                      padding, STCP_MSS, NULL);
+  else if (data_len > 0)
+    success = stcp_network_send (sd, packet, head_len, data, data_len, \
+                                 padding, STCP_MSS - data_len, NULL);
+  else
+    success = stcp_network_send (sd, packet, head_len, \
+                                 padding, STCP_MSS, NULL);
+
+  return success;
+}
+
+/* rcv_window : the window to advertise in an ACK: how much more the app
+ * has room for in its queue (see stcp_app_room), and none while data is
+ * held back for want of it (the peer goes on resending meanwhile, rather
+ * than giving up; see process_ack) */
+static int rcv_window (mysocket_t sd, context_t *ctx)
+{
+  size_t room = WINDOWS_SIZE;
+  int k;
+
+  if (ctx->rcv_full)
+    return 0;
+  for (k = 0; k == 0 || k < ctx->num_streams; k++)
+    room = MIN (room, stcp_app_room (sd, k, 1));
+  return room;
+}
+
+/* send_ack : acknowledge everything received so far.  the first ACK is
+ * kept, and later ones just refresh its sequence and ack numbers (unless
+ * the window has changed) */
+static void send_ack (mysocket_t sd, context_t *ctx)
+{
+  int window = rcv_window (sd, ctx);
+
+  if (ctx->ack_sent.len > 0 && ctx->ack_sent_win == window)
   {
-    memcpy (packet->data, data, size);
-    success = stcp_network_send (sd, packet, sizeof (STCPPacket), NULL);
+    stcp_network_resend (sd, &ctx->ack_sent, ctx->present_sequence_num, \
+                         ctx->present_ack_num, padding, STCP_MSS, NULL);
+    return;
   }
 
-  else success = stcp_network_send (sd, packet, sizeof (STCPPacket), NULL);
-  free (packet);
+  send_packet_kept (sd, ctx->present_sequence_num, ctx->present_ack_num, \
+                    ACK, NULL, 0, NULL, 0, window, &ctx->ack_sent);
+  ctx->ack_sent_win = window;
+}
 
-  return success;
+/* send_fast : frame and send up to max_len bytes of app data on the fast
+ * path (MYSO_FASTPATH), where the network below delivers every segment and
+ * nothing is kept for resending.  returns the payload size, or -1 */
+static int send_fast (mysocket_t sd, context_t *ctx, int max_len)
+{
+  char data[STCP_MSS];
+  int size = frame_app_data (sd, ctx, data, max_len);
+
+  if (size < 0)
+    return -1;
+  send_packet (sd, ctx->present_sequence_num, ctx->present_ack_num, \
+               NORMAL, data, size);
+  ctx->present_sequence_num += size;
+  ctx->window -= size;
+  return size;
+}
+
+/* send_preack : send an unacknowledged data segment, acknowledging
+ * everything received so far.  its header is kept as first sent, so
+ * resending it only refreshes the ack number */
+static void send_preack (mysocket_t sd, context_t *ctx, \
+                         preack_packet *preack)
+{
+  if (preack->sent.len > 0)
+  {
+    stcp_network_resend (sd, &preack->sent, preack->sequence_num, \
+                         ctx->present_ack_num, preack->data, preack->size, \
+                         padding, STCP_MSS - preack->size, NULL);
+    return;
+  }
+
+  send_packet_kept (sd, preack->sequence_num, ctx->present_ack_num, \
+                    (preack->msg_start && \
+                     (ctx->features & FEATURE_MESSAGES)) ? \
+                    MSG_START : NORMAL, NULL, 0, preack->data, \
+                    preack->size, WINDOWS_SIZE, &preack->sent);
 }
 
 /* rcvd_packet : receive a packet and parsing the data in packet */
 int rcvd_packet (mysocket_t sd, tcp_seq *seq_num, tcp_seq *ack_num, \
                  packet_type *type, char *data, int *data_size)
 {
-  int size;
-  int option;
-  void *temp = calloc (1, sizeof (STCPPacket) + FULLOPTION);
-  STCPPacket *packet = (STCPPacket *) calloc (1, sizeof (STCPPacket));
-  size = stcp_network_recv (sd, temp, sizeof (STCPPacket) + FULLOPTION);
-
-  option = ((STCPPacket *) temp)->header.th_off;
-  if (option != 5)
-  {
-    memcpy (packet, temp, sizeof (STCPHeader));
-    memcpy (&packet->data_size, temp + (option * sizeof (int)), sizeof (int));
-    memcpy (&packet->data, temp + ((option + 1) * sizeof (int)), STCP_MSS);
-  }
-  else memcpy (packet, temp, sizeof (STCPPacket));
-  
-  *seq_num = ntohl (packet->header.th_seq);
-  *ack_num = ntohl (packet->header.th_ack);
-  if (packet->header.th_flags == TH_SYN) *type = SYN;
-  else if (packet->header.th_flags == (TH_SYN | TH_ACK)) *type = SYNACK;
-  else if (packet->header.th_flags == TH_ACK) *type = ACK;
-  else if (packet->header.th_flags == TH_FIN) *type = FIN;
-  else *type = NORMAL;
+  return rcvd_packet_opt (sd, seq_num, ack_num, type, data, data_size, \
+                          NULL, NULL, NULL);
+}
 
-  if (data_size != NULL) *data_size = packet->data_size;
+/* rcvd_packet_opt : rcvd_packet, also copying out the TCP options (up to
+ * FULLOPTION bytes) if opt is non-NULL, and the window if window is */
+int rcvd_packet_opt (mysocket_t sd, tcp_seq *seq_num, tcp_seq *ack_num, \
+                     packet_type *type, char *data, int *data_size, \
+                     char *opt, int *opt_len, int *window)
+{
+  stcp_packet_t *packet;
+  char *payload;
+  int size, payload_size;
 
-  if (packet->data_size != 0)
-    memcpy (data, packet->data, STCP_MSS);
+  packet = rcvd_segment (sd, &size, seq_num, ack_num, type, &payload, \
+                         &payload_size, opt, opt_len, window);
+  if (data_size != NULL) *data_size = payload_size;
 
-  else data = NULL;
-  
-  free (packet);
-  free (temp);
+  if (payload_size != 0 && data != NULL)
+    memcpy (data, payload, MIN (payload_size, STCP_MSS));
 
+  stcp_packet_release (packet);
   return size;
 }
 
-/* cal_timer : calculate the RTT and change timeout value */
-/* (stop the timer) */
-void cal_timer (mysocket_t sd, context_t *ctx)
+/* rcvd_segment : receive a packet and parse it where it is, without
+ * copying it; *data points at the data in the packet returned, which the
+ * caller releases once done with it.  the length of the datagram is put
+ * in *size, and the window advertised in *window (if it isn't NULL) */
+static stcp_packet_t *rcvd_segment (mysocket_t sd, int *size, \
+                                    tcp_seq *seq_num, tcp_seq *ack_num, \
+                                    packet_type *type, char **data, \
+                                    int *data_size, char *opt, int *opt_len, \
+                                    int *window)
 {
-  struct timeval *now;
-  time_t RTT, new_RTT;
-  now = (struct timeval *) calloc (1, sizeof (struct timeval));
-  gettimeofday (now, NULL);
- 
-  RTT = ((2 * ctx->ERTT_s * SEC + 2 * ctx->ERTT_ms * MSEC) - \
-         ((ctx->timer->tv_sec - now->tv_sec) * SEC + \
-          (ctx->timer->tv_nsec - now->tv_usec * USEC))) / 1000;
-  RTT += 100 * USEC; /* prevent unnecessary timeout */
-  our_dprintf ("RTT = %d\n", RTT);
-  
+  stcp_packet_t *packet;
+  STCPHeader *header;
+  char *segment;
+  int option, len;
+
+  len = stcp_network_recv_packet (sd, &packet, &segment);
+  *size = len;
+  header = (STCPHeader *) segment;
+
+  /* a corrupt segment is handled as if it never arrived */
+  if (len < (int) sizeof (STCPHeader) || header->th_off < 5 || \
+      header->th_off * (int) sizeof (int) > len)
+  {
+    *seq_num = *ack_num = 0;
+    *type = LOST;
+    if (window != NULL)
+      *window = -1;
+    *data = segment;
+    *data_size = 0;
+    if (opt != NULL)
+      *opt_len = 0;
+    return packet;
+  }
+
+  option = header->th_off;
+  if (opt != NULL)
+  {
+    *opt_len = (option - 5) * sizeof (int);
+    memcpy (opt, segment + sizeof (STCPHeader), *opt_len);
+  }
+
+  /* the data size follows the options, then the data */
+  *data = segment + (option + 1) * sizeof (int);
+  if (len >= (option + 1) * (int) sizeof (int))
+    memcpy (data_size, segment + option * sizeof (int), sizeof (int));
+  else
+    *data_size = 0;
+
+  *seq_num = ntohl (header->th_seq);
+  *ack_num = ntohl (header->th_ack);
+  if (window != NULL)
+    *window = ntohs (header->th_win);
+  if (header->th_flags == TH_SYN) *type = SYN;
+  else if (header->th_flags == (TH_SYN | TH_ACK)) *type = SYNACK;
+  else if (header->th_flags == TH_ACK) *type = ACK;
+  else if (header->th_flags == TH_FIN) *type = FIN;
+  else if (header->th_flags == TH_PUSH) *type = MSG_START;
+  else *type = NORMAL;
+
+  return packet;
+}
+
+/* cal_timer : calculate the RTT and change timeout value */
+/* (stop the timer) */
+void cal_timer (mysocket_t sd, context_t *ctx)
+{
+  struct timeval now;
+  time_t RTT, new_RTT;
+  gettimeofday (&now, NULL);
+ 
+  RTT = ((2 * ctx->ERTT_s * SEC + 2 * ctx->ERTT_ms * MSEC) - \
+         ((ctx->timer->tv_sec - now.tv_sec) * SEC + \
+          (ctx->timer->tv_nsec - now.tv_usec * USEC))) / 1000;
+  RTT += 100 * USEC; /* prevent unnecessary timeout */
+  our_dprintf ("RTT = %d\n", RTT);
+  
   new_RTT = (7 * ((ctx->ERTT_s * SEC + ctx->ERTT_ms * MSEC) / 1000) + RTT) / 8;
   our_dprintf ("new_RTT : %d\n", new_RTT);
 
   ctx->ERTT_s = new_RTT / (SEC / 1000) ;
   ctx->ERTT_ms = (new_RTT / (MSEC / 1000)) % 1000; 
-  free (now);
-  free (ctx->timer);
+  pool_free (&timer_pool, ctx->timer);
   ctx->timer = NULL;
 }
 
 /* set_timer : set the timer on 2 * RTT value */
+/* (no timer on the fast path, where nothing is resent) */
 void set_timer (mysocket_t sd, context_t *ctx)
 {
-  struct timeval *now;
-  struct timespec *timer;
-  now = (struct timeval *) calloc (1, sizeof (struct timeval));
-  timer = (struct timespec *) calloc (1, sizeof (struct timespec));
-  
-  ctx->timer = timer;
-  gettimeofday (now, NULL);
+  struct timeval now;
+
+  if (ctx->fast_path)
+  {
+    pool_free (&timer_pool, ctx->timer);
+    ctx->timer = NULL;
+    return;
+  }
+  if (ctx->timer == NULL)
+    ctx->timer = (struct timespec *) pool_alloc (&timer_pool);
+  gettimeofday (&now, NULL);
 
-  if ((now->tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC) >= 2 * SEC)
+  if ((now.tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC) >= 2 * SEC)
   {
-    ctx->timer->tv_sec = now->tv_sec + 2 * ctx->ERTT_s + 2;
-    ctx->timer->tv_nsec = (now->tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC) % SEC;
+    ctx->timer->tv_sec = now.tv_sec + 2 * ctx->ERTT_s + 2;
+    ctx->timer->tv_nsec = (now.tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC) % SEC;
   }
-  else if ((now->tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC) >= SEC)
+  else if ((now.tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC) >= SEC)
   {
-    ctx->timer->tv_sec = now->tv_sec + 2 * ctx->ERTT_s + 1;
-    ctx->timer->tv_nsec = (now->tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC) % SEC;
+    ctx->timer->tv_sec = now.tv_sec + 2 * ctx->ERTT_s + 1;
+    ctx->timer->tv_nsec = (now.tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC) % SEC;
   }
   else
   {
-    ctx->timer->tv_sec = now->tv_sec + 2 * ctx->ERTT_s;
-    ctx->timer->tv_nsec = now->tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC;
+    ctx->timer->tv_sec = now.tv_sec + 2 * ctx->ERTT_s;
+    ctx->timer->tv_nsec = now.tv_usec * USEC + 2 * ctx->ERTT_ms * MSEC;
   }
 }
     
   
+/* set_timer_ms : set the timer ms milliseconds from now */
+static void set_timer_ms (context_t *ctx, long ms)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  if (ctx->timer == NULL)
+    ctx->timer = (struct timespec *) pool_alloc (&timer_pool);
+  ctx->timer->tv_sec = now.tv_sec + ms / 1000;
+  ctx->timer->tv_nsec = (now.tv_usec + (ms % 1000) * 1000) * USEC;
+  if (ctx->timer->tv_nsec >= SEC)
+  {
+    ctx->timer->tv_sec++;
+    ctx->timer->tv_nsec -= SEC;
+  }
+}
+
+/* ms_until : milliseconds from now until the given time (negative once
+ * it has passed) */
+static long ms_until (const struct timeval *when)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return (when->tv_sec - now.tv_sec) * 1000 + \
+         (when->tv_usec - now.tv_usec) / 1000;
+}
+
+/* handshake_start : arm the SYN/SYN-ACK timer and the connect deadline.
+ * the first RTO is three times the peer's cached RTT (the RFC 6298 value
+ * for a single sample), or SYN_RTO_MS for a peer we haven't seen */
+static void handshake_start (mysocket_t sd, context_t *ctx)
+{
+  long timeout_ms = stcp_get_option (sd, MYSO_CONNECT_TIMEOUT);
+  long rtt_us = peer_cache_get_rtt (peer_ip (sd));
+
+  if (timeout_ms <= 0)
+    timeout_ms = CONNECT_TIMEOUT_MS;
+
+  if (rtt_us > 0)
+    ctx->syn_rto_ms = MIN (MAX (3 * rtt_us / 1000, SYN_MIN_RTO_MS), \
+                           SYN_RTO_MS);
+  else
+    ctx->syn_rto_ms = SYN_RTO_MS;
+
+  gettimeofday (&ctx->syn_time, NULL);
+  ctx->connect_deadline.tv_sec = ctx->syn_time.tv_sec + timeout_ms / 1000;
+  ctx->connect_deadline.tv_usec = ctx->syn_time.tv_usec + \
+                                  (timeout_ms % 1000) * 1000;
+  if (ctx->connect_deadline.tv_usec >= 1000000)
+  {
+    ctx->connect_deadline.tv_sec++;
+    ctx->connect_deadline.tv_usec -= 1000000;
+  }
+  set_timer_ms (ctx, MIN (ctx->syn_rto_ms, timeout_ms));
+}
+
+/* handshake_backoff : double the RTO and re-arm the timer for a SYN(ACK)
+ * retransmission, never past the connect deadline.  returns -1 if the
+ * deadline has been reached */
+static int handshake_backoff (context_t *ctx)
+{
+  long remaining = ms_until (&ctx->connect_deadline);
+
+  if (remaining <= 0)
+    return -1;
+
+  ctx->syn_retransmits++;
+  ctx->syn_rto_ms = MIN (2 * ctx->syn_rto_ms, SYN_MAX_RTO_MS);
+  set_timer_ms (ctx, MIN (ctx->syn_rto_ms, remaining));
+  return 0;
+}
+
+/* handshake_done : the peer answered our SYN(ACK).  unless it had to be
+ * resent (Karn), remember the round trip for the next connection */
+static void handshake_done (mysocket_t sd, context_t *ctx)
+{
+  struct timeval now;
+
+  if (ctx->syn_retransmits > 0)
+    return;
+  gettimeofday (&now, NULL);
+  peer_cache_put_rtt (peer_ip (sd), \
+                      (now.tv_sec - ctx->syn_time.tv_sec) * 1000000 + \
+                      (now.tv_usec - ctx->syn_time.tv_usec));
+}
+
+/* process_ack : drop acknowledged packets from the retransmission list and
+ * move the window.  window is the one the ACK advertised (-1 if unknown) */
+static void process_ack (mysocket_t sd, context_t *ctx, tcp_seq ack_num, \
+                         int window)
+{
+  preack_packet *preack, *preack_temp;
+
+  /* a peer with no room is alive, and is resent to until it has some */
+  if (window >= 0)
+    ctx->peer_full = (window == 0);
+
+  /* a duplicate ACK means a segment was lost (for the FEC loss rate) */
+  if (ctx->preack != NULL && ack_num == ctx->preack->sequence_num && \
+      ack_num != ctx->fec_dup_ack)
+  {
+    ctx->fec_losses++;
+    ctx->fec_dup_ack = ack_num;
+  }
+
+  if (ctx->preack != NULL && ack_num > ctx->preack->sequence_num)
+  {
+    if (ctx->timer != NULL)   /* (none on the fast path) */
+      cal_timer (sd, ctx);
+    ctx->timeouts = 0;
+    preack_temp = ctx->preack;
+    while (preack_temp != NULL)
+    {
+      if (preack_temp->sequence_num < ack_num)
+      {
+        preack = preack_temp;
+        preack_temp = preack_temp->next;
+        ctx->preack = preack_temp;
+        pool_free (&preack_pool, preack);
+      }
+      else break;
+    }
+  }
+
+  if (ctx->fast_path)
+  {
+    /* only the window moves; there is nothing to resend */
+    if (ack_num > ctx->snd_una)   /* (the ACK of a FIN is one past) */
+      ctx->snd_una = MIN (ack_num, ctx->present_sequence_num);
+    ctx->window = FASTPATH_WINDOW - \
+                  (ctx->present_sequence_num - ctx->snd_una);
+  }
+  else if (ctx->preack == NULL) ctx->window = WINDOWS_SIZE;
+  else
+  {
+    ctx->window = WINDOWS_SIZE -\
+                  (ctx->present_sequence_num -\
+                   ctx->preack->sequence_num);
+    set_timer (sd, ctx);
+  }
+  our_dprintf ("ctx->window = %d\n", ctx->window);
+  assert (ctx->window <= (ctx->fast_path ? FASTPATH_WINDOW : WINDOWS_SIZE));
+
+  /* the peer has taken our forward skip */
+  if (ctx->skip_seq != 0 && ack_num >= ctx->skip_seq)
+  {
+    ctx->skip_seq = 0;
+    ctx->timeouts = 0;
+    if (ctx->preack == NULL)
+    {
+      pool_free (&timer_pool, ctx->timer);
+      ctx->timer = NULL;
+    }
+  }
+
+  /* our FIN is resent until it is acknowledged */
+  if (ctx->timer == NULL && ack_num <= ctx->present_sequence_num && \
+      (ctx->connection_state == CSTATE_FIN_WAIT_1 || \
+       ctx->connection_state == CSTATE_LAST_ACK))
+    set_timer (sd, ctx);
+}
+
+/* retransmit_preack : resend every packet not acknowledged yet */
+static void retransmit_preack (mysocket_t sd, context_t *ctx)
+{
+  preack_packet *preack_temp = ctx->preack;
+
+  while (preack_temp != NULL)
+  {
+    send_preack (sd, ctx, preack_temp);
+    preack_temp = preack_temp->next;
+  }
+}
+
+/* set_deadline : with a lifetime (MYSO_LIFETIME) the peer agreed to, a new
+ * segment is given up on that long after it is first sent; the segments
+ * of a message share the deadline of its first one */
+static void set_deadline (mysocket_t sd, context_t *ctx, \
+                          preack_packet *preack)
+{
+  int lifetime = stcp_get_option (sd, MYSO_LIFETIME);
+  struct timeval now, span;
+
+  if (lifetime <= 0 || !(ctx->features & FEATURE_PARTIAL))
+    return;
+
+  if (preack->msg_start)
+  {
+    gettimeofday (&now, NULL);
+    span.tv_sec = lifetime / 1000;
+    span.tv_usec = (lifetime % 1000) * 1000;
+    timeradd (&now, &span, &ctx->msg_deadline);
+  }
+  preack->deadline = ctx->msg_deadline;
+}
+
+/* abandon_expired : give up on the oldest unacknowledged segments once
+ * their deadline has passed, up to the start of a message, and have the
+ * peer skip them (a forward skip is sent with every retransmission until
+ * it is acknowledged).  returns 1 if anything was given up on */
+static int abandon_expired (mysocket_t sd, context_t *ctx)
+{
+  preack_packet *preack, *cut = NULL;
+  struct timeval now;
+  stream_header header;
+  tcp_seq skip_to;
+  uint32_t end;
+  int stream;
+
+  if (ctx->preack == NULL || ctx->preack->deadline.tv_sec == 0)
+    return 0;
+
+  gettimeofday (&now, NULL);
+  for (preack = ctx->preack; preack != NULL; preack = preack->next)
+  {
+    if (preack->msg_start)
+      cut = preack;
+    if (preack->deadline.tv_sec == 0 || \
+        timercmp (&now, &preack->deadline, <))
+      break;
+  }
+
+  if (ctx->preack != NULL && preack == NULL && !ctx->msg_open)
+    skip_to = ctx->present_sequence_num;
+  else if (cut != NULL && cut != ctx->preack)
+    skip_to = cut->sequence_num;
+  else
+    return 0;
+
+  while ((preack = ctx->preack) != NULL && preack->sequence_num < skip_to)
+  {
+    if (ctx->num_streams > 0)
+    {
+      memcpy (&header, preack->data, STREAM_HDR_LEN);
+      stream = ntohs (header.stream);
+      end = ntohl (header.offset) + preack->size - STREAM_HDR_LEN;
+      if (end > ctx->skip_offset[stream])
+        ctx->skip_offset[stream] = end;
+    }
+    ctx->preack = preack->next;
+    pool_free (&preack_pool, preack);
+  }
+  ctx->skip_seq = skip_to;
+
+  if (ctx->preack == NULL) ctx->window = WINDOWS_SIZE;
+  else
+    ctx->window = WINDOWS_SIZE -\
+                  (ctx->present_sequence_num -\
+                   ctx->preack->sequence_num);
+  return 1;
+}
+
+/* send_skip : tell the peer to skip ahead to skip_seq (much like an SCTP
+ * FORWARD TSN), carrying each stream's offset at that point */
+static void send_skip (mysocket_t sd, context_t *ctx)
+{
+  char opt[2] = { TCPOPT_SKIP, 2 };
+  uint32_t offsets[MYSOCK_MAX_STREAMS];
+  int k;
+
+  for (k = 0; k < ctx->num_streams; k++)
+    offsets[k] = htonl (ctx->skip_offset[k]);
+  send_packet_opt (sd, ctx->skip_seq, ctx->present_ack_num, NORMAL, \
+                   opt, 2, (char *) offsets, ctx->num_streams * 4);
+}
+
+/* fec_add : add a new data segment to the parity group.  the parity goes
+ * out once the group is full or the window is (nothing more will be sent
+ * for a while).  every FEC_PERIOD segments the group size is set so that
+ * a group and its parity see about a quarter of a loss on average */
+static void fec_add (mysocket_t sd, context_t *ctx, tcp_seq seq_num, \
+                     const char *data, int size)
+{
+  int k;
+
+  if (!(ctx->features & FEATURE_FEC))
+    return;
+
+  if (ctx->fec_count == 0)
+    ctx->fec_start = seq_num;
+  for (k = 0; k < size; k++)
+    ctx->fec_parity[k] ^= data[k];
+  ctx->fec_len = MAX (ctx->fec_len, size);
+  ctx->fec_count++;
+
+  if (ctx->fec_count >= ctx->fec_group || \
+      ctx->window <= frame_overhead (ctx))
+    fec_flush (sd, ctx);
+
+  if (++ctx->fec_sent >= FEC_PERIOD)
+  {
+    if (ctx->fec_losses == 0)
+      ctx->fec_group = FEC_MAX_GROUP;
+    else
+      ctx->fec_group = MIN (MAX (ctx->fec_sent / (4 * ctx->fec_losses) - 1, \
+                                 FEC_MIN_GROUP), FEC_MAX_GROUP);
+#ifdef DEBUG
+    our_dprintf ("FEC: %d losses in %d segments, group %d\n", \
+                 ctx->fec_losses, ctx->fec_sent, ctx->fec_group);
+#endif
+    ctx->fec_sent = 0;
+    ctx->fec_losses = 0;
+  }
+}
+
+/* fec_flush : send the parity of the current group, if it has any data.
+ * the option gives the number of segments and where the group ends */
+static void fec_flush (mysocket_t sd, context_t *ctx)
+{
+  char opt[8];
+  tcp_seq end = htonl (ctx->present_sequence_num);
+
+  if (ctx->fec_count == 0)
+    return;
+
+  opt[0] = TCPOPT_PARITY;
+  opt[1] = 8;
+  opt[2] = ctx->fec_count;
+  opt[3] = 0;
+  memcpy (opt + 4, &end, 4);
+  send_packet_opt (sd, ctx->fec_start, ctx->present_ack_num, NORMAL, \
+                   opt, 8, ctx->fec_parity, ctx->fec_len);
+
+  memset (ctx->fec_parity, 0, ctx->fec_len);
+  ctx->fec_len = 0;
+  ctx->fec_count = 0;
+}
+
+/* fec_remember : keep a copy of a segment received, in case a parity
+ * segment needs it to rebuild another one */
+static void fec_remember (context_t *ctx, tcp_seq seq_num, \
+                          const char *data, int size)
+{
+  save_packet *save, **link;
+  int n = 0;
+
+  if (!(ctx->features & FEATURE_FEC) || size <= 0)
+    return;
+
+  for (save = ctx->fec_history; save != NULL; save = save->next)
+    if (save->start == seq_num)
+      return;
+
+  save = (save_packet *) pool_zalloc (&save_pool);
+  save->start = seq_num;
+  save->end = seq_num + size;
+  memcpy (save->data, data, size);
+  save->next = ctx->fec_history;
+  ctx->fec_history = save;
+
+  for (link = &ctx->fec_history; *link != NULL; link = &(*link)->next)
+  {
+    if (++n == FEC_HISTORY)   /* forget the oldest */
+    {
+      pool_free (&save_pool, (*link)->next);
+      (*link)->next = NULL;
+      break;
+    }
+  }
+}
+
+/* receive_parity : a parity segment for the group of segments from start
+ * up to the end in its option.  if exactly one of them is missing, and we
+ * still have all the others, it is rebuilt and taken as if it had come */
+static void receive_parity (mysocket_t sd, context_t *ctx, tcp_seq start, \
+                            const char *opt, int len, char *data, int size)
+{
+  save_packet *save, *next;
+  tcp_seq at, end, hole = 0, hole_end = 0;
+  int count, known = 0, holes = 0, k;
+
+  if (len != 8 || !(ctx->features & FEATURE_FEC))
+    return;
+  count = (unsigned char) opt[2];
+  memcpy (&end, opt + 4, 4);
+  end = ntohl (end);
+  if (end <= ctx->present_ack_num)
+    return;   /* nothing lost */
+
+  for (at = start; at < end; )
+  {
+    next = NULL;
+    for (save = ctx->fec_history; save != NULL; save = save->next)
+    {
+      if (save->start == at)
+        break;
+      if (save->start > at && save->start < end && \
+          (next == NULL || save->start < next->start))
+        next = save;
+    }
+
+    if (save != NULL)
+    {
+      for (k = 0; k < (int) (save->end - save->start); k++)
+        data[k] ^= save->data[k];
+      known++;
+      at = save->end;
+    }
+    else
+    {
+      hole = at;
+      hole_end = (next != NULL) ? next->start : end;
+      holes++;
+      at = hole_end;
+    }
+  }
+
+  if (holes != 1 || known != count - 1 || (int) (hole_end - hole) > size)
+    return;
+#ifdef DEBUG
+  our_dprintf ("FEC: rebuilt %d bytes at %u\n", hole_end - hole, hole);
+#endif
+  receive_data (sd, ctx, hole, data, hole_end - hole, 0);
+}
+
+/* receive_data : handle the data in a segment from the peer.  in-sequence
+ * data goes up to the app along with any buffered data it makes
+ * contiguous; data beyond a gap is kept (sorted) until the gap is filled.
+ * either way the peer gets an ACK for everything received in order.
+ * msg_start is set if the segment starts a message */
+static void receive_data (mysocket_t sd, context_t *ctx, tcp_seq seq_num, \
+                          char *data, int size, int msg_start)
+{
+  save_packet *save, **link;
+  int held = (seq_num == ctx->present_ack_num && \
+              !app_fits (sd, ctx, data, size));
+
+  if (seq_num >= ctx->present_ack_num)
+    fec_remember (ctx, seq_num, data, size);
+
+  /* Buffer out of order, or in order with no room for it in the app's
+   * queue yet (nothing is resent on the fast path, so all the peer can
+   * send is kept) */
+  if (seq_num > ctx->present_ack_num || held)
+  {
+    if (held)
+      ctx->rcv_full = 1;
+    if (seq_num + size <= ctx->present_ack_num + \
+        (ctx->fast_path ? FASTPATH_WINDOW : WINDOWS_SIZE))
+    {
+      link = &ctx->save;
+      while (*link != NULL && (*link)->start < seq_num)
+        link = &(*link)->next;
+
+      if (*link == NULL || (*link)->start != seq_num)
+      {
+        save = (save_packet *) pool_zalloc (&save_pool);
+        save->start = seq_num;
+        save->end = seq_num + size;
+        memcpy (save->data, data, size);
+        save->msg_start = msg_start;
+        save->next = *link;
+        *link = save;
+
+        /* its stream need not wait for the gap */
+        if (ctx->num_streams > 0 && app_fits (sd, ctx, save->data, size))
+        {
+          int stream = stream_deliver (sd, ctx, save->data, size);
+          if (stream >= 0)
+            stream_deliver_saved (sd, ctx, stream);
+        }
+      }
+    }
+  }
+
+  else if (seq_num == ctx->present_ack_num)  /* Naturally Data arrive */
+  {
+    ctx->rcv_full = 0;
+    ctx->present_ack_num = seq_num + size;
+    deliver_segment (sd, ctx, data, size);
+    deliver_contiguous (sd, ctx);
+  }
+
+  /* (anything else is Duplicate Data) */
+  send_ack (sd, ctx);
+}
+
+/* deliver_contiguous : pass up buffered data that is now in sequence, as
+ * far as the app has room for it */
+static void deliver_contiguous (mysocket_t sd, context_t *ctx)
+{
+  save_packet *save;
+
+  while ((save = ctx->save) != NULL && \
+         save->start <= ctx->present_ack_num)
+  {
+    if (save->start == ctx->present_ack_num)
+    {
+      if (!app_fits (sd, ctx, save->data, save->end - save->start))
+      {
+        ctx->rcv_full = 1;
+        return;
+      }
+      ctx->present_ack_num = save->end;
+      deliver_segment (sd, ctx, save->data, save->end - save->start);
+    }
+    ctx->save = save->next;
+    pool_free (&save_pool, save);
+  }
+}
+
+/* receive_skip : the peer gave up on the data before skip_to (it has a
+ * lifetime, see MYSO_LIFETIME).  whatever of it did arrive is passed up
+ * without waiting for the holes, except in message mode, where only whole
+ * messages are, and a message with a piece missing is dropped.  data
+ * carries each stream's offset at skip_to.  the skip is acknowledged like
+ * data */
+static void receive_skip (mysocket_t sd, context_t *ctx, tcp_seq skip_to, \
+                          char *data, int size)
+{
+  save_packet *save, *last;
+  stream_header header;
+  uint32_t offset;
+  int k, stream, whole;
+
+  if (skip_to > ctx->present_ack_num && (ctx->features & FEATURE_PARTIAL))
+  {
+    /* a message cut short by the skip will never be finished (skip_to
+     * starts a message, so none goes on past it).  a stream passed up
+     * beyond its offset at skip_to, ahead of the hole, is partway through
+     * a message that began after it */
+    for (k = 0; k < MYSOCK_MAX_STREAMS; k++)
+    {
+      if (k < ctx->num_streams && (k + 1) * 4 <= size)
+      {
+        memcpy (&offset, data + k * 4, 4);
+        if (ctx->stream_rcv_next[k] > ntohl (offset))
+          continue;
+      }
+      free (ctx->msg_in[k].buf);
+      ctx->msg_in[k].buf = NULL;
+      ctx->msg_in[k].hdr_got = 0;
+    }
+
+    last = NULL;
+    while ((save = ctx->save) != NULL && save->start < skip_to)
+    {
+      /* (what the app has no room for is dropped with the rest) */
+      if ((ctx->features & FEATURE_MESSAGES) && last == NULL)
+        last = message_end (sd, ctx, save, skip_to);
+      whole = (ctx->features & FEATURE_MESSAGES) ? last != NULL : \
+              app_fits (sd, ctx, save->data, save->end - save->start);
+
+      if (ctx->num_streams == 0 && whole)
+        app_deliver (sd, ctx, 0, save->data, save->end - save->start);
+      else if (ctx->num_streams > 0 && whole && \
+               save->end - save->start > STREAM_HDR_LEN)
+      {
+        /* jump its stream over the hole before it */
+        memcpy (&header, save->data, STREAM_HDR_LEN);
+        stream = ntohs (header.stream);
+        offset = ntohl (header.offset);
+        if (stream < ctx->num_streams && \
+            offset > ctx->stream_rcv_next[stream])
+          ctx->stream_rcv_next[stream] = offset;
+        stream_deliver (sd, ctx, save->data, save->end - save->start);
+      }
+      if (save == last)
+        last = NULL;
+      ctx->save = save->next;
+      pool_free (&save_pool, save);
+    }
+    ctx->present_ack_num = skip_to;
+
+    for (k = 0; k < ctx->num_streams && (k + 1) * 4 <= size; k++)
+    {
+      memcpy (&offset, data + k * 4, 4);
+      offset = ntohl (offset);
+      if (offset > ctx->stream_rcv_next[k])
+        ctx->stream_rcv_next[k] = offset;
+    }
+
+    deliver_contiguous (sd, ctx);
+    for (k = 0; k < ctx->num_streams; k++)
+      stream_deliver_saved (sd, ctx, k);
+  }
+
+  send_ack (sd, ctx);
+}
+
+/* message_end : in message mode, if the saved segments from save on (all
+ * before skip_to) hold a whole message, starting at save and with nothing
+ * missing, that the app has room for, return the last of them; NULL
+ * otherwise */
+static save_packet *message_end (mysocket_t sd, context_t *ctx, \
+                                 save_packet *save, tcp_seq skip_to)
+{
+  int hdr_len = (ctx->num_streams > 0) ? STREAM_HDR_LEN : 0;
+  save_packet *last, *prev = NULL;
+  stream_header header;
+  uint32_t len, got = 0;
+  int stream = 0;
+
+  if (!save->msg_start || \
+      (int) (save->end - save->start) < hdr_len + MSG_HDR_LEN)
+    return NULL;
+  if (hdr_len > 0)
+  {
+    memcpy (&header, save->data, STREAM_HDR_LEN);
+    if ((stream = ntohs (header.stream)) >= ctx->num_streams)
+      return NULL;
+  }
+  memcpy (&len, save->data + hdr_len, MSG_HDR_LEN);
+  len = ntohl (len);
+  if (len > MYSOCK_MAX_MESSAGE || stcp_app_room (sd, stream, 1) < len)
+    return NULL;
+  len += MSG_HDR_LEN;
+
+  for (last = save; last != NULL && last->end <= skip_to; last = last->next)
+  {
+    if (prev != NULL && (last->msg_start || last->start != prev->end))
+      return NULL;
+    got += last->end - last->start - hdr_len;
+    if (got >= len)
+      return (got == len) ? last : NULL;
+    prev = last;
+  }
+  return NULL;
+}
+
+/* app_fits : whether the app has room for what the data of a segment
+ * (with its stream header) would pass up to it now.  a segment can finish
+ * a message or a compressed block begun in earlier ones, so that is
+ * counted too, and each message or block is a write */
+static int app_fits (mysocket_t sd, context_t *ctx, const char *data, \
+                     int size)
+{
+  stream_header header;
+  int stream = 0, bytes, writes = 1;
+
+  if (ctx->num_streams > 0)
+  {
+    if (size <= STREAM_HDR_LEN)
+      return 1;
+    memcpy (&header, data, STREAM_HDR_LEN);
+    stream = ntohs (header.stream);
+    if (stream >= ctx->num_streams || \
+        ntohl (header.offset) != ctx->stream_rcv_next[stream])
+      return 1;   /* (not passed up now) */
+    data += STREAM_HDR_LEN;
+    size -= STREAM_HDR_LEN;
+  }
+
+  bytes = size;
+  if (ctx->features & FEATURE_COMPRESS)
+    bytes = inflated_size (ctx, stream, data, size, &writes);
+  if (ctx->features & FEATURE_MESSAGES)
+  {
+    writes = bytes / MSG_HDR_LEN + 1;
+    bytes += ctx->msg_in[stream].got;
+  }
+  return stcp_app_room (sd, stream, writes) >= (size_t) bytes;
+}
+
+/* inflated_size : how many bytes the compressed blocks of a stream that
+ * the next size bytes of it finish stand for, and in *blocks, how many
+ * blocks that is.  (inflate_deliver checks the block headers.) */
+static int inflated_size (context_t *ctx, int stream, const char *data, \
+                          int size, int *blocks)
+{
+  msg_assembly *block = &ctx->block_in[stream];
+  char hdr[BLOCK_HDR_LEN];
+  uint16_t lens[2];
+  int hdr_got = block->hdr_got, n, raw = 0;
+  uint32_t left = block->len - block->got;
+
+  memcpy (hdr, block->hdr, BLOCK_HDR_LEN);
+  *blocks = 0;
+  while (size > 0)
+  {
+    if (hdr_got < BLOCK_HDR_LEN)
+    {
+      n = MIN (size, BLOCK_HDR_LEN - hdr_got);
+      memcpy (hdr + hdr_got, data, n);
+      hdr_got += n;
+      data += n;
+      size -= n;
+      if (hdr_got < BLOCK_HDR_LEN)
+        break;
+      memcpy (lens, hdr, BLOCK_HDR_LEN);
+      left = ntohs (lens[1]);
+    }
+
+    n = MIN ((uint32_t) size, left);
+    left -= n;
+    data += n;
+    size -= n;
+    if (left == 0)
+    {
+      memcpy (lens, hdr, BLOCK_HDR_LEN);
+      raw += ntohs (lens[0]);
+      (*blocks)++;
+      hdr_got = 0;
+    }
+  }
+  return raw;
+}
+
+/* receive_fin : ACK a FIN with sequence number fin_seq.  returns 1 if it
+ * is new and everything before it has arrived; a FIN that overtook data
+ * gets a duplicate ACK and is taken when the peer resends it */
+static int receive_fin (mysocket_t sd, context_t *ctx, tcp_seq fin_seq)
+{
+  int in_order = (fin_seq == ctx->present_ack_num);
+
+  if (in_order)
+    ctx->present_ack_num++;
+  send_ack (sd, ctx);
+  return in_order;
+}
+
+/* deliver_segment : pass the data of an in-sequence segment up to the app.
+ * a stream chunk already delivered ahead of a gap is not passed up again */
+static void deliver_segment (mysocket_t sd, context_t *ctx, char *data, \
+                             int size)
+{
+  int stream;
+
+  if (ctx->num_streams == 0)
+  {
+    app_deliver (sd, ctx, 0, data, size);
+    return;
+  }
+
+  if ((stream = stream_deliver (sd, ctx, data, size)) >= 0)
+    stream_deliver_saved (sd, ctx, stream);
+}
+
+/* stream_deliver : pass a stream chunk up to the app if it is the next data
+ * on its stream.  returns the stream, or -1 if nothing was delivered */
+static int stream_deliver (mysocket_t sd, context_t *ctx, char *data, \
+                           int size)
+{
+  stream_header header;
+  int stream;
+
+  if (size <= STREAM_HDR_LEN)
+    return -1;
+  memcpy (&header, data, STREAM_HDR_LEN);
+  stream = ntohs (header.stream);
+  if (stream >= ctx->num_streams || \
+      ntohl (header.offset) != ctx->stream_rcv_next[stream])
+    return -1;
+
+  app_deliver (sd, ctx, stream, data + STREAM_HDR_LEN, \
+               size - STREAM_HDR_LEN);
+  ctx->stream_rcv_next[stream] += size - STREAM_HDR_LEN;
+  return stream;
+}
+
+/* stream_deliver_saved : pass up buffered chunks of a stream that follow
+ * what it has delivered so far */
+static void stream_deliver_saved (mysocket_t sd, context_t *ctx, int stream)
+{
+  save_packet *save = ctx->save;
+
+  while (save != NULL)
+  {
+    if (app_fits (sd, ctx, save->data, save->end - save->start) && \
+        stream_deliver (sd, ctx, save->data, save->end - save->start) \
+        == stream)
+      save = ctx->save;   /* may have made an earlier chunk next */
+    else
+      save = save->next;
+  }
+}
+
+/* app_deliver : pass data of a stream up to the app */
+static void app_deliver (mysocket_t sd, context_t *ctx, int stream, \
+                         const char *data, int size)
+{
+  if (ctx->done)    /* (dropped for a bad frame) */
+    return;
+
+  if (ctx->features & FEATURE_COMPRESS)
+    inflate_deliver (sd, ctx, stream, data, size);
+  else
+    message_deliver (sd, ctx, stream, data, size);
+}
+
+/* inflate_deliver : collect the compressed blocks of a stream, and pass
+ * each one on decompressed */
+static void inflate_deliver (mysocket_t sd, context_t *ctx, int stream, \
+                             const char *data, int size)
+{
+  msg_assembly *block = &ctx->block_in[stream];
+  char raw[LZ_MAX_BLOCK];
+  uint16_t lens[2];
+  int n, raw_len;
+
+  while (size > 0)
+  {
+    if (block->hdr_got < BLOCK_HDR_LEN)
+    {
+      n = MIN (size, BLOCK_HDR_LEN - block->hdr_got);
+      memcpy (block->hdr + block->hdr_got, data, n);
+      block->hdr_got += n;
+      data += n;
+      size -= n;
+      if (block->hdr_got < BLOCK_HDR_LEN)
+        break;
+
+      /* the sender never makes a block of more than LZ_MAX_BLOCK bytes,
+       * nor codes one in more bytes than it stands for */
+      memcpy (lens, block->hdr, BLOCK_HDR_LEN);
+      block->len = ntohs (lens[1]);
+      block->got = 0;
+      if (ntohs (lens[0]) > LZ_MAX_BLOCK || block->len > ntohs (lens[0]))
+      {
+        drop_connection (ctx, EPROTO, "bad compressed block", stream);
+        return;
+      }
+      if ((block->buf = (char *) malloc (MAX (block->len, 1))) == NULL)
+      {
+        drop_connection (ctx, ENOMEM, "no memory for a block", stream);
+        return;
+      }
+    }
+
+    n = MIN ((uint32_t) size, block->len - block->got);
+    memcpy (block->buf + block->got, data, n);
+    block->got += n;
+    data += n;
+    size -= n;
+
+    if (block->got == block->len)
+    {
+      memcpy (lens, block->hdr, BLOCK_HDR_LEN);
+      raw_len = ntohs (lens[0]);
+      if ((uint32_t) raw_len == block->len)   /* stored */
+      {
+        lz_store (&ctx->lz_in[stream], block->buf, raw_len);
+        message_deliver (sd, ctx, stream, block->buf, raw_len);
+      }
+      else if (lz_decompress (&ctx->lz_in[stream], block->buf, block->len, \
+                              raw, raw_len) == 0)
+        message_deliver (sd, ctx, stream, raw, raw_len);
+      else  /* the history is out of step from here on */
+        drop_connection (ctx, EPROTO, "corrupt compressed block", stream);
+
+      free (block->buf);
+      block->buf = NULL;
+      block->hdr_got = 0;
+      if (ctx->done)
+        return;
+    }
+  }
+}
+
+/* message_deliver : pass data of a stream up to the app.  in message mode,
+ * it is collected until a whole message (length header first) is there */
+static void message_deliver (mysocket_t sd, context_t *ctx, int stream, \
+                             const char *data, int size)
+{
+  msg_assembly *msg = &ctx->msg_in[stream];
+  uint32_t len;
+  int n;
+
+  if (!(ctx->features & FEATURE_MESSAGES))
+  {
+    stcp_app_send_packet (sd, stream, ctx->rx_packet, data, size);
+    return;
+  }
+
+  while (size > 0)
+  {
+    if (msg->hdr_got < MSG_HDR_LEN)
+    {
+      n = MIN (size, MSG_HDR_LEN - msg->hdr_got);
+      memcpy (msg->hdr + msg->hdr_got, data, n);
+      msg->hdr_got += n;
+      data += n;
+      size -= n;
+      if (msg->hdr_got < MSG_HDR_LEN)
+        break;
+
+      /* the sender never frames a longer message, so the length is
+       * corrupt */
+      memcpy (&len, msg->hdr, MSG_HDR_LEN);
+      msg->len = ntohl (len);
+      msg->got = 0;
+      if (msg->len > MYSOCK_MAX_MESSAGE)
+      {
+        drop_connection (ctx, EPROTO, "message too long", stream);
+        return;
+      }
+      if ((msg->buf = (char *) malloc (MAX (msg->len, 1))) == NULL)
+      {
+        drop_connection (ctx, ENOMEM, "no memory for a message", stream);
+        return;
+      }
+    }
+
+    n = MIN ((uint32_t) size, msg->len - msg->got);
+    memcpy (msg->buf + msg->got, data, n);
+    msg->got += n;
+    data += n;
+    size -= n;
+
+    if (msg->got == msg->len)
+    {
+      stcp_app_send_stream (sd, stream, msg->buf, msg->len);
+      free (msg->buf);
+      msg->buf = NULL;
+      msg->hdr_got = 0;
+    }
+  }
+}
+
+/* drop_connection : give up on a connection whose peer sent a stream
+ * that can't be taken apart (error is what it failed with); the app sees
+ * the end of the data, as when the peer stops answering */
+static void drop_connection (context_t *ctx, int error, const char *why, \
+                             int stream)
+{
+  our_dprintf ("%s on stream %d; dropping the connection\n", why, stream);
+  ctx->iserror = error;
+  ctx->done = TRUE;
+}
+
+/* frame_overhead : bytes of headers the next segment of app data needs */
+static int frame_overhead (context_t *ctx)
+{
+  int len = 0;
+
+  if (ctx->num_streams > 0)
+    len += STREAM_HDR_LEN;
+  if ((ctx->features & FEATURE_MESSAGES) && !ctx->msg_open && \
+      !(ctx->features & FEATURE_COMPRESS))
+    len += MSG_HDR_LEN;
+  return len;
+}
+
+/* frame_app_data : take data the app wrote and frame it as the payload of
+ * a segment of at most max_len bytes, with a stream header if there are
+ * streams.  returns the payload size, or -1 if the data was written
+ * (before myconnect()) to a stream the peer didn't agree to; that data is
+ * dropped */
+static int frame_app_data (mysocket_t sd, context_t *ctx, char *data, \
+                           int max_len)
+{
+  int hdr_len = (ctx->num_streams > 0) ? STREAM_HDR_LEN : 0;
+  int stream, size;
+  stream_header header;
+
+  if (ctx->features & FEATURE_COMPRESS)
+    size = frame_compressed (sd, ctx, &stream, data + hdr_len, \
+                             max_len - hdr_len);
+  else
+    size = frame_messages (sd, ctx, &stream, data + hdr_len, \
+                           max_len - hdr_len);
+  if (size < 0)
+    return -1;
+
+  if (ctx->num_streams > 0)
+  {
+    if (stream >= ctx->num_streams)
+      return -1;
+    header.stream = htons (stream);
+    header.flags = 0;
+    header.offset = htonl (ctx->stream_snd_next[stream]);
+    memcpy (data, &header, STREAM_HDR_LEN);
+    ctx->stream_snd_next[stream] += size;
+  }
+  return hdr_len + size;
+}
+
+/* frame_messages : take up to max_len bytes of data the app wrote, in
+ * message mode with a length header before the start of each message.
+ * returns the size, and the stream the data is for */
+static int frame_messages (mysocket_t sd, context_t *ctx, int *stream, \
+                           char *data, int max_len)
+{
+  int hdr_len = 0, size;
+  size_t left;
+  uint32_t len;
+
+  if (ctx->num_streams == 0 && !(ctx->features & FEATURE_MESSAGES))
+  {
+    *stream = 0;
+    return stcp_app_recv (sd, data, max_len);
+  }
+
+  if ((ctx->features & FEATURE_MESSAGES) && !ctx->msg_open)
+    hdr_len = MSG_HDR_LEN;
+  size = stcp_app_recv_stream (sd, stream, &left, data + hdr_len, \
+                               max_len - hdr_len);
+  if (ctx->features & FEATURE_MESSAGES)
+  {
+    if (!ctx->msg_open)
+    {
+      len = htonl (size + left);
+      memcpy (data, &len, MSG_HDR_LEN);
+    }
+    ctx->msg_open = (left > 0);
+  }
+  return hdr_len + size;
+}
+
+/* frame_compressed : like frame_messages, but the data is the next piece
+ * of a compressed block.  once a block is all sent, the next one is made
+ * from as much data (framed by frame_messages) as the app has queued for
+ * a stream, up to LZ_MAX_BLOCK bytes */
+static int frame_compressed (mysocket_t sd, context_t *ctx, int *stream, \
+                             char *data, int max_len)
+{
+  char raw[LZ_MAX_BLOCK];
+  uint16_t lens[2];
+  int raw_len, coded, size;
+
+  if (ctx->block_sent == ctx->block_len)
+  {
+    raw_len = frame_messages (sd, ctx, stream, raw, LZ_MAX_BLOCK);
+    if (*stream >= MAX (ctx->num_streams, 1))
+      return -1;
+
+    coded = lz_compress (&ctx->lz_out[*stream], raw, raw_len, \
+                         ctx->block + BLOCK_HDR_LEN, raw_len - 1);
+    if (coded < 0)  /* doesn't compress */
+    {
+      memcpy (ctx->block + BLOCK_HDR_LEN, raw, raw_len);
+      coded = raw_len;
+    }
+    lens[0] = htons (raw_len);
+    lens[1] = htons (coded);
+    memcpy (ctx->block, lens, BLOCK_HDR_LEN);
+    ctx->block_len = BLOCK_HDR_LEN + coded;
+    ctx->block_sent = 0;
+    ctx->block_stream = *stream;
+  }
+
+  *stream = ctx->block_stream;
+  size = MIN (max_len, ctx->block_len - ctx->block_sent);
+  memcpy (data, ctx->block + ctx->block_sent, size);
+  ctx->block_sent += size;
+  return size;
+}
+
+/* request_features : the features and streams the app asked for */
+static void request_features (mysocket_t sd, context_t *ctx)
+{
+  int streams = stcp_get_option (sd, MYSO_STREAMS);
+
+  ctx->features = FEATURE_PARTIAL;    /* we can always take skips */
+  if (stcp_get_option (sd, MYSO_MESSAGES))
+    ctx->features |= FEATURE_MESSAGES;
+  if (stcp_get_option (sd, MYSO_FEC))
+    ctx->features |= FEATURE_FEC;
+  /* skipped data would leave the compression histories out of step */
+  if (stcp_get_option (sd, MYSO_COMPRESS) && \
+      stcp_get_option (sd, MYSO_LIFETIME) <= 0)
+    ctx->features |= FEATURE_COMPRESS;
+  if (stcp_get_option (sd, MYSO_CRC32C))
+    ctx->features |= FEATURE_CRC32C;
+  if (stcp_get_option (sd, MYSO_FASTPATH) && stcp_network_is_reliable (sd))
+    ctx->features |= FEATURE_FASTPATH;
+  ctx->num_streams = (streams > 1) ? streams : 0;
+}
+
+/* negotiate_features : settle the features and number of streams from the
+ * peer's SYN or SYN-ACK (what both ends asked for), and let the app see
+ * them.  returns 1 if the connection has everything the peer asked for */
+static int negotiate_features (mysocket_t sd, context_t *ctx, \
+                               const char *opt, int opt_len)
+{
+  const char *stcp_opt;
+  int len, peer_features = 0, peer_streams = 0, agreed;
+
+  stcp_opt = find_option (opt, opt_len, TCPOPT_STCP, &len);
+  if (stcp_opt != NULL && len == 4)
+  {
+    peer_features = (unsigned char) stcp_opt[2];
+    peer_streams = (unsigned char) stcp_opt[3];
+    if (peer_streams < 2)
+      peer_streams = 0;
+  }
+
+  request_features (sd, ctx);
+  ctx->features &= peer_features;
+  ctx->num_streams = MIN (ctx->num_streams, peer_streams);
+  agreed = (ctx->features == peer_features && \
+            ctx->num_streams == peer_streams);
+
+  /* on the fast path nothing is lost or corrupted, so there is no use for
+   * parity segments or a CRC (dropping them changes nothing the peer
+   * sends) */
+  ctx->fast_path = (ctx->features & FEATURE_FASTPATH) != 0;
+  if (ctx->fast_path)
+  {
+    ctx->features &= ~(FEATURE_FEC | FEATURE_CRC32C);
+    ctx->snd_una = ctx->initial_sequence_num + 1;
+  }
+
+  stcp_set_option (sd, MYSO_STREAMS, MAX (ctx->num_streams, 1));
+  stcp_set_option (sd, MYSO_MESSAGES, (ctx->features & FEATURE_MESSAGES) != 0);
+  stcp_set_option (sd, MYSO_FEC, (ctx->features & FEATURE_FEC) != 0);
+  stcp_set_option (sd, MYSO_COMPRESS, \
+                   (ctx->features & FEATURE_COMPRESS) != 0);
+  stcp_set_option (sd, MYSO_CRC32C, (ctx->features & FEATURE_CRC32C) != 0);
+  stcp_set_option (sd, MYSO_FASTPATH, ctx->fast_path);
+  if (ctx->fast_path)
+    stcp_set_checksum (sd, STCP_CHECKSUM_NONE);
+  else if (ctx->features & FEATURE_CRC32C)
+    stcp_set_checksum (sd, STCP_CHECKSUM_CRC32C);
+  else
+    stcp_set_checksum (sd, STCP_CHECKSUM_TCP);
+  return agreed;
+}
+
+/* send_syn : send our SYN; with TFO it carries a cookie request, or the
+ * cached cookie and the first segment of data */
+static void send_syn (mysocket_t sd, context_t *ctx)
+{
+  char opt[2 + TFO_COOKIE_LEN + 4];
+  int opt_len = syn_options (ctx, opt);
+
+  if (ctx->syn_data_size > 0)
+    send_packet_opt (sd, ctx->initial_sequence_num, 0, SYN, opt, opt_len, \
+                     ctx->preack->data, ctx->preack->size);
+  else
+    send_packet_opt (sd, ctx->initial_sequence_num, 0, SYN, opt, opt_len, \
+                     NULL, 0);
+}
+
+/* send_synack : send our SYN-ACK, with a TFO cookie if the peer asked */
+static void send_synack (mysocket_t sd, context_t *ctx)
+{
+  char opt[2 + TFO_COOKIE_LEN + 4];
+  int opt_len = syn_options (ctx, opt);
+
+  send_packet_opt (sd, ctx->initial_sequence_num, ctx->present_ack_num, \
+                   SYNACK, opt, opt_len, NULL, 0);
+}
+
+/* syn_options : options for our SYN(ACK): the TFO cookie (or an empty
+ * one to request a cookie), and the features and streams we want (or, on
+ * a SYN-ACK, agree to) */
+static int syn_options (context_t *ctx, char *opt)
+{
+  int opt_len = 0;
+
+  if (ctx->cookie_len >= 0)
+  {
+    opt[0] = TCPOPT_FASTOPEN;
+    opt[1] = 2 + ctx->cookie_len;
+    memcpy (opt + 2, ctx->cookie, ctx->cookie_len);
+    opt_len = 2 + ctx->cookie_len;
+  }
+  if (ctx->features != 0 || ctx->num_streams > 0)
+  {
+    opt[opt_len++] = TCPOPT_STCP;
+    opt[opt_len++] = 4;
+    opt[opt_len++] = ctx->features;
+    opt[opt_len++] = ctx->num_streams;
+  }
+  return opt_len;
+}
+
+/* tfo_prepare_syn : with a cookie cached for the peer, move the first
+ * segment of data the app queued before myconnect() into the SYN (framed
+ * for the features we ask for); without one, just ask for a cookie */
+static void tfo_prepare_syn (mysocket_t sd, context_t *ctx)
+{
+  struct timespec poll_time = { 0, 0 };   /* already past: don't block */
+  preack_packet *preack;
+
+  ctx->cookie_len = peer_cache_get_cookie (peer_ip (sd), ctx->cookie);
+  if (ctx->cookie_len == 0)
+    return;
+  /* a compressed block couldn't be unpacked if the server said no */
+  if (ctx->features & FEATURE_COMPRESS)
+    return;
+  if (!(stcp_wait_for_event (sd, APP_DATA, &poll_time) & APP_DATA))
+    return;
+
+  preack = (preack_packet *) pool_zalloc (&preack_pool);
+  preack->sequence_num = ctx->initial_sequence_num + 1;
+  preack->msg_start = 1;
+  preack->size = frame_app_data (sd, ctx, preack->data, STCP_MSS);
+  if (preack->size < 0)
+  {
+    pool_free (&preack_pool, preack);
+    return;
+  }
+  ctx->preack = preack;
+  ctx->syn_data_size = preack->size;
+}
+
+/* tfo_reframe : the server didn't take our SYN data, and may have agreed
+ * to less than it was framed for (req_features, req_streams); take out
+ * the headers it won't expect before the data is resent.  data for a
+ * stream the server doesn't have is dropped */
+static void tfo_reframe (context_t *ctx, int req_features, int req_streams)
+{
+  preack_packet *preack = ctx->preack;
+  stream_header header;
+  char *msg_hdr = preack->data + (req_streams > 0 ? STREAM_HDR_LEN : 0);
+  int stream = 0;
+
+  if (req_streams > 0)
+  {
+    memcpy (&header, preack->data, STREAM_HDR_LEN);
+    stream = ntohs (header.stream);
+  }
+  if (stream >= MAX (ctx->num_streams, 1))
+  {
+    pool_free (&preack_pool, preack);
+    ctx->preack = NULL;
+    ctx->syn_data_size = 0;
+    return;
+  }
+
+  if ((req_features & FEATURE_MESSAGES) && \
+      !(ctx->features & FEATURE_MESSAGES))
+  {
+    preack->size -= MSG_HDR_LEN;
+    memmove (msg_hdr, msg_hdr + MSG_HDR_LEN, \
+             preack->size - (msg_hdr - preack->data));
+    ctx->stream_snd_next[stream] -= MSG_HDR_LEN;
+  }
+  if (req_streams > 0 && ctx->num_streams == 0)
+  {
+    preack->size -= STREAM_HDR_LEN;
+    memmove (preack->data, preack->data + STREAM_HDR_LEN, preack->size);
+  }
+  ctx->syn_data_size = preack->size;
+}
+
+/* find_option : look for a TCP option of the given kind; returns a pointer
+ * to it (kind byte first) and its total length, or NULL if absent */
+static const char *find_option (const char *opt, int opt_len, int kind, \
+                                int *len)
+{
+  int i = 0;
+
+  while (i < opt_len && opt[i] != TCPOPT_EOL)
+  {
+    if (opt[i] == TCPOPT_NOP)
+    {
+      i++;
+      continue;
+    }
+    if (i + 1 >= opt_len || (unsigned char) opt[i + 1] < 2 || \
+        i + (unsigned char) opt[i + 1] > opt_len)
+      break;  /* malformed */
+
+    if ((unsigned char) opt[i] == kind)
+    {
+      *len = (unsigned char) opt[i + 1];
+      return opt + i;
+    }
+    i += (unsigned char) opt[i + 1];
+  }
+  return NULL;
+}
+
+/* peer_ip : IP address of the connection's peer (network byte order) */
+static uint32_t peer_ip (mysocket_t sd)
+{
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof (sin);
+
+  memset (&sin, 0, sizeof (sin));
+  if (mygetpeername (sd, (struct sockaddr *) &sin, &sin_len) < 0)
+    return 0;
+  return sin.sin_addr.s_addr;
+}
+
+/* peer_cache_get_cookie : copy out the TFO cookie cached for a server;
+ * returns its length, or 0 if we have none */
+static int peer_cache_get_cookie (uint32_t addr, char *cookie)
+{
+  peer_cache_entry *entry = &peer_cache[addr % PEER_CACHE_SIZE];
+  int len = 0;
+
+  pthread_mutex_lock (&peer_cache_lock);
+  if (addr != 0 && entry->addr == addr)
+  {
+    len = entry->cookie_len;
+    memcpy (cookie, entry->cookie, len);
+  }
+  pthread_mutex_unlock (&peer_cache_lock);
+  return len;
+}
+
+/* peer_cache_put_cookie : remember the TFO cookie a server issued us */
+static void peer_cache_put_cookie (uint32_t addr, const char *cookie)
+{
+  peer_cache_entry *entry = &peer_cache[addr % PEER_CACHE_SIZE];
+
+  if (addr == 0)
+    return;
+  pthread_mutex_lock (&peer_cache_lock);
+  if (entry->addr != addr)
+    memset (entry, 0, sizeof (*entry));
+  entry->addr = addr;
+  entry->cookie_len = TFO_COOKIE_LEN;
+  memcpy (entry->cookie, cookie, TFO_COOKIE_LEN);
+  pthread_mutex_unlock (&peer_cache_lock);
+}
+
+/* peer_cache_get_rtt : smoothed handshake RTT to a peer in microseconds,
+ * or 0 if unknown */
+static long peer_cache_get_rtt (uint32_t addr)
+{
+  peer_cache_entry *entry = &peer_cache[addr % PEER_CACHE_SIZE];
+  long rtt_us = 0;
+
+  pthread_mutex_lock (&peer_cache_lock);
+  if (addr != 0 && entry->addr == addr)
+    rtt_us = entry->rtt_us;
+  pthread_mutex_unlock (&peer_cache_lock);
+  return rtt_us;
+}
+
+/* peer_cache_put_rtt : fold a handshake RTT sample into the peer's
+ * smoothed RTT (gain 1/8, as for SRTT) */
+static void peer_cache_put_rtt (uint32_t addr, long rtt_us)
+{
+  peer_cache_entry *entry = &peer_cache[addr % PEER_CACHE_SIZE];
+
+  if (addr == 0)
+    return;
+  if (rtt_us <= 0)
+    rtt_us = 1;
+  pthread_mutex_lock (&peer_cache_lock);
+  if (entry->addr != addr)
+    memset (entry, 0, sizeof (*entry));
+  entry->addr = addr;
+  if (entry->rtt_us == 0)
+    entry->rtt_us = rtt_us;
+  else
+    entry->rtt_us = (7 * entry->rtt_us + rtt_us) / 8;
+  pthread_mutex_unlock (&peer_cache_lock);
+}
+
+static void tfo_init_secret (void)
+{
+  FILE *urandom = fopen ("/dev/urandom", "rb");
+
+  if (urandom == NULL)
+    return;
+  tfo_have_secret = (fread (tfo_secret, sizeof (tfo_secret), 1, urandom) \
+                     == 1);
+  fclose (urandom);
+}
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v) \
+  do { \
+    v[0] += v[1]; v[1] = ROTL64 (v[1], 13); v[1] ^= v[0]; \
+    v[0] = ROTL64 (v[0], 32); \
+    v[2] += v[3]; v[3] = ROTL64 (v[3], 16); v[3] ^= v[2]; \
+    v[0] += v[3]; v[3] = ROTL64 (v[3], 21); v[3] ^= v[0]; \
+    v[2] += v[1]; v[1] = ROTL64 (v[1], 17); v[1] ^= v[2]; \
+    v[2] = ROTL64 (v[2], 32); \
+  } while (0)
+
+/* siphash24 : SipHash-2-4 of a single 64-bit word m under a 128-bit key
+ * (a message of 8 bytes, so the length byte of the last word is 8) */
+static uint64_t siphash24 (const uint64_t key[2], uint64_t m)
+{
+  uint64_t v[4], b = (uint64_t) 8 << 56;
+  int k;
+
+  v[0] = key[0] ^ 0x736f6d6570736575ULL;
+  v[1] = key[1] ^ 0x646f72616e646f6dULL;
+  v[2] = key[0] ^ 0x6c7967656e657261ULL;
+  v[3] = key[1] ^ 0x7465646279746573ULL;
+
+  v[3] ^= m;
+  SIPROUND (v);
+  SIPROUND (v);
+  v[0] ^= m;
+
+  v[3] ^= b;
+  SIPROUND (v);
+  SIPROUND (v);
+  v[0] ^= b;
+
+  v[2] ^= 0xff;
+  for (k = 0; k < 4; k++)
+    SIPROUND (v);
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/* tfo_make_cookie : the cookie we issue to (and expect back from) a client
+ * is a MAC of its address (SipHash-2-4, keyed with tfo_secret).  returns
+ * -1 if we have no key, and so issue no cookies */
+static int tfo_make_cookie (uint32_t addr, char *cookie)
+{
+  uint64_t mac;
+
+  pthread_once (&tfo_secret_once, tfo_init_secret);
+  if (!tfo_have_secret)
+    return -1;
+  mac = siphash24 (tfo_secret, addr);
+  memcpy (cookie, &mac, TFO_COOKIE_LEN);
+  return 0;
+}
+
 /**********************************************************************/
 /* our_dprintf
  *